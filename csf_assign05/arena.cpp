@@ -0,0 +1,54 @@
+#include <cstring>
+#include <utility>
+#include "arena.h"
+
+Arena::Arena()
+  : m_next( nullptr )
+  , m_left( 0 )
+  , m_chunk_size( FIRST_CHUNK_SIZE )
+  , m_allocated( 0 )
+  , m_released( 0 )
+{ }
+
+Arena::~Arena()
+{
+  for (auto it = m_chunks.begin(); it != m_chunks.end(); it++) { delete[] *it; }
+}
+
+std::string_view Arena::copy( std::string_view bytes )
+{
+  if (bytes.empty()) { return std::string_view(); }
+  m_allocated += bytes.size();
+
+  // Bytes too large to share a chunk get a chunk of their own, behind the current one
+  if (bytes.size() > CHUNK_SIZE / 4) {
+    char *chunk = new char[bytes.size()];
+    memcpy(chunk, bytes.data(), bytes.size());
+    m_chunks.insert(m_chunks.empty() ? m_chunks.end() : m_chunks.end() - 1, chunk);
+    return std::string_view(chunk, bytes.size());
+  }
+
+  if (bytes.size() > m_left) {
+    while (m_chunk_size < bytes.size()) { m_chunk_size *= 2; }
+    m_next = new char[m_chunk_size];
+    m_left = m_chunk_size;
+    m_chunks.push_back(m_next);
+    if (m_chunk_size < CHUNK_SIZE) { m_chunk_size *= 2; }
+  }
+
+  char *copy = m_next;
+  memcpy(copy, bytes.data(), bytes.size());
+  m_next += bytes.size();
+  m_left -= bytes.size();
+  return std::string_view(copy, bytes.size());
+}
+
+void Arena::swap( Arena &other )
+{
+  std::swap(m_chunks, other.m_chunks);
+  std::swap(m_next, other.m_next);
+  std::swap(m_left, other.m_left);
+  std::swap(m_chunk_size, other.m_chunk_size);
+  std::swap(m_allocated, other.m_allocated);
+  std::swap(m_released, other.m_released);
+}
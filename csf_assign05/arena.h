@@ -0,0 +1,53 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+/*
+ * Bump allocator holding the bytes of a table stripe's keys and values. Bytes are
+ * copied into chunks that grow from small to CHUNK_SIZE, so a stripe with few keys stays
+ * small, and a SET costs no allocation of its own once a chunk has room. Bytes are never
+ * freed one at a time: release only counts them, and the owner compacts the arena by
+ * copying what is still live into a new one once enough has been released.
+ */
+class Arena {
+private:
+  std::vector<char *> m_chunks;
+
+  /* Free space at the end of the current chunk. */
+  char *m_next;
+  size_t m_left;
+
+  /* Size of the next chunk to allocate. */
+  size_t m_chunk_size;
+
+  size_t m_allocated;
+  size_t m_released;
+
+  // copy constructor and assignment operator are prohibited
+  Arena( const Arena & );
+  Arena &operator=( const Arena & );
+
+public:
+  static const size_t FIRST_CHUNK_SIZE = 256;
+  static const size_t CHUNK_SIZE = 64 * 1024;
+
+  Arena();
+  ~Arena();
+
+  /* Copies bytes into the arena, and returns the copy. */
+  std::string_view copy( std::string_view bytes );
+
+  /* Records that a copy is no longer used. */
+  void release( std::string_view bytes ) { m_released += bytes.size(); }
+
+  size_t get_live_bytes() const { return m_allocated - m_released; }
+  size_t get_released_bytes() const { return m_released; }
+
+  /* Exchanges contents with another arena (the new one, after compacting). */
+  void swap( Arena &other );
+};
+
+#endif // ARENA_H
@@ -1,9 +1,11 @@
 #include <iostream>
 #include <cassert>
+#include <cstring>
 #include "csapp.h"
 #include "message.h"
 #include "message_serialization.h"
 #include "server.h"
+#include "wal.h"
 #include "exceptions.h"
 #include "client_connection.h"
 
@@ -13,56 +15,524 @@ ClientConnection::ClientConnection( Server *server, int client_fd )
   : m_server( server )
   , m_client_fd( client_fd )
   , in_transaction(false)
-  , loop_in_progress(true)  {
+  , loop_in_progress(true)
+  , first_valid_message(true)
+  , m_connected_at(std::chrono::steady_clock::now())
+  , m_last_activity(m_connected_at)
+  , m_loop_slot(-1)
+  , m_shard(nullptr)
+  , m_pending(0)
+  , m_txn(0)
+  , m_peer_closed(false)
+  , m_resume_point(nullptr)
+  , m_waiting(Wait::NONE)
+  , m_held_table(nullptr)
+  , m_held_stripe(0)
+  , m_event_loop(false)
+  , m_commit_pending(false)
+  , m_commit_end(0)
+  , m_commit_table(nullptr)
+  , m_commit_stripe(0)  {
     
   rio_readinitb( &m_fdbuf, m_client_fd );
 }
 
 
 ClientConnection::~ClientConnection() {
+  close_connection();
+}
+
+
+void ClientConnection::reset( int client_fd ) {
+  m_client_fd = client_fd;
+  rio_readinitb( &m_fdbuf, m_client_fd );
+  stack.clear();
+  locked_tables.clear();
+  in_transaction = false;
+  loop_in_progress = true;
+  first_valid_message = true;
+  m_inbuf.clear();
+  m_output.clear();
+  m_connected_at = std::chrono::steady_clock::now();
+  m_last_activity = m_connected_at;
+  m_loop_slot = -1;
+  m_shard = nullptr;
+  m_pending = 0;
+  m_txn = 0;
+  m_peer_closed = false;
+  m_session = Task();
+  m_resume_point = nullptr;
+  m_waiting = Wait::NONE;
+  m_held_table = nullptr;
+  m_held_stripe = 0;
+  for (unsigned i = 0; i < TABLE_CACHE_SIZE; i++) { m_table_cache[i] = CachedTable(); }
+  m_event_loop = false;
+  m_commit_pending = false;
+  m_commit_end = 0;
+  m_commit_table = nullptr;
+  m_commit_stripe = 0;
+  m_commit_key.clear();
+
+  // m_log_record is cleared before each use, and keeps its buffer for the next client
+}
+
 
+void ClientConnection::close_connection() {
+
+  // A commit already in the log is applied, even though its answer can no longer be sent
+  if (m_commit_pending) {
+    finish_commit(false);
+  }
   if (in_transaction) {
     fail_transaction();
   }
+  if (m_client_fd >= 0) {
+    close(m_client_fd);
+    m_client_fd = -1;
+    m_server->release_client();
+  }
 }
 
 
 void ClientConnection::chat_with_client() {
-  bool first_valid_message = true;
-  Message client_msg;
-  char buf[client_msg.MAX_ENCODED_LEN];
+  char buf[Message::MAX_ENCODED_LEN];
+
+  // A blocked read gives up once the client has been silent for the current timeout
+  int timeout = current_timeout();
+  if (timeout > 0) { set_receive_timeout(timeout); }
 
   while (loop_in_progress) {
-    ssize_t n = rio_readlineb(&m_fdbuf, buf, sizeof(m_fdbuf));
+    ssize_t n = rio_readlineb(&m_fdbuf, buf, sizeof(buf));
 
     // If nothing is read from the client
-    if (n <= 0) { loop_in_progress = false; }
+    if (n <= 0) {
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { m_output.append(OutputBuffer::FixedResponse::TIMED_OUT); }
+      loop_in_progress = false;
+    }
     else {
-      try { decode(buf, client_msg); } 
-      catch (InvalidMessage const& ex) { 
-        manage_exception(ex, false);
-        continue; 
+      process_line(std::string_view(buf, n));
+
+      // Logging in switches from the LOGIN timeout to the idle timeout
+      if (current_timeout() != timeout) {
+        timeout = current_timeout();
+        set_receive_timeout(timeout);
       }
-      
-      // If the Message is a login
-      if (client_msg.get_message_type() == MessageType::LOGIN) {
-        try { handle_login(&first_valid_message); }
-        catch (OperationException const& ex) { manage_exception(ex, true); }
-        continue;
-        // If the Message isn't a login but is the first valid Message
-      } else if (first_valid_message) {
-        Message error_msg (MessageType::ERROR, { "Please log in first." });
-        std::string encoded_error;
-        encode(error_msg, encoded_error);
-        rio_writen(m_client_fd, encoded_error.data(), encoded_error.size());
-        loop_in_progress = false;
-        continue;
+
+      // Responses to pipelined requests are sent together, in order, once no complete request is left
+      if (!has_buffered_line()) { flush_output(); }
+    }
+  }
+
+  flush_output();
+}
+
+
+bool ClientConnection::on_readable() {
+  char buf[Message::MAX_ENCODED_LEN];
+  bool peer_closed = false;
+
+  // Edge-triggered notifications require reading until the socket is drained
+  while (1) {
+    ssize_t n = read(m_client_fd, buf, sizeof(buf));
+    if (n > 0) {
+      m_inbuf.append(buf, n);
+      m_last_activity = std::chrono::steady_clock::now();
+    }
+    else if (n < 0 && errno == EINTR) { continue; }
+    else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+    else {
+      peer_closed = true;
+      break;
+    }
+  }
+
+  process_input();
+
+  // A partial line left by a client that hung up is handled like rio_readlineb would,
+  // once no answer from a shard is awaited
+  if (peer_closed && m_pending > 0) { m_peer_closed = true; }
+  else if (peer_closed) { on_eof(); }
+
+  // The responses of a batch go out together, once no request waits for a table's lock or the
+  // log, so a small first part does not wait for the client's ACK
+  bool socket_ok = is_waiting_to_retry() || flush_output_nonblocking();
+
+  // A shard's answer must find the connection, so it is kept until then. Requests waiting
+  // for a table's lock or the log are handled once the loop retries them.
+  if (m_pending > 0 || is_waiting_to_retry()) { return true; }
+  if (!socket_ok || peer_closed) { return false; }
+
+  // Keep the connection until the final responses have been written
+  return loop_in_progress || !m_output.empty();
+}
+
+
+bool ClientConnection::on_writable() {
+  if (is_waiting_to_retry()) { return true; }
+  if (!flush_output_nonblocking() && m_pending == 0) { return false; }
+
+  return loop_in_progress || !m_output.empty() || m_pending > 0;
+}
+
+
+bool ClientConnection::on_shard_answer( ShardMessage &answer ) {
+  m_pending--;
+
+  // A COMMIT is answered once every shard the transaction used has committed
+  if (answer.op != ShardMessage::Op::COMMIT) { apply_shard_answer(answer); }
+  else if (m_pending == 0) { write_ok(); }
+
+  if (m_pending == 0) {
+    process_input();
+    if (m_peer_closed) { on_eof(); }
+  }
+
+  bool socket_ok = flush_output_nonblocking();
+  if (m_pending > 0) { return true; }
+  if (!socket_ok || m_peer_closed) { return false; }
+
+  return loop_in_progress || !m_output.empty();
+}
+
+
+void ClientConnection::process_line(std::string_view line) {
+  MessageView client_msg;
+
+  try { decode_view(line, client_msg); } 
+  catch (InvalidMessage const& ex) { 
+    manage_exception(ex, false);
+    return; 
+  }
+
+  process_message(client_msg);
+}
+
+
+void ClientConnection::process_message(const MessageView &client_msg) {
+  
+  // If the Message is a login
+  if (client_msg.get_message_type() == MessageType::LOGIN) {
+    try { handle_login(&first_valid_message); }
+    catch (OperationException const& ex) { manage_exception(ex, true); }
+    return;
+    // If the Message isn't a login but is the first valid Message
+  } else if (first_valid_message) {
+    m_output.append(OutputBuffer::FixedResponse::NOT_LOGGED_IN);
+    loop_in_progress = false;
+    return;
+  }
+
+  call_response_function(client_msg);
+}
+
+
+void ClientConnection::on_data( const char *data, size_t len ) {
+  m_inbuf.append(data, len);
+  m_last_activity = std::chrono::steady_clock::now();
+  process_input();
+}
+
+
+void ClientConnection::on_retry() {
+  if (m_peer_closed) { on_eof(); }
+  else { process_input(); }
+}
+
+
+void ClientConnection::on_eof() {
+  // The partial line left by the client counts as complete, and the connection finishes once
+  // no request is left waiting for a table's lock or the log
+  m_peer_closed = true;
+  process_input();
+  if (!is_waiting_to_retry()) { loop_in_progress = false; }
+}
+
+
+bool ClientConnection::check_timeout( std::chrono::steady_clock::time_point now ) {
+  int timeout = current_timeout();
+  if (!loop_in_progress || timeout <= 0) { return false; }
+
+  // The LOGIN timeout counts from the connection, the idle timeout from the last data received
+  bool awaiting_login = first_valid_message && m_server->get_login_timeout() > 0;
+  std::chrono::steady_clock::time_point since = awaiting_login ? m_connected_at : m_last_activity;
+  if (now - since < std::chrono::seconds(timeout)) { return false; }
+
+  m_output.append(OutputBuffer::FixedResponse::TIMED_OUT);
+  loop_in_progress = false;
+  return true;
+}
+
+
+int ClientConnection::current_timeout() const {
+  // Without a LOGIN timeout, the idle timeout also applies before the client logs in
+  if (first_valid_message && m_server->get_login_timeout() > 0) { return m_server->get_login_timeout(); }
+  return m_server->get_idle_timeout();
+}
+
+
+void ClientConnection::set_receive_timeout(int seconds) {
+  timeval tv;
+  tv.tv_sec = seconds;
+  tv.tv_usec = 0;
+  setsockopt(m_client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+
+void ClientConnection::take_output( std::string &out ) {
+  m_output.take(out);
+}
+
+
+bool ClientConnection::next_line(size_t &line_start, std::string_view &line, bool at_eof) {
+  size_t newline = m_inbuf.find('\n', line_start);
+
+  // Overlong lines are cut off at the maximum length, as rio_readlineb would do
+  if (newline == std::string::npos) {
+    if (at_eof && line_start < m_inbuf.size()) { newline = m_inbuf.size() - 1; }
+    else if (m_inbuf.size() - line_start < Message::MAX_ENCODED_LEN - 1) { return false; }
+    else { newline = line_start + Message::MAX_ENCODED_LEN - 2; }
+  }
+
+  line = std::string_view(m_inbuf).substr(line_start, newline - line_start + 1);
+  line_start = newline + 1;
+  return true;
+}
+
+
+void ClientConnection::process_input() {
+  size_t line_start = 0;
+  std::string_view line;
+  m_waiting = Wait::NONE;
+
+  // Nothing else is handled before the commit is answered
+  if (m_commit_pending && !finish_commit(true)) {
+    m_waiting = Wait::LOG;
+    return;
+  }
+
+  // Requests wait while a shard has yet to answer, since their results depend on that answer.
+  // Lines are decoded in place, so m_inbuf must not change until they are handled.
+  while (loop_in_progress && m_pending == 0 && next_line(line_start, line, m_peer_closed)) {
+    MessageView client_msg;
+    bool valid = true;
+    try { decode_view(line, client_msg); }
+    catch (InvalidMessage const& ex) {
+      manage_exception(ex, false);
+      valid = false;
+    }
+    if (!valid) { continue; }
+
+    // An event loop must not block on a table's lock, so an autocommit GET or SET whose stripe
+    // is taken stays in the input buffer, along with the requests after it, until the loop
+    // retries it with on_retry
+    Table *table = autocommit_table(client_msg);
+    if (table != nullptr) {
+      bool shared = client_msg.get_message_type() == MessageType::GET;
+      unsigned stripe = table->get_stripe(client_msg.get_hashed_key());
+      if (!table->trylock_stripe(stripe, shared)) {
+        line_start -= line.size();
+        m_waiting = Wait::LOCK;
+        break;
       }
+      m_held_table = table;
+      m_held_stripe = stripe;
+    }
+
+    process_message(client_msg);
+
+    // A request that failed before using the table leaves its lock behind
+    if (m_held_table != nullptr) {
+      m_held_table->unlock_stripe(m_held_stripe);
+      m_held_table = nullptr;
+    }
+
+    // A commit whose record is not yet durable is answered once the loop retries it
+    if (m_commit_pending && !finish_commit(true)) {
+      m_waiting = Wait::LOG;
+      break;
+    }
+  }
+
+  m_inbuf.erase(0, line_start);
+}
+
+
+void ClientConnection::start_session() {
+  m_session = session();
+  m_resume_point = m_session.handle();
+  m_waiting = Wait::IO;
+}
+
+
+bool ClientConnection::resume_session() {
+  m_waiting = Wait::NONE;
+  std::coroutine_handle<> resume_point = m_resume_point;
+  m_resume_point = nullptr;
+  Task::run(resume_point);
+
+  return !m_session.done();
+}
+
+
+Task ClientConnection::session() {
+  while (loop_in_progress) {
+    co_await read_input();
+    co_await process_input_async();
+    if (m_peer_closed) { loop_in_progress = false; }
+
+    // Responses to every request of the batch go out together
+    co_await write_output();
+  }
+}
+
+
+Task ClientConnection::read_input() {
+  size_t line_start = 0;
+  std::string_view line;
+
+  while (loop_in_progress && !m_peer_closed && !next_line(line_start, line)) {
+    // Reading straight into m_inbuf keeps the buffer out of the coroutine frame
+    size_t old_size = m_inbuf.size();
+    m_inbuf.resize(old_size + Message::MAX_ENCODED_LEN);
+    ssize_t n = read(m_client_fd, &m_inbuf[old_size], Message::MAX_ENCODED_LEN);
+    m_inbuf.resize(old_size + (n > 0 ? n : 0));
+
+    if (n > 0) { m_last_activity = std::chrono::steady_clock::now(); }
+    else if (n < 0 && errno == EINTR) { continue; }
+    else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { co_await Suspend{ this, Wait::IO }; }
+    else { m_peer_closed = true; }
+  }
+}
+
 
-      call_response_function(client_msg);
+Task ClientConnection::process_input_async() {
+  size_t line_start = 0;
+  std::string_view line;
+
+  while (loop_in_progress && next_line(line_start, line, m_peer_closed)) {
+    MessageView client_msg;
+    bool valid = true;
+    try { decode_view(line, client_msg); }
+    catch (InvalidMessage const& ex) {
+      manage_exception(ex, false);
+      valid = false;
+    }
+    if (!valid) { continue; }
+
+    // An autocommit GET or SET waits for its table here, where waiting does not block the thread
+    Table *table = autocommit_table(client_msg);
+    if (table != nullptr) {
+      bool shared = client_msg.get_message_type() == MessageType::GET;
+      co_await lock_table(table, table->get_stripe(client_msg.get_hashed_key()), shared);
     }
+
+    process_message(client_msg);
+
+    // A request that failed before using the table leaves its lock behind
+    if (m_held_table != nullptr) {
+      m_held_table->unlock_stripe(m_held_stripe);
+      m_held_table = nullptr;
+    }
+
+    // The session waits for its commit's record to be durable without blocking the thread
+    while (m_commit_pending && !finish_commit(true)) { co_await Suspend{ this, Wait::LOG }; }
   }
-  close(m_client_fd);
+
+  m_inbuf.erase(0, line_start);
+}
+
+
+Task ClientConnection::write_output() {
+  while (!m_output.empty()) {
+    if (!flush_output_nonblocking()) {
+      loop_in_progress = false;
+      m_output.clear();
+    }
+    if (!m_output.empty()) { co_await Suspend{ this, Wait::IO }; }
+  }
+}
+
+
+Task ClientConnection::lock_table(Table *table, unsigned stripe, bool shared) {
+  while (!table->trylock_stripe(stripe, shared)) { co_await Suspend{ this, Wait::LOCK }; }
+  m_held_table = table;
+  m_held_stripe = stripe;
+}
+
+
+Table *ClientConnection::autocommit_table(const MessageView &client_msg) {
+  MessageType type = client_msg.get_message_type();
+  if (in_transaction || first_valid_message || m_shard != nullptr ||
+      (type != MessageType::GET && type != MessageType::SET)) {
+    return nullptr;
+  }
+
+  return resolve_table(client_msg.get_hashed_table());
+}
+
+
+Table *ClientConnection::resolve_table(const HashedKey &name) {
+  CachedTable &cached = m_table_cache[name.hash % TABLE_CACHE_SIZE];
+  if (cached.table != nullptr && cached.hash == name.hash && cached.name == name.key) { return cached.table; }
+
+  // A missing table is not cached, as a CREATE may add it at any time
+  Table *table = m_server->find_table(name);
+  if (table != nullptr) {
+    cached.name = name.key;
+    cached.hash = name.hash;
+    cached.table = table;
+  }
+  return table;
+}
+
+
+void ClientConnection::lock_for_autocommit(Table *table, unsigned stripe, bool shared) {
+  if (m_held_table == table) {
+    m_held_table = nullptr;
+    return;
+  }
+  table->lock_stripe(stripe, shared);
+}
+
+
+void ClientConnection::flush_output() {
+  // Unlike write, send with MSG_NOSIGNAL fails instead of raising SIGPIPE once the client is gone
+  size_t written = 0;
+  while (written < m_output.size()) {
+    ssize_t n = send(m_client_fd, m_output.data() + written, m_output.size() - written, MSG_NOSIGNAL);
+    if (n > 0) { written += n; }
+    else if (n < 0 && errno == EINTR) { continue; }
+    else { break; }
+  }
+  m_output.clear();
+}
+
+
+bool ClientConnection::has_buffered_line() {
+
+  // A client sending one request at a time is not charged an extra read per request
+  if (m_fdbuf.rio_cnt == 0 && m_output.get_num_responses() > 1) {
+    ssize_t n = recv(m_client_fd, m_fdbuf.rio_buf, sizeof(m_fdbuf.rio_buf), MSG_DONTWAIT);
+    if (n > 0) {
+      m_fdbuf.rio_cnt = n;
+      m_fdbuf.rio_bufptr = m_fdbuf.rio_buf;
+    }
+  }
+
+  return m_fdbuf.rio_cnt > 0 && memchr(m_fdbuf.rio_bufptr, '\n', m_fdbuf.rio_cnt) != nullptr;
+}
+
+
+bool ClientConnection::flush_output_nonblocking() {
+  while (!m_output.empty()) {
+    ssize_t n = send(m_client_fd, m_output.data(), m_output.size(), MSG_NOSIGNAL);
+    if (n > 0) { m_output.consume(n); }
+    else if (n < 0 && errno == EINTR) { continue; }
+    else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+    else { return false; }
+  }
+
+  return true;
 }
 
 
@@ -79,20 +549,33 @@ void ClientConnection::manage_exception (std::runtime_error ex, bool recoverable
   // Assign a MessageType to the server's response to the client
   MessageType response_type = (recoverable) ? MessageType::FAILED : MessageType::ERROR;
 
-  // Finish creating and encode the Message
-  Message response (response_type, { ex.what() });
-  std::string encoded_response;
-  encode(response, encoded_response);
-
-  // Send the Message
-  rio_writen(m_client_fd, encoded_response.data(), encoded_response.size());
+  // Encode the exception's text straight into the output buffer
+  m_output.append_failure(response_type, ex.what());
 }
 
 
 void ClientConnection::fail_transaction() {
+  // Rollbacks are not answered, and reach each shard before any later request of this connection
+  if (m_shard != nullptr) {
+    for (auto it = locked_tables.begin(); it != locked_tables.end(); it++) {
+      ShardMessage msg = shard_message(ShardMessage::Op::ROLLBACK, it->first->get_name());
+      msg.client = nullptr;
+      msg.table_obj = it->first;
+      m_shard->submit(msg);
+    }
+    locked_tables.clear();
+    in_transaction = false;
+    return;
+  }
+
+  // Only a table the transaction could write to has changes to roll back
   for (auto it = locked_tables.begin(); it != locked_tables.end(); it++) {
-    (*it)->rollback_changes();
-    (*it)->unlock();
+    if (it->second) {
+      it->first->rollback_changes();
+      it->first->unlock();
+    } else {
+      it->first->unlock_shared();
+    }
   }
 
   locked_tables.clear();
@@ -100,7 +583,7 @@ void ClientConnection::fail_transaction() {
 }
 
 
-void ClientConnection::call_response_function(Message client_msg) {
+void ClientConnection::call_response_function(const MessageView &client_msg) {
   MessageType response_type = client_msg.get_message_type();
   
   try {
@@ -158,21 +641,19 @@ void ClientConnection::call_response_function(Message client_msg) {
 }
 
 
-void ClientConnection::handle_create(Message client_msg) {
+void ClientConnection::handle_create(const MessageView &client_msg) {
 
-  m_server->lock();
-  std::string table_name = client_msg.get_arg(0);
+  if (m_shard != nullptr) {
+    ShardMessage msg = shard_message(ShardMessage::Op::CREATE, std::string(client_msg.get_table()));
+    forward_to_shard(msg);
+    return;
+  }
 
   // If the table's name is already in the server's map of tables
-  if (m_server->find_table(table_name) != nullptr) {
-    m_server->unlock();
+  if (!m_server->create_table(std::string(client_msg.get_table()))) {
     throw OperationException("A table with this name already exists.");
   }
-
-  m_server->create_table(table_name);
   write_ok();
-
-  m_server->unlock();
 }
 
 
@@ -194,6 +675,7 @@ void ClientConnection::handle_begin() {
   }
 
   in_transaction = true;
+  if (m_shard != nullptr) { m_txn = m_shard->new_transaction(); }
   write_ok();
 }
 
@@ -204,15 +686,93 @@ void ClientConnection::handle_commit() {
     throw FailedTransaction("Transaction is not ongoing.");
   }
 
-  // Otherwise, commit all changes and unlock used tables.
+  // Every shard the transaction used commits its tables
+  if (m_shard != nullptr) {
+    in_transaction = false;
+    for (auto it = locked_tables.begin(); it != locked_tables.end(); it++) {
+      ShardMessage msg = shard_message(ShardMessage::Op::COMMIT, it->first->get_name());
+      msg.table_obj = it->first;
+      if (!m_shard->submit(msg)) { m_pending++; }
+    }
+    locked_tables.clear();
+    if (m_pending == 0) { write_ok(); }
+    return;
+  }
+
+  // The changes to every table are logged as one record, so they are recovered together or not at all.
+  // If that fails, the transaction fails and rolls back.
+  if (WriteAheadLog *log = m_server->get_log()) {
+    m_log_record.clear();
+    for (auto it = locked_tables.begin(); it != locked_tables.end(); it++) {
+      if (!it->second) { continue; }
+      std::string table_name = it->first->get_name();
+      it->first->for_each_proposed([this, &table_name]( std::string_view key, std::string_view value ) {
+        WriteAheadLog::append_set(m_log_record, table_name, key, value);
+      });
+    }
+    // An event loop's connection keeps its tables locked until the record is durable
+    if (!m_log_record.empty() && log_commit(log)) {
+      m_commit_table = nullptr;
+      return;
+    }
+  }
+
+  // Then commit all changes and unlock used tables.
+  commit_transaction();
+  write_ok();
+}
+
+
+void ClientConnection::commit_transaction() {
   for (auto it = locked_tables.begin(); it != locked_tables.end(); it++) {
-    (*it)->commit_changes();
-    (*it)->unlock();
+    if (it->second) {
+      it->first->commit_changes();
+      it->first->unlock();
+    } else {
+      it->first->unlock_shared();
+    }
   }
   locked_tables.clear();
   in_transaction = false;
+}
+
+
+bool ClientConnection::log_commit(WriteAheadLog *log) {
+  if (!m_event_loop) {
+    log->commit(m_log_record);
+    return false;
+  }
+
+  m_commit_end = log->commit_async(m_log_record);
+  m_commit_pending = true;
+  return true;
+}
+
+
+bool ClientConnection::finish_commit(bool wait) {
+  bool durable;
+  try { durable = m_server->get_log()->is_durable(m_commit_end); }
+  catch (OperationException const& ex) {
+    // The commit fails as it would have in log->commit, which rolls back a transaction
+    m_commit_pending = false;
+    if (m_commit_table != nullptr) { m_commit_table->unlock_stripe(m_commit_stripe); }
+    manage_exception(ex, true);
+    return true;
+  }
+  if (!durable && wait) { return false; }
+
+  m_commit_pending = false;
+  if (m_commit_table != nullptr) {
+    m_commit_table->set(m_commit_key, stack.get_top());
+    stack.pop();
+    m_commit_table->commit_stripe(m_commit_stripe);
+    m_commit_table->unlock_stripe(m_commit_stripe);
+  } else {
+    commit_transaction();
+  }
 
   write_ok();
+  return true;
 }
 
 
@@ -231,14 +791,8 @@ void ClientConnection::handle_top() {
   try { top_value = stack.get_top(); }
   catch (OperationException const& ex) { throw OperationException(ex.what()); }
 
-  // Create DATA Message
-  Message data_msg(MessageType::DATA);
-  data_msg.push_arg(top_value);
-
-  // Encode and send data Message
-  std::string encoded_data;
-  encode(data_msg, encoded_data);
-  rio_writen(m_client_fd, encoded_data.data(), encoded_data.size());
+  // Encode and send DATA Message
+  m_output.append_data(top_value);
 }
 
 
@@ -348,35 +902,73 @@ void ClientConnection::handle_bye() {
 }
 
 
-void ClientConnection::handle_push(Message client_msg) {
-  stack.push(client_msg.get_arg(0));
+void ClientConnection::handle_push(const MessageView &client_msg) {
+  // The value outlives the request, so the stack keeps its own copy
+  stack.push(std::string(client_msg.get_value()));
   write_ok();
 }
 
 
-void ClientConnection::handle_set(Message client_msg) {
+void ClientConnection::handle_set(const MessageView &client_msg) {
 
   if (stack.get_size() < 1) { throw OperationException("No value on stack."); }
 
-  std::string table_name = client_msg.get_arg(0);
-  Table* table_obj = m_server->find_table(table_name);
+  // The value is only popped once the table's shard has stored it
+  if (m_shard != nullptr) {
+    ShardMessage msg = shard_message(ShardMessage::Op::SET, std::string(client_msg.get_table()));
+    msg.key = client_msg.get_key();
+    msg.value = stack.get_top();
+    forward_to_shard(msg);
+    return;
+  }
+
+  Table* table_obj = resolve_table(client_msg.get_hashed_table());
   
   if (table_obj == nullptr) { throw OperationException("Could not find table."); }
 
-  // During atomic operations where it is confirmed that the table exists
+  // During atomic operations where it is confirmed that the table exists, only the key's stripe is locked
   if (!in_transaction) {
-    table_obj->lock();
+    unsigned stripe = table_obj->get_stripe(client_msg.get_hashed_key());
+    lock_for_autocommit(table_obj, stripe, false);
+
+    // The change is logged while the stripe is locked, so the log orders SETs of a key as they commit
+    if (WriteAheadLog *log = m_server->get_log()) {
+      m_log_record.clear();
+      WriteAheadLog::append_set(m_log_record, client_msg.get_table(), client_msg.get_key(), stack.get_top());
+      bool deferred;
+      try { deferred = log_commit(log); }
+      catch (OperationException const& ex) {
+        table_obj->unlock_stripe(stripe);
+        throw;
+      }
+
+      // Until the record is durable, the stripe stays locked so no one sees the new value
+      if (deferred) {
+        m_commit_table = table_obj;
+        m_commit_stripe = stripe;
+        m_commit_key.assign(client_msg.get_key());
+        return;
+      }
+    }
     set_table_value(client_msg, table_obj);
-    table_obj->commit_changes();
-    table_obj->unlock();
+    table_obj->commit_stripe(stripe);
+    table_obj->unlock_stripe(stripe);
 
   // During transactions
   } else {
-    // If the lock isn't held yet, try to acquire it.
-    if (locked_tables.find(table_obj) == locked_tables.end()) {
+    // If the lock isn't held yet, try to acquire it. If a GET took it shared, try to upgrade it.
+    auto locked = locked_tables.find(table_obj);
+    if (locked == locked_tables.end()) {
       bool lock_successful = table_obj->trylock();
       if (!lock_successful) { throw FailedTransaction("Could not gain access to table."); }
-      else { locked_tables.insert(table_obj); }
+      else { locked_tables[table_obj] = true; }
+    } else if (!locked->second) {
+      if (!table_obj->try_upgrade()) {
+        // A failed upgrade leaves the table unlocked
+        locked_tables.erase(locked);
+        throw FailedTransaction("Could not gain access to table.");
+      }
+      locked->second = true;
     }
     // If the lock is being held
     set_table_value(client_msg, table_obj);
@@ -385,38 +977,43 @@ void ClientConnection::handle_set(Message client_msg) {
 }
 
 
-void ClientConnection::set_table_value(Message client_msg, Table* table_obj) {
-  std::string key = client_msg.get_arg(1);
-
+void ClientConnection::set_table_value(const MessageView &client_msg, Table* table_obj) {
     // Set the new value to the table (as a suggestion during transactions), and pop it
-    table_obj->set(key, stack.get_top());
+    table_obj->set(client_msg.get_hashed_key(), stack.get_top());
     stack.pop(); 
 }
 
 
-void ClientConnection::handle_get(Message client_msg) {
-  std::string table_name = client_msg.get_arg(0);
-  Table* table_obj = m_server->find_table(table_name);
+void ClientConnection::handle_get(const MessageView &client_msg) {
+
+  if (m_shard != nullptr) {
+    ShardMessage msg = shard_message(ShardMessage::Op::GET, std::string(client_msg.get_table()));
+    msg.key = client_msg.get_key();
+    forward_to_shard(msg);
+    return;
+  }
+  Table* table_obj = resolve_table(client_msg.get_hashed_table());
   
   if (table_obj == nullptr) { throw OperationException("Could not find table."); }
   
-  // During atomic operations where it is confirmed that the table exists
+  // During atomic operations where it is confirmed that the table exists, only the key's stripe is locked
   if (!in_transaction) {
-    table_obj->lock();
+    unsigned stripe = table_obj->get_stripe(client_msg.get_hashed_key());
+    lock_for_autocommit(table_obj, stripe, true);
     try { get_table_value(client_msg, table_obj); }
     catch (OperationException const& ex) { 
-      table_obj->unlock();
+      table_obj->unlock_stripe(stripe);
       throw OperationException(ex.what()); 
     }
-    table_obj->unlock();
+    table_obj->unlock_stripe(stripe);
 
   // During transactions
   } else {
-    // If the lock isn't held yet
+    // If the lock isn't held yet, reading only needs shared access
     if (locked_tables.find(table_obj) == locked_tables.end()) {
-      bool lock_successful = table_obj->trylock();
+      bool lock_successful = table_obj->trylock_shared();
       if (!lock_successful) { throw FailedTransaction("Could not gain access to table."); }
-      else { locked_tables.insert(table_obj); }
+      else { locked_tables[table_obj] = false; }
     }
     // If the lock is being held
     try { get_table_value(client_msg, table_obj); }
@@ -426,24 +1023,55 @@ void ClientConnection::handle_get(Message client_msg) {
 }
 
 
-void ClientConnection::get_table_value(Message client_msg, Table* table_obj) {
-  std::string key = client_msg.get_arg(1);
-
-  if (!table_obj->has_key(key)) {
-      table_obj->unlock();
+void ClientConnection::get_table_value(const MessageView &client_msg, Table* table_obj) {
+  // The caller releases the table's lock
+  std::string_view value;
+  if (!table_obj->find(client_msg.get_hashed_key(), value)) {
       throw OperationException("Could not find key in specified table.");
   } 
-  else { stack.push(table_obj->get(key)); }
+  else { stack.push(std::string(value)); }
 }
 
 
 void ClientConnection::write_ok() {
-  // Create OK Message
-  Message ok_msg(MessageType::OK);
+  // Copy the precomputed OK response
+  m_output.append_ok();
+}
+
+
+
+ShardMessage ClientConnection::shard_message( ShardMessage::Op op, const std::string &table ) {
+  ShardMessage msg;
+  msg.op = op;
+  msg.client = this;
+  msg.origin = m_shard->get_index();
+  msg.in_transaction = in_transaction;
+  msg.txn = m_txn;
+  msg.table = table;
+  msg.table_obj = nullptr;
+  msg.failed = false;
+  return msg;
+}
+
 
-  // Encode and send Message
-  std::string encoded_ok;
-  encode(ok_msg, encoded_ok);
-  rio_writen(m_client_fd, encoded_ok.data(), encoded_ok.size());
+void ClientConnection::forward_to_shard( ShardMessage &msg ) {
+  if (m_shard->submit(msg)) { apply_shard_answer(msg); }
+  else { m_pending++; }
 }
 
+
+void ClientConnection::apply_shard_answer( const ShardMessage &answer ) {
+
+  // Failures are handled like the exceptions thrown by the locking handlers
+  if (answer.failed) {
+    manage_exception(OperationException(answer.value), true);
+    return;
+  }
+
+  // Shards keep their own claims, so the lock mode recorded here is not used
+  if (in_transaction && answer.table_obj != nullptr) { locked_tables[answer.table_obj] = true; }
+
+  if (answer.op == ShardMessage::Op::GET) { stack.push(answer.value); }
+  else if (answer.op == ShardMessage::Op::SET) { stack.pop(); }
+  write_ok();
+}
@@ -1,13 +1,22 @@
 #ifndef CLIENT_CONNECTION_H
 #define CLIENT_CONNECTION_H
 
-#include <unordered_set>
+#include <chrono>
+#include <coroutine>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include "message.h"
+#include "message_view.h"
 #include "csapp.h"
 #include "value_stack.h"
+#include "output_buffer.h"
+#include "shard.h"
+#include "task.h"
 
 class Server; // forward declaration
 class Table; // forward declaration
+class WriteAheadLog; // forward declaration
 
 class ClientConnection {
 private:
@@ -15,10 +24,99 @@ private:
   int m_client_fd;
   rio_t m_fdbuf;
   ValueStack stack;
-  std::unordered_set<Table*> locked_tables;
+  /* Tables locked by the ongoing transaction, and whether it holds their lock exclusively
+  (it takes shared access for GETs, until it SETs a value). */
+  std::unordered_map<Table*, bool> locked_tables;
 
   bool in_transaction;
   bool loop_in_progress;
+  bool first_valid_message;
+
+  /* Bytes read from a non-blocking socket that do not yet form a complete line. */
+  std::string m_inbuf;
+
+  /* Encoded responses waiting to be written to the client. */
+  OutputBuffer m_output;
+
+  /* When the client connected and when it last sent anything, for the server's timeouts. */
+  std::chrono::steady_clock::time_point m_connected_at;
+  std::chrono::steady_clock::time_point m_last_activity;
+
+  /* Position of the connection in its event loop's list of connections (-1 if not listed). */
+  int m_loop_slot;
+
+  /* Shard whose thread serves the connection (nullptr outside of the sharded loop), the
+  answers still awaited from shards, and the current transaction's id. Requests are not
+  processed while an answer is awaited. */
+  Shard *m_shard;
+  int m_pending;
+  unsigned long long m_txn;
+
+  /* Whether the client hung up before its last requests were handled. */
+  bool m_peer_closed;
+
+  /* What a connection of an event loop, or a coroutine session, waits for: its socket, a
+  table's lock, or the log making a commit durable. */
+  enum class Wait {
+    NONE,
+    IO,
+    LOCK,
+    LOG,
+  };
+
+  /* The coroutine session, where it resumes, and what it waits for. */
+  Task m_session;
+  std::coroutine_handle<> m_resume_point;
+  Wait m_waiting;
+
+  /* Table (and its stripe) whose lock a coroutine session took before handling an
+  autocommit request. */
+  Table *m_held_table;
+  unsigned m_held_stripe;
+
+  /* Tables this connection used recently, so that a session using the same tables over
+  and over does not look their names up in the server's directory each time. Entries are
+  placed by the name's hash, one per slot. Tables are never dropped, so an entry stays
+  valid for as long as the server; dropping tables would need the entries to be checked
+  against a count of drops kept by the directory. */
+  struct CachedTable {
+    std::string name;
+    size_t hash;
+    Table *table = nullptr;
+  };
+
+  static const unsigned TABLE_CACHE_SIZE = 4;
+  CachedTable m_table_cache[TABLE_CACHE_SIZE];
+
+  /* The write-ahead log record of the commit being handled, kept to reuse its buffer. */
+  std::string m_log_record;
+
+  /* Whether the connection shares its thread with other connections, so it must not wait
+  for the log's fsyncs. */
+  bool m_event_loop;
+
+  /* A commit whose log record is appended but not yet durable, and where the record ends.
+  An autocommit SET keeps its stripe locked and its value on the stack until then (its
+  table is m_commit_table), and a transaction keeps its tables locked (m_commit_table is
+  nullptr). */
+  bool m_commit_pending;
+  unsigned long long m_commit_end;
+  Table *m_commit_table;
+  unsigned m_commit_stripe;
+  std::string m_commit_key;
+
+  /* Suspends a coroutine session until its scheduler resumes it. */
+  struct Suspend {
+    ClientConnection *conn;
+    Wait reason;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend( std::coroutine_handle<> handle ) noexcept {
+      conn->m_resume_point = handle;
+      conn->m_waiting = reason;
+    }
+    void await_resume() const noexcept { }
+  };
 
   // copy constructor and assignment operator are prohibited
   ClientConnection( const ClientConnection & );
@@ -33,16 +131,164 @@ public:
 
   int get_m_client_fd();
 
+  /* Prepares a finished connection object to serve a newly accepted client, with every
+  per-connection field as the constructor leaves it. */
+  void reset( int client_fd );
+
+  /* Fails an unfinished transaction and closes the client's socket. */
+  void close_connection();
+
+  /*
+   * Event loop entry points for connections on a non-blocking socket. Each returns
+   * false once the connection is finished and can be closed.
+   */
+  bool on_readable();
+  bool on_writable();
+
+  /*
+   * Entry points for an io_uring loop, which does the socket I/O itself. Received
+   * bytes are handed to on_data (or on_eof once the client hangs up), and the queued
+   * responses are collected with take_output.
+   */
+  void on_data( const char *data, size_t len );
+  void on_eof();
+  void take_output( std::string &out );
+  bool is_finished() const { return !loop_in_progress; }
+
+  /*
+   * A request of an event loop's connection that finds its table's stripe locked, or whose
+   * commit is not yet durable in the log, waits along with the requests after it instead
+   * of blocking the loop's thread. While is_waiting_to_retry is true, the loop should call
+   * on_retry a little later to try again, then write the responses as after on_data.
+   */
+  void on_retry();
+  bool is_waiting_to_retry() const { return m_waiting == Wait::LOCK || m_waiting == Wait::LOG; }
+
+  /* Marks the connection as one of an event loop's, whose commits do not wait for the log. */
+  void set_event_loop() { m_event_loop = true; }
+
+  /*
+   * Ends the connection with an ERROR once the client has gone without logging in for
+   * the server's LOGIN timeout, or without sending anything for its idle timeout. Used
+   * by loops that check their connections periodically. Returns true if it timed out.
+   */
+  bool check_timeout( std::chrono::steady_clock::time_point now );
+
+  int get_loop_slot() const { return m_loop_slot; }
+  void set_loop_slot( int slot ) { m_loop_slot = slot; }
+
+  /* Sends every table operation to the shard owning the table. */
+  void set_shard( Shard *shard ) { m_shard = shard; }
+
+  /*
+   * Handles the answer to an operation sent to a shard, then carries on with the
+   * requests that arrived meanwhile. Returns false once the connection is finished
+   * and can be closed.
+   */
+  bool on_shard_answer( ShardMessage &answer );
+
+  /*
+   * Entry points for a coroutine scheduler. start_session creates the session, which
+   * runs once it is first resumed. A session suspends whenever its socket would block
+   * (it should be resumed once the socket has an event), or a table's lock is taken or
+   * its commit is not yet durable (it should be resumed a little later to try again,
+   * whenever is_waiting_to_retry is true). resume_session returns false once
+   * the session is finished and the connection can be closed.
+   */
+  void start_session();
+  bool resume_session();
+  bool is_waiting_for_io() const { return m_waiting == Wait::IO; }
+
 
 private:
+  /* Decodes one line sent by the client and queues the response(s) in the output buffer. */
+  void process_line(std::string_view line);
+
+  /* Handles a decoded request, and queues the response(s) in the output buffer. */
+  void process_message(const MessageView &client_msg);
+
+  /* Finds the next complete line in the input buffer, starting at line_start, and advances
+  line_start past it. At the end of the input, a partial line counts as complete. */
+  bool next_line(size_t &line_start, std::string_view &line, bool at_eof = false);
+
+  /* Writes all queued responses, blocking until they are sent. */
+  void flush_output();
+
+  /* Checks whether another complete request can be read without blocking. Once a batch of
+  pipelined requests is being answered, this also pulls in data already sent to the socket. */
+  bool has_buffered_line();
+
+  /* Writes as many queued responses as the socket accepts. Returns false on a write error. */
+  bool flush_output_nonblocking();
+
+  /* The timeout that currently applies to the client in seconds, or 0 for none. */
+  int current_timeout() const;
+
+  /* Makes blocking reads from the client's socket give up after the given number of seconds. */
+  void set_receive_timeout(int seconds);
+
+  /* Processes every complete line in the input buffer, up to a request whose table's stripe is
+  locked. */
+  void process_input();
+
+  /*
+   * The coroutine session: the same read/process/write cycle as the event loops, as one
+   * sequence of steps that suspend instead of blocking the thread.
+   */
+  Task session();
+
+  /* Reads until the input buffer holds a complete line, or the client hangs up. */
+  Task read_input();
+
+  /* Processes every complete line in the input buffer, waiting for table locks as needed. */
+  Task process_input_async();
+
+  /* Writes every queued response. */
+  Task write_output();
+
+  /* Locks a table's stripe (shared or exclusive) without blocking other sessions of the thread. */
+  Task lock_table(Table *table, unsigned stripe, bool shared);
+
+  /* The table an autocommit GET (shared) or SET (exclusive) will lock, or nullptr if it
+  will not lock one. */
+  Table *autocommit_table(const MessageView &client_msg);
+
+  /* The table called name, from the connection's cache or else the server, or nullptr. */
+  Table *resolve_table(const HashedKey &name);
+
+  /* Locks a table's stripe for an autocommit operation, unless an event loop or session already
+  took it. */
+  void lock_for_autocommit(Table *table, unsigned stripe, bool shared);
+
+  /* Commits m_log_record to the log. A connection of an event loop only appends it and
+  returns true, leaving the commit pending until the record is durable. */
+  bool log_commit(WriteAheadLog *log);
+
+  /* Applies and answers the pending commit once its record is durable, or fails it if the
+  log failed. Unless wait is false, returns false without doing anything while the record
+  is not yet durable. */
+  bool finish_commit(bool wait);
+
+  /* Commits the changes to the transaction's tables and unlocks them. */
+  void commit_transaction();
+
   /* Fails an ongoing transaction and turns an exception into a message sent to the client. */
   void manage_exception(std::runtime_error ex, bool recoverable);
 
   /* Rolls back changes in altered Tables and unlocks them. */
   void fail_transaction();
 
+  /* A table operation of this connection, to be sent to the shard owning the table. */
+  ShardMessage shard_message( ShardMessage::Op op, const std::string &table );
+
+  /* Sends an operation to its table's shard, and handles the answer if it is already there. */
+  void forward_to_shard( ShardMessage &msg );
+
+  /* Queues the response to an answered GET, SET or CREATE. */
+  void apply_shard_answer( const ShardMessage &answer );
+
   /* Finds a message's type and calls the appropriate response function based on the type. */
-  void call_response_function(Message client_msg);
+  void call_response_function(const MessageView &client_msg);
 
   void handle_begin();
 
@@ -64,17 +310,17 @@ private:
 
   void handle_login(bool* first_valid_message);
 
-  void handle_create(Message client_msg);
+  void handle_create(const MessageView &client_msg);
 
-  void handle_push(Message client_msg);
+  void handle_push(const MessageView &client_msg);
 
-  void handle_set(Message client_msg);
+  void handle_set(const MessageView &client_msg);
   /* handle_set() helper function that accesses table entry and performs the actual SET operation. */
-  void set_table_value(Message client_msg, Table* table_obj);
+  void set_table_value(const MessageView &client_msg, Table* table_obj);
 
-  void handle_get(Message client_msg);
+  void handle_get(const MessageView &client_msg);
   /* handle_get() helper function that accesses table entry and performs the actual GET operation */
-  void get_table_value(Message client_msg, Table* table_obj);
+  void get_table_value(const MessageView &client_msg, Table* table_obj);
 
   /* Respond to client with OK Message */
   void write_ok();
@@ -0,0 +1,101 @@
+#include <sched.h>
+#include <cerrno>
+#include "connection_queue.h"
+
+namespace {
+  size_t round_up_to_power_of_two( size_t n ) {
+    size_t size = 1;
+    while (size < n) { size *= 2; }
+    return size;
+  }
+}
+
+ConnectionQueue::ConnectionQueue( size_t capacity )
+  : cells( round_up_to_power_of_two(capacity) )
+  , mask( cells.size() - 1 )
+  , enqueue_pos( 0 )
+  , dequeue_pos( 0 )
+{
+  size_t size = cells.size();
+  for (size_t i = 0; i < size; i++) {
+    cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  sem_init(&free_slots, 0, size);
+  sem_init(&queued_fds, 0, 0);
+}
+
+ConnectionQueue::~ConnectionQueue()
+{
+  sem_destroy(&free_slots);
+  sem_destroy(&queued_fds);
+}
+
+void ConnectionQueue::push( int client_fd )
+{
+  while (sem_wait(&free_slots) != 0 && errno == EINTR) { }
+
+  // A free slot is guaranteed, but the consumer that freed it may not have published it yet
+  while (!try_enqueue(client_fd)) { sched_yield(); }
+
+  sem_post(&queued_fds);
+}
+
+int ConnectionQueue::pop()
+{
+  while (sem_wait(&queued_fds) != 0 && errno == EINTR) { }
+
+  int client_fd;
+  while (!try_dequeue(&client_fd)) { sched_yield(); }
+
+  sem_post(&free_slots);
+  return client_fd;
+}
+
+bool ConnectionQueue::try_enqueue( int client_fd )
+{
+  size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+
+  while (1) {
+    Cell &cell = cells[pos & mask];
+    size_t sequence = cell.sequence.load(std::memory_order_acquire);
+    long diff = (long) sequence - (long) pos;
+
+    // The cell is free for this position, so try to claim it
+    if (diff == 0) {
+      if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        cell.client_fd = client_fd;
+        cell.sequence.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+    }
+    // The cell still holds an fd from one lap ago
+    else if (diff < 0) { return false; }
+    // Another producer claimed this position first
+    else { pos = enqueue_pos.load(std::memory_order_relaxed); }
+  }
+}
+
+bool ConnectionQueue::try_dequeue( int *client_fd )
+{
+  size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+
+  while (1) {
+    Cell &cell = cells[pos & mask];
+    size_t sequence = cell.sequence.load(std::memory_order_acquire);
+    long diff = (long) sequence - (long) (pos + 1);
+
+    // The cell holds an fd for this position, so try to claim it
+    if (diff == 0) {
+      if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        *client_fd = cell.client_fd;
+        cell.sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+      }
+    }
+    // The producer for this position has not published its fd yet
+    else if (diff < 0) { return false; }
+    // Another consumer claimed this position first
+    else { pos = dequeue_pos.load(std::memory_order_relaxed); }
+  }
+}
@@ -0,0 +1,51 @@
+#ifndef CONNECTION_QUEUE_H
+#define CONNECTION_QUEUE_H
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <semaphore.h>
+
+/* 
+ * Bounded queue used to hand accepted client sockets to pool worker threads.
+ * The ring itself is lock-free (each cell carries a sequence number, so any number
+ * of accept threads and workers can use it), and semaphores are only used to sleep
+ * while the queue is full or empty.
+ */
+class ConnectionQueue {
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    int client_fd;
+  };
+
+  std::vector<Cell> cells;
+  size_t mask;
+
+  // Producer and consumer positions live on separate cache lines
+  alignas(64) std::atomic<size_t> enqueue_pos;
+  alignas(64) std::atomic<size_t> dequeue_pos;
+
+  sem_t free_slots;
+  sem_t queued_fds;
+
+  // copy constructor and assignment operator are prohibited
+  ConnectionQueue( const ConnectionQueue & );
+  ConnectionQueue &operator=( const ConnectionQueue & );
+
+  bool try_enqueue( int client_fd );
+  bool try_dequeue( int *client_fd );
+
+public:
+  /* The capacity is rounded up to a power of two. */
+  ConnectionQueue( size_t capacity );
+  ~ConnectionQueue();
+
+  /* Adds a socket to the queue, waiting while the queue is full. */
+  void push( int client_fd );
+
+  /* Removes the oldest socket from the queue, waiting while the queue is empty. */
+  int pop();
+};
+
+#endif // CONNECTION_QUEUE_H
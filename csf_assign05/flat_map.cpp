@@ -0,0 +1,242 @@
+#include <cstring>
+#include <new>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "flat_map.h"
+#include "hashed_key.h"
+
+namespace {
+  // Control byte of an empty slot. A full slot's is 7 bits of its key's hash, so never negative.
+  const int8_t CTRL_EMPTY = -128;
+
+  // Control byte of an old slot whose entry has been moved. Lookups probe past it, like a full slot.
+  const int8_t CTRL_DELETED = -2;
+
+  // The smallest number of slots, which is one group
+  const size_t MIN_CAPACITY = 16;
+
+  // Old slots that each insert moves to the new arrays while the map grows. The new arrays
+  // take 7/8 of the old capacity in inserts before they are full, so this is plenty.
+  const size_t MIGRATE_SLOTS = 16;
+
+  // A map that held more slots than this frees them when it is cleared
+  const size_t MAX_CLEARED_CAPACITY = 64;
+
+  // Slot arrays are left uninitialized: only slots with a full control byte are ever read,
+  // and not touching the rest keeps growing a large map from faulting in all its pages at once.
+  template<typename Slot>
+  Slot *allocate_slots( size_t capacity ) {
+    return static_cast<Slot *>( ::operator new( capacity * sizeof(Slot) ) );
+  }
+
+  template<typename Slot>
+  void free_slots( Slot *slots ) {
+    ::operator delete( slots );
+  }
+
+  // The map grows once 7/8 of its slots are full
+  size_t max_size_of( size_t capacity ) {
+    return capacity - capacity / 8;
+  }
+
+  // Bits set for the bytes of a group equal to ctrl
+  unsigned match_group( const int8_t *group, int8_t ctrl ) {
+#ifdef __SSE2__
+    __m128i bytes = _mm_loadu_si128( reinterpret_cast<const __m128i *>( group ) );
+    return _mm_movemask_epi8( _mm_cmpeq_epi8( bytes, _mm_set1_epi8( ctrl ) ) );
+#else
+    unsigned matches = 0;
+    for (unsigned i = 0; i < 16; i++) {
+      if (group[i] == ctrl) { matches |= 1u << i; }
+    }
+    return matches;
+#endif
+  }
+}
+
+FlatMap::FlatMap()
+  : m_ctrl( nullptr )
+  , m_slots( nullptr )
+  , m_capacity( 0 )
+  , m_size( 0 )
+  , m_growth_left( 0 )
+  , m_old_ctrl( nullptr )
+  , m_old_slots( nullptr )
+  , m_old_capacity( 0 )
+  , m_migrated( 0 )
+{ }
+
+FlatMap::~FlatMap()
+{
+  release();
+}
+
+size_t FlatMap::find_index( const int8_t *ctrl, const Slot *slots, size_t capacity,
+                            std::string_view key, size_t hash )
+{
+  if (capacity == 0) { return capacity; }
+
+  size_t mask = capacity - 1;
+  int8_t h2 = hash & 0x7F;
+  size_t pos = (hash >> 7) & mask;
+
+  // Groups are probed triangularly, which visits each of them once when their number is a power of two
+  for (size_t step = GROUP_WIDTH; ; step += GROUP_WIDTH) {
+    for (unsigned match = match_group(ctrl + pos, h2); match != 0; match &= match - 1) {
+      size_t index = (pos + __builtin_ctz(match)) & mask;
+      if (slots[index].key == key) { return index; }
+    }
+
+    // The key would have been stored in the first empty slot of its probe sequence
+    if (match_group(ctrl + pos, CTRL_EMPTY) != 0) { return capacity; }
+    pos = (pos + step) & mask;
+  }
+}
+
+size_t FlatMap::find_empty( const int8_t *ctrl, size_t capacity, size_t hash )
+{
+  size_t mask = capacity - 1;
+  size_t pos = (hash >> 7) & mask;
+
+  for (size_t step = GROUP_WIDTH; ; step += GROUP_WIDTH) {
+    unsigned empty = match_group(ctrl + pos, CTRL_EMPTY);
+    if (empty != 0) { return (pos + __builtin_ctz(empty)) & mask; }
+    pos = (pos + step) & mask;
+  }
+}
+
+void FlatMap::set_ctrl( int8_t *ctrl, size_t capacity, size_t index, int8_t value )
+{
+  ctrl[index] = value;
+  if (index < GROUP_WIDTH - 1) { ctrl[capacity + index] = value; }
+}
+
+FlatMap::Slot *FlatMap::find_slot( std::string_view key, size_t hash ) const
+{
+  size_t index = find_index(m_ctrl, m_slots, m_capacity, key, hash);
+  if (index != m_capacity) { return &m_slots[index]; }
+
+  if (m_old_ctrl == nullptr) { return nullptr; }
+  index = find_index(m_old_ctrl, m_old_slots, m_old_capacity, key, hash);
+  return index == m_old_capacity ? nullptr : &m_old_slots[index];
+}
+
+const std::string_view *FlatMap::find( std::string_view key ) const
+{
+  return find(key, HashedKey::hash_of(key));
+}
+
+std::string_view *FlatMap::find( std::string_view key )
+{
+  return find(key, HashedKey::hash_of(key));
+}
+
+const std::string_view *FlatMap::find( std::string_view key, size_t hash ) const
+{
+  Slot *slot = find_slot(key, hash);
+  return slot == nullptr ? nullptr : &slot->value;
+}
+
+std::string_view *FlatMap::find( std::string_view key, size_t hash )
+{
+  Slot *slot = find_slot(key, hash);
+  return slot == nullptr ? nullptr : &slot->value;
+}
+
+std::string_view &FlatMap::insert( std::string_view key )
+{
+  return insert(key, HashedKey::hash_of(key));
+}
+
+std::string_view &FlatMap::insert( std::string_view key, size_t hash )
+{
+  if (m_old_ctrl != nullptr) { migrate(MIGRATE_SLOTS); }
+  if (m_growth_left == 0) { grow(m_capacity == 0 ? MIN_CAPACITY : m_capacity * 2); }
+
+  size_t index = find_empty(m_ctrl, m_capacity, hash);
+  new (&m_slots[index]) Slot{ key, std::string_view() };
+  set_ctrl(m_ctrl, m_capacity, index, hash & 0x7F);
+  m_size++;
+  m_growth_left--;
+  return m_slots[index].value;
+}
+
+void FlatMap::grow( size_t new_capacity )
+{
+  // Should the new arrays fill up before the old ones are empty, the rest moves now
+  if (m_old_ctrl != nullptr) { migrate(m_old_capacity); }
+
+  m_old_ctrl = m_ctrl;
+  m_old_slots = m_slots;
+  m_old_capacity = m_capacity;
+  m_migrated = 0;
+
+  m_capacity = new_capacity;
+  m_ctrl = new int8_t[new_capacity + GROUP_WIDTH - 1];
+  memset(m_ctrl, CTRL_EMPTY, new_capacity + GROUP_WIDTH - 1);
+  m_slots = allocate_slots<Slot>(new_capacity);
+  m_growth_left = max_size_of(new_capacity) - m_size;
+}
+
+void FlatMap::migrate( size_t count )
+{
+  for (; count > 0 && m_migrated < m_old_capacity; count--, m_migrated++) {
+    if (m_old_ctrl[m_migrated] < 0) { continue; }
+
+    Slot &slot = m_old_slots[m_migrated];
+    size_t hash = HashedKey::hash_of(slot.key);
+    size_t index = find_empty(m_ctrl, m_capacity, hash);
+    new (&m_slots[index]) Slot( slot );
+    set_ctrl(m_ctrl, m_capacity, index, hash & 0x7F);
+    set_ctrl(m_old_ctrl, m_old_capacity, m_migrated, CTRL_DELETED);
+  }
+
+  if (m_migrated == m_old_capacity) {
+    delete[] m_old_ctrl;
+    free_slots(m_old_slots);
+
+    m_old_ctrl = nullptr;
+    m_old_slots = nullptr;
+    m_old_capacity = 0;
+    m_migrated = 0;
+  }
+}
+
+void FlatMap::clear()
+{
+  if (m_capacity > MAX_CLEARED_CAPACITY || m_old_ctrl != nullptr) {
+    release();
+    return;
+  }
+
+  if (m_capacity > 0) { memset(m_ctrl, CTRL_EMPTY, m_capacity + GROUP_WIDTH - 1); }
+  m_size = 0;
+  m_growth_left = max_size_of(m_capacity);
+}
+
+void FlatMap::release()
+{
+  delete[] m_ctrl;
+  free_slots(m_slots);
+  delete[] m_old_ctrl;
+  free_slots(m_old_slots);
+
+  m_ctrl = nullptr;
+  m_slots = nullptr;
+  m_capacity = 0;
+  m_size = 0;
+  m_growth_left = 0;
+  m_old_ctrl = nullptr;
+  m_old_slots = nullptr;
+  m_old_capacity = 0;
+  m_migrated = 0;
+}
+
+size_t FlatMap::memory_usage() const
+{
+  size_t usage = 0;
+  if (m_capacity > 0) { usage += m_capacity * sizeof(Slot) + m_capacity + GROUP_WIDTH - 1; }
+  if (m_old_capacity > 0) { usage += m_old_capacity * sizeof(Slot) + m_old_capacity + GROUP_WIDTH - 1; }
+  return usage;
+}
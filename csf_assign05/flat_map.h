@@ -0,0 +1,127 @@
+#ifndef FLAT_MAP_H
+#define FLAT_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/*
+ * Open-addressing hash map from string keys to string values, laid out like a
+ * SwissTable. A control byte per slot holds 7 bits of the key's hash (or marks the slot
+ * empty), and lookups compare a group of 16 control bytes at once with SSE2, so they
+ * only touch the slots whose hash bits match. The slots live in one flat array instead
+ * of in a node allocated per entry, and only hold views of the keys and values: their
+ * bytes belong to whoever fills the map (a table stripe's Arena).
+ *
+ * Growing does not move every entry at once, which would stall the insert that triggers
+ * it for as long as copying millions of slots takes. The old arrays are kept next to the
+ * new ones, and each insert after that moves a few of their entries over, so lookups
+ * check both until the old arrays are empty and freed.
+ */
+class FlatMap {
+private:
+  struct Slot {
+    std::string_view key;
+    std::string_view value;
+  };
+
+  static const size_t GROUP_WIDTH = 16;
+
+  /* One control byte per slot, followed by a copy of the first GROUP_WIDTH - 1 bytes so
+  that a group starting near the end can be loaded without wrapping around. */
+  int8_t *m_ctrl;
+
+  /* Slots, of which only those with a full control byte are used. */
+  Slot *m_slots;
+
+  size_t m_capacity;
+  size_t m_size;
+
+  /* Inserts that may still happen before the map must grow. Entries still in the old
+  arrays are counted as using their slot in the new ones already. */
+  size_t m_growth_left;
+
+  /* The arrays before the map last grew, while their entries are being moved, else
+  nullptr. Slots up to m_migrated have been moved, and their control bytes marked deleted. */
+  int8_t *m_old_ctrl;
+  Slot *m_old_slots;
+  size_t m_old_capacity;
+  size_t m_migrated;
+
+  // copy constructor and assignment operator are prohibited
+  FlatMap( const FlatMap & );
+  FlatMap &operator=( const FlatMap & );
+
+  /* The index of key's slot in the given arrays, or capacity if the key is absent. */
+  static size_t find_index( const int8_t *ctrl, const Slot *slots, size_t capacity,
+                            std::string_view key, size_t hash );
+
+  /* Index of the first empty slot on hash's probe sequence. */
+  static size_t find_empty( const int8_t *ctrl, size_t capacity, size_t hash );
+
+  static void set_ctrl( int8_t *ctrl, size_t capacity, size_t index, int8_t value );
+
+  /* The slot holding key, in the new arrays or the old ones, or nullptr. */
+  Slot *find_slot( std::string_view key, size_t hash ) const;
+
+  /* Allocates new arrays of new_capacity slots, and keeps the current ones as the old
+  arrays to migrate from. */
+  void grow( size_t new_capacity );
+
+  /* Moves up to count entries from the old arrays, and frees them once they are empty. */
+  void migrate( size_t count );
+
+  void release();
+
+public:
+  FlatMap();
+  ~FlatMap();
+
+  size_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+
+  /* The value stored for key, or nullptr if there is none. The overloads taking a hash
+  expect the key's HashedKey::hash_of, computed once by the caller. */
+  const std::string_view *find( std::string_view key ) const;
+  std::string_view *find( std::string_view key );
+  const std::string_view *find( std::string_view key, size_t hash ) const;
+  std::string_view *find( std::string_view key, size_t hash );
+
+  /* Adds key, which must be absent, and returns its (empty) value to be filled in. The
+  map keeps the view of key, so its bytes must outlive the entry. */
+  std::string_view &insert( std::string_view key );
+  std::string_view &insert( std::string_view key, size_t hash );
+
+  /* Removes every entry. */
+  void clear();
+
+  /* Bytes allocated for the slot arrays, old and new. */
+  size_t memory_usage() const;
+
+  /* True while the map is still moving entries out of the arrays it grew from. */
+  bool is_migrating() const { return m_old_ctrl != nullptr; }
+
+  /* Calls fn( key, value ) for every entry. The views may be changed, to point to a copy
+  of the same bytes. */
+  template<typename Fn>
+  void for_each( Fn fn ) {
+    for (size_t i = 0; i < m_capacity; i++) {
+      if (m_ctrl[i] >= 0) { fn(m_slots[i].key, m_slots[i].value); }
+    }
+    for (size_t i = m_migrated; i < m_old_capacity; i++) {
+      if (m_old_ctrl[i] >= 0) { fn(m_old_slots[i].key, m_old_slots[i].value); }
+    }
+  }
+
+  template<typename Fn>
+  void for_each( Fn fn ) const {
+    for (size_t i = 0; i < m_capacity; i++) {
+      if (m_ctrl[i] >= 0) { fn(std::string_view(m_slots[i].key), std::string_view(m_slots[i].value)); }
+    }
+    for (size_t i = m_migrated; i < m_old_capacity; i++) {
+      if (m_old_ctrl[i] >= 0) { fn(std::string_view(m_old_slots[i].key), std::string_view(m_old_slots[i].value)); }
+    }
+  }
+};
+
+#endif // FLAT_MAP_H
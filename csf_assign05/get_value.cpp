@@ -1,5 +1,8 @@
 #include <iostream>
+#include <vector>
+#include <unistd.h>
 #include "csapp.h"
+#include "unix_socket.h"
 #include "message.h"
 #include "message_serialization.h"
 
@@ -170,26 +173,97 @@ int bye_operation(int fd) {
 }
 
 
+/* Send LOGIN, GET, TOP and BYE in a single write, then handle the responses in order. Return 0 on success, -1 otherwise. */
+int pipelined_operations(std::string username, std::string table, std::string key, int fd) {
+  std::vector<Message> requests;
+  requests.push_back(Message(MessageType::LOGIN, { username }));
+  requests.push_back(Message(MessageType::GET, { table, key }));
+  requests.push_back(Message(MessageType::TOP));
+  requests.push_back(Message(MessageType::BYE));
+
+  // Encode and send every Message at once
+  std::string encoded_requests;
+  for (auto it = requests.begin(); it != requests.end(); it++) {
+    std::string encoded_msg;
+    encode(*it, encoded_msg);
+    encoded_requests += encoded_msg;
+  }
+  rio_writen(fd, encoded_requests.data(), encoded_requests.size());
+
+  // The responses arrive in request order, so they share one read buffer
+  rio_t read;
+  rio_readinitb(&read, fd);
+  char buf[Message::MAX_ENCODED_LEN];
+
+  for (auto it = requests.begin(); it != requests.end(); it++) {
+    ssize_t n = rio_readlineb(&read, buf, sizeof(buf));
+
+    // If the server response couldn't be read
+    if (n <= 0) {
+      std::cerr << "Error: could not read server's response.\n";
+      return -1;
+    }
+
+    int result = (it->get_message_type() == MessageType::TOP) ? handle_top_response(buf) : handle_possible_ok_response(buf);
+    if (result != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+/* Print how to run the program. */
+void print_usage() {
+  std::cerr << "Usage: ./get_value [-p] (<hostname> <port> | -u <path>) <username> <table> <key>\n";
+  std::cerr << "Options:\n";
+  std::cerr << "  -p          send all requests at once instead of waiting for each response\n";
+  std::cerr << "  -u <path>   connect through the server's Unix domain socket at <path>\n";
+}
+
+
 int main(int argc, char **argv)
 {
-  if ( argc != 6 ) {
-    std::cerr << "Usage: ./get_value <hostname> <port> <username> <table> <key>\n";
+  bool pipelined = false;
+  std::string socket_path;
+
+  int opt;
+  // Parsing stops at the first argument that is not an option, so a key such as -x is left alone
+  while ((opt = getopt(argc, argv, "+pu:")) != -1) {
+    if (opt == 'p') { pipelined = true; }
+    else if (opt == 'u') { socket_path = optarg; }
+    else {
+      print_usage();
+      return 1;
+    }
+  }
+
+  // A Unix domain socket takes the place of the hostname and port
+  int num_address_args = socket_path.empty() ? 2 : 0;
+  if ( argc - optind != 3 + num_address_args ) {
+    print_usage();
     return 1;
   }
 
-  std::string hostname = argv[1];
-  std::string port = argv[2];
-  std::string username = argv[3];
-  std::string table = argv[4];
-  std::string key = argv[5];
+  std::string hostname = num_address_args ? argv[optind] : "";
+  std::string port = num_address_args ? argv[optind + 1] : "";
+  optind += num_address_args;
+  std::string username = argv[optind];
+  std::string table = argv[optind + 1];
+  std::string key = argv[optind + 2];
 
   // Try to connect to server
-  int fd = open_clientfd(hostname.data(), port.data());
+  int fd = open_server_clientfd(hostname, port, socket_path);
   if (fd < 0) {
     std::cerr << "Error: Could not connect to server.\n";
     return 1;
   }
 
+  if (pipelined) {
+    return (pipelined_operations(username, table, key, fd) == 0) ? 0 : 1;
+  }
+
   /* LOGIN operation. Errors printed in functions. */
   int login_result = login_operation(username, fd);
   if (login_result != 0) {
@@ -0,0 +1,54 @@
+#ifndef HASHED_KEY_H
+#define HASHED_KEY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+/*
+ * A table name or key together with its hash. A request's names are hashed once, when it
+ * is decoded, and the server's table directory, a table's stripes and the stripe's maps
+ * all take the hash from here instead of hashing the same string again. Everything that
+ * hashes names and keys must use hash_of, so that the hashes agree.
+ */
+struct HashedKey {
+  std::string_view key;
+  size_t hash;
+
+  HashedKey() : hash( 0 ) { }
+  explicit HashedKey( std::string_view key ) : key( key ), hash( hash_of( key ) ) { }
+  HashedKey( std::string_view key, size_t hash ) : key( key ), hash( hash ) { }
+
+  /* Hashes a word at a time, folding each into the hash with a 64x64 to 128 bit
+  multiplication. Names are short, so most of them take one or two multiplications.
+  Every bit of the result depends on every byte, as tables use the low bits for their
+  slots and the high bits for their stripes. */
+  static size_t hash_of( std::string_view key ) {
+    const uint64_t SEED = 0xa0761d6478bd642full;
+    const uint64_t WORD_SECRET = 0xe7037ed1a0b428dbull;
+    const uint64_t HASH_SECRET = 0x8ebc6af09c88c6e3ull;
+
+    const char *bytes = key.data();
+    size_t left = key.size();
+    uint64_t hash = SEED ^ left;
+
+    for (; left > 8; bytes += 8, left -= 8) {
+      uint64_t word;
+      memcpy(&word, bytes, 8);
+      hash = mix(word ^ WORD_SECRET, hash ^ HASH_SECRET);
+    }
+
+    // The last one to eight bytes, zero padded (the length is already in the seed)
+    uint64_t word = 0;
+    memcpy(&word, bytes, left);
+    return mix(word ^ WORD_SECRET, hash ^ HASH_SECRET);
+  }
+
+  static uint64_t mix( uint64_t a, uint64_t b ) {
+    unsigned __int128 product = (unsigned __int128) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+  }
+};
+
+#endif // HASHED_KEY_H
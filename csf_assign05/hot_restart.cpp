@@ -0,0 +1,123 @@
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "exceptions.h"
+#include "hot_restart.h"
+#include "unix_socket.h"
+
+int HotRestart::open_control_socket(const std::string &path) {
+  // Only one new server connects at a time
+  return open_unix_listenfd(path, 1);
+}
+
+
+int HotRestart::connect_control_socket(const std::string &path) {
+  return open_unix_clientfd(path);
+}
+
+
+bool HotRestart::send_fds(int control_fd, const std::vector<int> &fds) {
+  if (fds.empty() || fds.size() > MAX_HANDOFF_FDS) { return false; }
+
+  // The number of descriptors is sent as the message's data, since ancillary data needs some
+  unsigned num_fds = fds.size();
+  iovec iov;
+  iov.iov_base = &num_fds;
+  iov.iov_len = sizeof(num_fds);
+
+  char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)];
+  memset(control, 0, sizeof(control));
+
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+  memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * num_fds);
+
+  return sendmsg(control_fd, &msg, MSG_NOSIGNAL) == (ssize_t) sizeof(num_fds);
+}
+
+
+bool HotRestart::receive_fds(int control_fd, std::vector<int> &fds) {
+  unsigned num_fds = 0;
+  iovec iov;
+  iov.iov_base = &num_fds;
+  iov.iov_len = sizeof(num_fds);
+
+  char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)];
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  if (recvmsg(control_fd, &msg, MSG_CMSG_CLOEXEC) != (ssize_t) sizeof(num_fds)) { return false; }
+
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      num_fds == 0 || num_fds > MAX_HANDOFF_FDS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * num_fds)) {
+    return false;
+  }
+
+  fds.resize(num_fds);
+  memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(int) * num_fds);
+  return true;
+}
+
+
+bool HotRestart::write_all(int control_fd, const std::string &data) {
+  size_t written = 0;
+
+  while (written < data.size()) {
+    ssize_t n = send(control_fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+    if (n > 0) { written += n; }
+    else if (n < 0 && errno == EINTR) { continue; }
+    else { return false; }
+  }
+  return true;
+}
+
+
+void HotRestart::append_u32(std::string &out, unsigned value) {
+  out.append(reinterpret_cast<const char *>( &value ), sizeof(value));
+}
+
+
+void HotRestart::append_u64(std::string &out, unsigned long long value) {
+  out.append(reinterpret_cast<const char *>( &value ), sizeof(value));
+}
+
+
+unsigned HotRestart::read_u32(const std::string &in, size_t &pos) {
+  unsigned value;
+  if (pos + sizeof(value) > in.size()) { throw CommException("Truncated handoff data"); }
+  memcpy(&value, in.data() + pos, sizeof(value));
+  pos += sizeof(value);
+  return value;
+}
+
+
+unsigned long long HotRestart::read_u64(const std::string &in, size_t &pos) {
+  unsigned long long value;
+  if (pos + sizeof(value) > in.size()) { throw CommException("Truncated handoff data"); }
+  memcpy(&value, in.data() + pos, sizeof(value));
+  pos += sizeof(value);
+  return value;
+}
+
+
+std::string HotRestart::read_bytes(const std::string &in, size_t &pos, size_t len) {
+  if (pos + len > in.size()) { throw CommException("Truncated handoff data"); }
+  std::string bytes = in.substr(pos, len);
+  pos += len;
+  return bytes;
+}
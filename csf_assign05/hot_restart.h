@@ -0,0 +1,62 @@
+#ifndef HOT_RESTART_H
+#define HOT_RESTART_H
+
+#include <string>
+#include <vector>
+
+/*
+ * Helpers for handing a running server over to a new server process. The two processes
+ * talk over a Unix domain control socket: the old server sends its listening sockets
+ * (as SCM_RIGHTS ancillary data) and then the contents of its tables.
+ */
+namespace HotRestart {
+
+  // Most listening sockets that can be handed over at once
+  const unsigned MAX_HANDOFF_FDS = 64;
+
+  /*
+   * Opens a control socket listening at path, replacing any stale socket file.
+   * @return The socket, or -1 on failure.
+  */
+  int open_control_socket(const std::string &path);
+
+  /*
+   * Connects to the control socket of a running server.
+   * @return The socket, or -1 if no server is listening at path.
+  */
+  int connect_control_socket(const std::string &path);
+
+  /*
+   * Sends file descriptors to the process at the other end of a control socket.
+   * @return false if they could not be sent.
+  */
+  bool send_fds(int control_fd, const std::vector<int> &fds);
+
+  /*
+   * Receives file descriptors sent with send_fds.
+   * @return false if none could be received.
+  */
+  bool receive_fds(int control_fd, std::vector<int> &fds);
+
+  /*
+   * Writes all of data to a control socket. Unlike rio_writen, a peer that went away does
+   * not raise SIGPIPE.
+   * @return false if the data could not be written.
+  */
+  bool write_all(int control_fd, const std::string &data);
+
+  /* Appends a fixed size, native byte order integer to a binary buffer. */
+  void append_u32(std::string &out, unsigned value);
+  void append_u64(std::string &out, unsigned long long value);
+
+  /* Reads an integer written by append_u32/append_u64 and advances pos past it.
+  Reads past the end of the buffer throw a CommException. */
+  unsigned read_u32(const std::string &in, size_t &pos);
+  unsigned long long read_u64(const std::string &in, size_t &pos);
+
+  /* Reads len bytes from a binary buffer and advances pos past them. */
+  std::string read_bytes(const std::string &in, size_t &pos, size_t len);
+
+};
+
+#endif // HOT_RESTART_H
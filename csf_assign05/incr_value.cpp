@@ -1,5 +1,8 @@
 #include <iostream>
+#include <vector>
+#include <unistd.h>
 #include "csapp.h"
+#include "unix_socket.h"
 #include "message.h"
 #include "message_serialization.h"
 
@@ -229,42 +232,126 @@ int bye_operation(int fd) {
 }
 
 
-int main(int argc, char **argv) {
-  if ( argc != 6 && (argc != 7 || std::string(argv[1]) != "-t") ) {
-    std::cerr << "Usage: ./incr_value [-t] <hostname> <port> <username> <table> <key>\n";
-    std::cerr << "Options:\n";
-    std::cerr << "  -t      execute the increment as a transaction\n";
-    return 1;
+/* Send a batch of requests in a single write, then handle their OK responses in order. Return 0 on success, -1 otherwise. */
+int pipelined_batch(const std::vector<Message> &requests, int fd, rio_t *read) {
+
+  // Encode and send every Message at once
+  std::string encoded_requests;
+  for (auto it = requests.begin(); it != requests.end(); it++) {
+    std::string encoded_msg;
+    encode(*it, encoded_msg);
+    encoded_requests += encoded_msg;
+  }
+  rio_writen(fd, encoded_requests.data(), encoded_requests.size());
+
+  char buf[Message::MAX_ENCODED_LEN];
+  for (unsigned i = 0; i < requests.size(); i++) {
+    ssize_t n = rio_readlineb(read, buf, sizeof(buf));
+
+    // If the server response couldn't be read
+    if (n <= 0) {
+      std::cerr << "Error: could not read server's response.\n";
+      return -1;
+    }
+
+    if (handle_possible_ok_response(buf) != 0) {
+      return -1;
+    }
   }
 
-  int count = 1;
+  return 0;
+}
+
 
+/* 
+ * Perform the increment in two pipelined batches. The GET must succeed before the PUSH/ADD/SET
+ * batch is sent, otherwise the SET would store whatever is left on the stack.
+ * Return 0 on success, -1 otherwise.
+ */
+int pipelined_operations(std::string username, std::string table, std::string key, bool use_transaction, int fd) {
+  rio_t read;
+  rio_readinitb(&read, fd);
+
+  std::vector<Message> first_batch;
+  first_batch.push_back(Message(MessageType::LOGIN, { username }));
+  if (use_transaction) { first_batch.push_back(Message(MessageType::BEGIN)); }
+  first_batch.push_back(Message(MessageType::GET, { table, key }));
+
+  if (pipelined_batch(first_batch, fd, &read) != 0) {
+    return -1;
+  }
+
+  std::vector<Message> second_batch;
+  second_batch.push_back(Message(MessageType::PUSH, { "1" }));
+  second_batch.push_back(Message(MessageType::ADD));
+  second_batch.push_back(Message(MessageType::SET, { table, key }));
+  if (use_transaction) { second_batch.push_back(Message(MessageType::COMMIT)); }
+  second_batch.push_back(Message(MessageType::BYE));
+
+  return pipelined_batch(second_batch, fd, &read);
+}
+
+
+/* Print how to run the program. */
+void print_usage() {
+  std::cerr << "Usage: ./incr_value [-t] [-p] (<hostname> <port> | -u <path>) <username> <table> <key>\n";
+  std::cerr << "Options:\n";
+  std::cerr << "  -t          execute the increment as a transaction\n";
+  std::cerr << "  -p          send requests in two batches instead of waiting for each response\n";
+  std::cerr << "  -u <path>   connect through the server's Unix domain socket at <path>\n";
+}
+
+
+int main(int argc, char **argv) {
   bool use_transaction = false;
-  if ( argc == 7 ) {
-    use_transaction = true;
-    count = 2;
+  bool pipelined = false;
+  std::string socket_path;
+
+  int opt;
+  // Options must come first: getopt would otherwise take a table or key name like -1 for one
+  while ((opt = getopt(argc, argv, "+tpu:")) != -1) {
+    if (opt == 't') { use_transaction = true; }
+    else if (opt == 'p') { pipelined = true; }
+    else if (opt == 'u') { socket_path = optarg; }
+    else {
+      print_usage();
+      return 1;
+    }
+  }
+
+  // A Unix domain socket takes the place of the hostname and port
+  int num_address_args = socket_path.empty() ? 2 : 0;
+  if ( argc - optind != 3 + num_address_args ) {
+    print_usage();
+    return 1;
   }
 
-  std::string hostname = argv[count++];
-  std::string port = argv[count++];
+  int count = optind;
+
+  std::string hostname = num_address_args ? argv[count++] : "";
+  std::string port = num_address_args ? argv[count++] : "";
   std::string username = argv[count++];
   std::string table = argv[count++];
   std::string key = argv[count++];
 
   // Try to connect to server
-  int fd = open_clientfd(hostname.data(), port.data());
+  int fd = open_server_clientfd(hostname, port, socket_path);
   if (fd < 0) {
     std::cerr << "Error: Could not connect to server.\n";
     return 1;
   }
 
+  if (pipelined) {
+    return (pipelined_operations(username, table, key, use_transaction, fd) == 0) ? 0 : 1;
+  }
+
   /* LOGIN operation. Errors printed in functions */
   int login_result = login_operation(username, fd);
   if (login_result != 0) {
     return 1;
   }
 
-  /* BEGIN operation. Errors printed in functions. Only runs when 7 arguments are entered. */
+  /* BEGIN operation. Errors printed in functions. Only runs with the -t option. */
   if (use_transaction) {
     int begin_result = begin_operation(fd);
     if (begin_result != 0) {
@@ -296,7 +383,7 @@ int main(int argc, char **argv) {
     return 1;
   } 
 
-  /* COMMIT operation. Errors printed in functions. Only runs when 7 arguments are entered. */
+  /* COMMIT operation. Errors printed in functions. Only runs with the -t option. */
   if (use_transaction) {
     int commit_result = commit_operation(fd);
     if (commit_result != 0) {
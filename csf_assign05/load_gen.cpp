@@ -0,0 +1,393 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <cerrno>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "csapp.h"
+#include "unix_socket.h"
+#include "message.h"
+#include "message_serialization.h"
+
+using namespace MessageSerialization;
+
+typedef std::chrono::steady_clock Clock;
+
+/* State of one benchmark connection. Each connection always has one batch of requests in flight. */
+struct BenchConnection {
+  int fd;
+  bool next_is_get;
+  int outstanding;
+  Clock::time_point sent_at;
+  std::string inbuf;
+};
+
+/* Work assigned to one load generating thread, and the results it collected. */
+struct BenchThread {
+  pthread_t thr_id;
+  std::vector<BenchConnection> conns;
+  std::string hostname;
+  std::string port;
+  // Unix domain socket used instead of hostname:port, if not empty
+  std::string socket_path;
+  std::string encoded_login;
+  std::string encoded_get;
+  std::string encoded_pop;
+  std::string encoded_bye;
+  // Requests sent at once on a connection, starting with a GET or with a POP
+  int depth;
+  std::string batch_from_get;
+  std::string batch_from_pop;
+  Clock::time_point deadline;
+  long num_responses;
+  // Churning sessions that could not connect, and that were cut off after connecting
+  long num_refused;
+  long num_failed;
+  std::vector<double> latencies_us;
+};
+
+
+/* Send a request and wait for a single response line. Return 0 if a line was received, -1 otherwise. */
+int request_response(int fd, const std::string &encoded_msg, std::string &response) {
+  rio_writen(fd, (void *) encoded_msg.data(), encoded_msg.size());
+
+  rio_t read;
+  rio_readinitb(&read, fd);
+  char buf[Message::MAX_ENCODED_LEN];
+  ssize_t n = rio_readlineb(&read, buf, sizeof(buf));
+
+  if (n <= 0) { return -1; }
+  response = buf;
+  return 0;
+}
+
+
+/* Make sure the benchmarked table and key exist. Return 0 on success, -1 otherwise. */
+int setup_table(std::string hostname, std::string port, std::string socket_path, std::string table, std::string key) {
+  int fd = open_server_clientfd(hostname, port, socket_path);
+  if (fd < 0) { return -1; }
+
+  std::vector<Message> requests;
+  requests.push_back(Message(MessageType::LOGIN, { "loadgen" }));
+  // The table may exist from an earlier run, so a FAILED response is fine here
+  requests.push_back(Message(MessageType::CREATE, { table }));
+  requests.push_back(Message(MessageType::PUSH, { "1" }));
+  requests.push_back(Message(MessageType::SET, { table, key }));
+  requests.push_back(Message(MessageType::BYE));
+
+  for (auto it = requests.begin(); it != requests.end(); it++) {
+    std::string encoded_msg;
+    std::string response;
+    encode(*it, encoded_msg);
+
+    if (request_response(fd, encoded_msg, response) != 0) {
+      close(fd);
+      return -1;
+    }
+  }
+
+  close(fd);
+  return 0;
+}
+
+
+/* Open and log in a benchmark connection. Return the socket, or -1 on failure. */
+int open_bench_connection(std::string hostname, std::string port, std::string socket_path) {
+  int fd = open_server_clientfd(hostname, port, socket_path);
+  if (fd < 0) { return -1; }
+
+  std::string encoded_login;
+  std::string response;
+  encode(Message(MessageType::LOGIN, { "loadgen" }), encoded_login);
+
+  if (request_response(fd, encoded_login, response) != 0 || response != "OK\n") {
+    close(fd);
+    return -1;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+
+/* Send the next batch of a connection's GET/POP cycle with a single write. */
+void send_next_batch(BenchThread *bench, BenchConnection *conn) {
+  const std::string &batch = conn->next_is_get ? bench->batch_from_get : bench->batch_from_pop;
+  if (bench->depth % 2 == 1) { conn->next_is_get = !conn->next_is_get; }
+  conn->outstanding = bench->depth;
+  conn->sent_at = Clock::now();
+
+  // Batches are small, so the socket buffer always has room for them
+  if (write(conn->fd, batch.data(), batch.size()) < 0) {
+    std::cerr << "Error: could not send request.\n";
+  }
+}
+
+
+/* Keep one request in flight on every connection of the thread until the deadline. */
+void *bench_worker(void *arg) {
+  BenchThread *bench = static_cast<BenchThread *>( arg );
+
+  int epoll_fd = epoll_create1(0);
+  for (unsigned i = 0; i < bench->conns.size(); i++) {
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bench->conns[i].fd, &ev);
+    send_next_batch(bench, &bench->conns[i]);
+  }
+
+  epoll_event events[256];
+  char buf[4096];
+  while (Clock::now() < bench->deadline) {
+    int num_events = epoll_wait(epoll_fd, events, 256, 100);
+
+    for (int i = 0; i < num_events; i++) {
+      BenchConnection *conn = &bench->conns[events[i].data.u32];
+      ssize_t n = read(conn->fd, buf, sizeof(buf));
+      if (n <= 0) {
+        if (n < 0 && errno == EAGAIN) { continue; }
+        std::cerr << "Error: server closed a connection.\n";
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+        continue;
+      }
+      conn->inbuf.append(buf, n);
+
+      // Every complete response line finishes one request, and the last one finishes the batch
+      size_t newline;
+      while ((newline = conn->inbuf.find('\n')) != std::string::npos) {
+        conn->inbuf.erase(0, newline + 1);
+        bench->num_responses++;
+
+        if (--conn->outstanding == 0) {
+          std::chrono::duration<double, std::micro> latency = Clock::now() - conn->sent_at;
+          bench->latencies_us.push_back(latency.count());
+          send_next_batch(bench, conn);
+        }
+      }
+    }
+  }
+
+  close(epoll_fd);
+  return nullptr;
+}
+
+
+/* Repeat short sessions (connect, LOGIN, GET, BYE) until the deadline, timing each session. */
+void *churn_worker(void *arg) {
+  BenchThread *bench = static_cast<BenchThread *>( arg );
+  std::string response;
+
+  while (Clock::now() < bench->deadline) {
+    Clock::time_point start = Clock::now();
+
+    int fd = open_server_clientfd(bench->hostname, bench->port, bench->socket_path);
+    if (fd < 0) {
+      bench->num_refused++;
+      continue;
+    }
+
+    bool completed = request_response(fd, bench->encoded_login, response) == 0 &&
+                     request_response(fd, bench->encoded_get, response) == 0 &&
+                     request_response(fd, bench->encoded_bye, response) == 0;
+    close(fd);
+    if (!completed) {
+      bench->num_failed++;
+      continue;
+    }
+
+    std::chrono::duration<double, std::micro> latency = Clock::now() - start;
+    bench->latencies_us.push_back(latency.count());
+    bench->num_responses++;
+  }
+
+  return nullptr;
+}
+
+
+/* Open sockets that connect and never send anything, as left behind by a misbehaving client.
+Returns the sockets that could be opened. */
+std::vector<int> open_idle_sockets(std::string hostname, std::string port, std::string socket_path, int num_sockets) {
+  std::vector<int> fds;
+
+  for (int i = 0; i < num_sockets; i++) {
+    int fd = open_server_clientfd(hostname, port, socket_path);
+    if (fd < 0) {
+      std::cerr << "Error: Could not open idle socket " << i << ".\n";
+      break;
+    }
+    fds.push_back(fd);
+  }
+
+  return fds;
+}
+
+
+/* Close idle sockets, and return how many of them the server had already rejected or timed out. */
+long close_idle_sockets(const std::vector<int> &fds) {
+  long num_closed_by_server = 0;
+  char buf[256];
+
+  // A socket the server closed has its ERROR line or the hangup waiting to be read
+  for (auto it = fds.begin(); it != fds.end(); it++) {
+    if (recv(*it, buf, sizeof(buf), MSG_DONTWAIT) >= 0) { num_closed_by_server++; }
+    close(*it);
+  }
+
+  return num_closed_by_server;
+}
+
+
+int main(int argc, char **argv)
+{
+  int num_connections = 100;
+  int num_threads = 1;
+  int seconds = 5;
+  bool churn = false;
+  int depth = 1;
+  int num_idle = 0;
+  int num_tables = 1;
+  std::string socket_path;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:T:d:rp:i:u:n:")) != -1) {
+    switch (opt) {
+      case 'p': depth = atoi(optarg); break;
+      case 'i': num_idle = atoi(optarg); break;
+      case 'c': num_connections = atoi(optarg); break;
+      case 'r': churn = true; break;
+      case 'T': num_threads = atoi(optarg); break;
+      case 'd': seconds = atoi(optarg); break;
+      case 'u': socket_path = optarg; break;
+      case 'n': num_tables = atoi(optarg); break;
+      default: num_connections = 0;
+    }
+  }
+
+  // A Unix domain socket takes the place of the hostname and port
+  int num_address_args = socket_path.empty() ? 2 : 0;
+  if ( argc - optind != 2 + num_address_args || num_connections < 1 || num_threads < 1 || seconds < 1 || depth < 1 || num_idle < 0 || num_tables < 1 ) {
+    std::cerr << "Usage: ./load_gen [-r] [-c <connections>] [-T <threads>] [-d <seconds>] [-p <depth>] [-i <sockets>]\n";
+    std::cerr << "                  [-n <tables>] (<hostname> <port> | -u <path>) <table> <key>\n";
+    std::cerr << "Options:\n";
+    std::cerr << "  -r                 reconnect for every LOGIN/GET/BYE session instead of\n";
+    std::cerr << "                     keeping connections open (one thread per connection)\n";
+    std::cerr << "  -c <connections>   number of concurrent client connections (default 100)\n";
+    std::cerr << "  -T <threads>       number of load generating threads (default 1)\n";
+    std::cerr << "  -d <seconds>       duration of the measurement (default 5)\n";
+    std::cerr << "  -p <depth>         requests pipelined in each batch (default 1); latencies\n";
+    std::cerr << "                     are reported per batch\n";
+    std::cerr << "  -i <sockets>       also open <sockets> idle connections that never send\n";
+    std::cerr << "                     anything, and hold them for the whole measurement\n";
+    std::cerr << "  -n <tables>        spread the load over the tables <table>0 to <table><tables - 1>,\n";
+    std::cerr << "                     one per load generating thread in turn (default: <table> only)\n";
+    std::cerr << "  -u <path>          connect through the server's Unix domain socket at <path>\n";
+    return 1;
+  }
+
+  std::string hostname = num_address_args ? argv[optind] : "";
+  std::string port = num_address_args ? argv[optind + 1] : "";
+  optind += num_address_args;
+  std::string table = argv[optind];
+  std::string key = argv[optind + 1];
+
+  std::vector<std::string> tables;
+  for (int i = 0; i < num_tables; i++) {
+    tables.push_back(num_tables == 1 ? table : table + std::to_string(i));
+    if (setup_table(hostname, port, socket_path, tables[i], key) != 0) {
+      std::cerr << "Error: Could not set up the benchmark table.\n";
+      return 1;
+    }
+  }
+
+  // Churning clients each run in their own thread
+  if (churn) { num_threads = num_connections; }
+
+  std::vector<BenchThread> threads(num_threads);
+  for (int i = 0; i < num_threads; i++) {
+    threads[i].hostname = hostname;
+    threads[i].port = port;
+    threads[i].socket_path = socket_path;
+    encode(Message(MessageType::LOGIN, { "loadgen" }), threads[i].encoded_login);
+    encode(Message(MessageType::GET, { tables[i % num_tables], key }), threads[i].encoded_get);
+    encode(Message(MessageType::POP), threads[i].encoded_pop);
+    encode(Message(MessageType::BYE), threads[i].encoded_bye);
+
+    threads[i].depth = depth;
+    threads[i].num_responses = 0;
+    threads[i].num_refused = 0;
+    threads[i].num_failed = 0;
+    for (int j = 0; j < depth; j++) {
+      threads[i].batch_from_get += (j % 2 == 0) ? threads[i].encoded_get : threads[i].encoded_pop;
+      threads[i].batch_from_pop += (j % 2 == 0) ? threads[i].encoded_pop : threads[i].encoded_get;
+    }
+  }
+
+  // Connections are spread evenly over the load generating threads
+  for (int i = 0; i < num_connections && !churn; i++) {
+    int fd = open_bench_connection(hostname, port, socket_path);
+    if (fd < 0) {
+      std::cerr << "Error: Could not open connection " << i << ".\n";
+      return 1;
+    }
+
+    BenchConnection conn;
+    conn.fd = fd;
+    conn.next_is_get = true;
+    threads[i % num_threads].conns.push_back(conn);
+  }
+
+  // The idle sockets are opened after the measured connections have logged in, and are held
+  // for the whole measurement
+  std::vector<int> idle_fds = open_idle_sockets(hostname, port, socket_path, num_idle);
+
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < num_threads; i++) {
+    threads[i].deadline = start + std::chrono::seconds(seconds);
+    pthread_create(&threads[i].thr_id, nullptr, churn ? churn_worker : bench_worker, &threads[i]);
+  }
+
+  std::vector<double> latencies_us;
+  long num_responses = 0;
+  long num_refused = 0;
+  long num_failed = 0;
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i].thr_id, nullptr);
+    num_responses += threads[i].num_responses;
+    num_refused += threads[i].num_refused;
+    num_failed += threads[i].num_failed;
+    latencies_us.insert(latencies_us.end(), threads[i].latencies_us.begin(), threads[i].latencies_us.end());
+  }
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+
+  if (latencies_us.empty()) {
+    std::cerr << "Error: no requests completed.\n";
+    return 1;
+  }
+
+  std::sort(latencies_us.begin(), latencies_us.end());
+  std::cout << "connections " << num_connections
+            << (churn ? "  sessions " : "  requests ") << num_responses
+            << (churn ? "  sessions/s " : "  req/s ") << (long) (num_responses / elapsed.count())
+            << "  p50 " << latencies_us[latencies_us.size() / 2] << "us"
+            << "  p99 " << latencies_us[latencies_us.size() * 99 / 100] << "us"
+            << "  max " << latencies_us.back() << "us";
+  if (churn) { std::cout << "  refused " << num_refused << "  failed " << num_failed; }
+  if (num_idle > 0) {
+    std::cout << "  idle sockets " << idle_fds.size() << " (closed by server " << close_idle_sockets(idle_fds) << ")";
+  }
+  std::cout << "\n";
+
+  for (int i = 0; i < num_threads; i++) {
+    for (auto it = threads[i].conns.begin(); it != threads[i].conns.end(); it++) {
+      close(it->fd);
+    }
+  }
+
+  return 0;
+}
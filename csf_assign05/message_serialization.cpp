@@ -1,7 +1,5 @@
-#include <utility>
-#include <sstream>
-#include <cassert>
-#include <map>
+#include <iterator>
+#include <cctype>
 #include "exceptions.h"
 #include "message_serialization.h"
 
@@ -55,9 +53,13 @@ void MessageSerialization::encode( const Message &msg, std::string &encoded_msg
 
   // Add message arguments to the encoded message
   int num_args = msg.get_num_args();
+  // The text argument of a FAILED or ERROR response is quoted
+  bool quoted = (m_type == MessageType::FAILED || m_type == MessageType::ERROR);
   for (int i = 0; i < num_args; i++) {
     encoded_msg += " ";
+    if (quoted) { encoded_msg += "\""; }
     encoded_msg += msg.get_arg(i);
+    if (quoted) { encoded_msg += "\""; }
   }
 
   // Add newline character
@@ -68,83 +70,62 @@ void MessageSerialization::encode( const Message &msg, std::string &encoded_msg
   catch (InvalidMessage const& ex) { throw InvalidMessage(ex.what()); }
 }
 
+namespace {
+  // Names of the message types, as they appear at the start of an encoded message
+  const struct { std::string_view name; MessageType type; } MESSAGE_TYPE_NAMES[] = {
+    { "BEGIN", MessageType::BEGIN },   { "COMMIT", MessageType::COMMIT }, { "POP", MessageType::POP },
+    { "TOP", MessageType::TOP },       { "ADD", MessageType::ADD },       { "SUB", MessageType::SUB },
+    { "MUL", MessageType::MUL },       { "DIV", MessageType::DIV },       { "BYE", MessageType::BYE },
+    { "OK", MessageType::OK },         { "FAILED", MessageType::FAILED }, { "ERROR", MessageType::ERROR },
+    { "LOGIN", MessageType::LOGIN },   { "CREATE", MessageType::CREATE }, { "PUSH", MessageType::PUSH },
+    { "SET", MessageType::SET },       { "GET", MessageType::GET },       { "DATA", MessageType::DATA },
+  };
+
+  bool is_space(char c) { return isspace(static_cast<unsigned char>(c)) != 0; }
+}
+
 void MessageSerialization::decode( const std::string &encoded_msg_, Message &msg )
 {
-  try { check_message_size(encoded_msg_); }
-  catch (InvalidMessage const& ex) { throw InvalidMessage(ex.what()); }
+  MessageView view;
+  decode_view(encoded_msg_, view);
+
+  // Copy the arguments out of the encoded message
+  msg.set_message_type(view.get_message_type());
+  msg.clear_args();
+  for (unsigned i = 0; i < view.get_num_args(); i++) {
+    msg.push_arg(std::string(view.get_arg(i)));
+  }
+}
 
-  if (encoded_msg_.back() != '\n') { throw InvalidMessage("Encoded message is missing a newline."); }
+void MessageSerialization::decode_view( std::string_view encoded_msg, MessageView &msg )
+{
+  check_message_size(encoded_msg);
 
-  // Get the string containing the encoded message's type
-  std::stringstream ss(encoded_msg_);
+  if (encoded_msg.empty() || encoded_msg.back() != '\n') { throw InvalidMessage("Encoded message is missing a newline."); }
 
-  std::string m_type; 
-  ss >> m_type;
+  // Find the word holding the encoded message's type
+  size_t type_start = 0;
+  while (type_start < encoded_msg.size() && is_space(encoded_msg[type_start])) { type_start++; }
+  size_t type_end = type_start;
+  while (type_end < encoded_msg.size() && !is_space(encoded_msg[type_end])) { type_end++; }
+  std::string_view m_type = encoded_msg.substr(type_start, type_end - type_start);
 
   // Add the message's type to the decoded message
-  if (m_type == "BEGIN") {
-    msg.set_message_type(MessageType::BEGIN);
-  }
-  else if (m_type == "COMMIT") {
-    msg.set_message_type(MessageType::COMMIT);
-  }
-  else if (m_type == "POP") {
-    msg.set_message_type(MessageType::POP);
-  }
-  else if (m_type == "TOP") {
-    msg.set_message_type(MessageType::TOP);
-  }
-  else if (m_type == "ADD") {
-    msg.set_message_type(MessageType::ADD);
-  }
-  else if (m_type == "SUB") {
-    msg.set_message_type(MessageType::SUB);
-  }
-  else if (m_type == "MUL") {
-    msg.set_message_type(MessageType::MUL);
-  }
-  else if (m_type == "DIV") {
-    msg.set_message_type(MessageType::DIV);
-  }
-  else if (m_type == "BYE") {
-    msg.set_message_type(MessageType::BYE);
-  }
-  else if (m_type == "OK") {
-    msg.set_message_type(MessageType::OK);
-  }
-  else if (m_type == "FAILED") {
-    msg.set_message_type(MessageType::FAILED);
-  }
-  else if (m_type == "ERROR") {
-    msg.set_message_type(MessageType::ERROR);
-  }
-  else if (m_type == "LOGIN") {
-    msg.set_message_type(MessageType::LOGIN);
-  }
-  else if (m_type == "CREATE") {
-    msg.set_message_type(MessageType::CREATE);
-  }
-  else if (m_type == "PUSH") {
-    msg.set_message_type(MessageType::PUSH);
-  }
-  else if (m_type == "SET") {
-    msg.set_message_type(MessageType::SET);
-  }
-  else if (m_type == "GET") {
-    msg.set_message_type(MessageType::GET);
-  }
-  else if (m_type == "DATA") {
-    msg.set_message_type(MessageType::DATA);
-  } else {
-    throw InvalidMessage("Message must have a type.");
+  msg.set_message_type(MessageType::NONE);
+  for (auto it = std::begin(MESSAGE_TYPE_NAMES); it != std::end(MESSAGE_TYPE_NAMES); it++) {
+    if (it->name == m_type) {
+      msg.set_message_type(it->type);
+      break;
+    }
   }
+  if (msg.get_message_type() == MessageType::NONE) { throw InvalidMessage("Message must have a type."); }
 
   // Clear msg's arguments
   msg.clear_args();
 
-  // Convert the rest of the stringstream to a string, and make sure it ends with a newline
-  std::string remaining_text;
-  std::getline(ss, remaining_text);
+  // The arguments are the rest of the line
+  size_t newline = encoded_msg.find('\n', type_end);
+  std::string_view remaining_text = encoded_msg.substr(type_end, newline - type_end);
 
   // If the rest of the string is a quoted text, push the text as the Message's only argument
   MessageType msg_type = msg.get_message_type();
@@ -160,10 +141,13 @@ void MessageSerialization::decode( const std::string &encoded_msg_, Message &msg
   if (!msg.is_valid()) {
     throw InvalidMessage("Message is not valid.");
   }
+
+  // The table and key are hashed here once, for every lookup the request makes
+  if (msg_type == MessageType::GET || msg_type == MessageType::SET) { msg.hash_args(); }
 }
 
 
-void MessageSerialization::check_message_size(std::string msg) {
+void MessageSerialization::check_message_size(std::string_view msg) {
 
   if (msg.length() > Message::MAX_ENCODED_LEN) {
     throw InvalidMessage("Message is too long.");
@@ -171,7 +155,7 @@ void MessageSerialization::check_message_size(std::string msg) {
 }
 
 
-void MessageSerialization::extract_quoted_text_arg(Message* msg, std::string quoted_text) {
+void MessageSerialization::extract_quoted_text_arg(MessageView* msg, std::string_view quoted_text) {
 
     size_t open_quote_ind = quoted_text.find_first_of('"');
     size_t close_quote_ind = quoted_text.find_last_of('"');
@@ -181,19 +165,22 @@ void MessageSerialization::extract_quoted_text_arg(Message* msg, std::string quo
       throw InvalidMessage("Message whose type requires a quoted text argument does not contain a quotation.");
     }
 
-    quoted_text = quoted_text.substr(open_quote_ind + 1, close_quote_ind - open_quote_ind - 1);
-    msg->push_arg(quoted_text);
+    msg->push_arg(quoted_text.substr(open_quote_ind + 1, close_quote_ind - open_quote_ind - 1));
 }
 
 
-void MessageSerialization::extract_single_word_args(Message* msg, std::string args_list) {
-  
-  std::stringstream ss(args_list);
-  std::string curr_arg;
+void MessageSerialization::extract_single_word_args(MessageView* msg, std::string_view args_list) {
 
-  while(ss >> curr_arg) {
-    msg->push_arg(curr_arg);
+  size_t pos = 0;
+  while (pos < args_list.size()) {
+    // Skip the white space before the next word
+    if (is_space(args_list[pos])) {
+      pos++;
+      continue;
+    }
+
+    size_t word_start = pos;
+    while (pos < args_list.size() && !is_space(args_list[pos])) { pos++; }
+    msg->push_arg(args_list.substr(word_start, pos - word_start));
   }
 }
-
-
@@ -1,7 +1,9 @@
 #ifndef MESSAGE_SERIALIZATION_H
 #define MESSAGE_SERIALIZATION_H
 
+#include <string_view>
 #include "message.h"
+#include "message_view.h"
 
 namespace MessageSerialization {
 
@@ -9,12 +11,19 @@ namespace MessageSerialization {
 
   void decode(const std::string &encoded_msg, Message &msg);
 
+  /* 
+   * Decodes a message without copying it. The view's arguments point into encoded_msg,
+   * which must outlive the view.
+   * @throws InvalidMessage if the encoded message is not a valid Message.
+  */
+  void decode_view(std::string_view encoded_msg, MessageView &msg);
+
   /* 
    * Throws an InvalidMessage exception if an encoded Message exceeds MAX_ENCODED_LEN. 
    * @param msg The encoded message.
    * @throws InvalidMessage exception.
   */
-  void check_message_size(std::string msg);
+  void check_message_size(std::string_view msg);
 
   /* 
   * Finds the text between quotation marks and pushes it to a Message's arguments.
@@ -22,14 +31,14 @@ namespace MessageSerialization {
   * @param quoted_text The text between the quotation marks.
   * @throws InvalidMessage if the encoded Message doesn't include a quotation.
   */
-  void extract_quoted_text_arg(Message* msg, std::string quoted_text);
+  void extract_quoted_text_arg(MessageView* msg, std::string_view quoted_text);
 
   /* 
-  * Takes a stringstream of arguments and pushes each word in the stringstream as a Message's argument.
+  * Takes a list of arguments and pushes each word in the list as a Message's argument.
   * @param msg The encoded message.
   * @param args The list of arguments.
   */
-  void extract_single_word_args(Message* msg, std::string args);
+  void extract_single_word_args(MessageView* msg, std::string_view args);
 
 };
 
@@ -0,0 +1,92 @@
+#include <algorithm>
+#include <cctype>
+#include "message_view.h"
+
+MessageView::MessageView( MessageType message_type )
+  : m_message_type( message_type )
+  , m_num_args( 0 )
+  , m_hashes()
+{
+}
+
+void MessageView::push_arg( std::string_view arg )
+{
+  if (m_num_args < MAX_ARGS) { m_args[m_num_args] = arg; }
+  m_num_args++;
+}
+
+void MessageView::hash_args()
+{
+  for (unsigned i = 0; i < m_num_args && i < MAX_ARGS; i++) { m_hashes[i] = HashedKey::hash_of(m_args[i]); }
+}
+
+/* Checks that Network Protocols are followed. Protocols are checked separately for readability. */
+bool MessageView::is_valid() const
+{
+  MessageType msg_type = get_message_type();
+
+  // If a request that takes no arguments has an incorrect number of arguments
+  if      ((msg_type == MessageType::POP || msg_type == MessageType::TOP || msg_type == MessageType::ADD   || msg_type == MessageType::MUL ||
+            msg_type == MessageType::SUB || msg_type == MessageType::DIV || msg_type == MessageType::BEGIN || msg_type == MessageType::COMMIT ||
+            msg_type == MessageType::BYE)
+            && (m_num_args != 0)) {
+
+    return false;
+  }
+
+  // If a request that takes one argument has an incorrect number of arguments
+  else if ((msg_type == MessageType::LOGIN || msg_type == MessageType::CREATE || msg_type == MessageType::PUSH || msg_type == MessageType::DATA)
+            && (m_num_args != 1)) {
+
+    return false;
+  }
+
+  // If a request that takes two arguments has an incorrect number of arguments
+  else if ((msg_type == MessageType::SET || msg_type == MessageType::GET) && (m_num_args != 2)) {
+
+    return false;
+  }
+
+  // If the first argument is an identifier
+  else if (msg_type == MessageType::LOGIN || msg_type == MessageType::CREATE ||
+           msg_type == MessageType::SET   || msg_type == MessageType::GET) {
+
+    if (!is_valid_identifier(m_args[0])) { return false; }
+
+    // And there are two arguments, with the second being an identifier
+    if (msg_type == MessageType::SET || msg_type == MessageType::GET) {
+      if (!is_valid_identifier(m_args[1])) { return false; }
+    }
+  }
+
+  // If the argument is a value
+  else if (msg_type == MessageType::PUSH) {
+
+    // and only contains white space
+    if (std::all_of(m_args[0].begin(), m_args[0].end(), isspace)) { return false; }
+  }
+
+  // Otherwise
+  return true;
+}
+
+
+bool MessageView::is_valid_identifier( std::string_view arg ) {
+  // and the identifier is empty or the first character is not a letter
+    if (arg.empty() || !((arg[0] >= 'A' && arg[0] <= 'Z') || (arg[0] >= 'a' && arg[0] <= 'z'))) {
+      return false;
+    }
+
+    // or the rest of the identifier contains an invalid character
+    int identifier_length = arg.length();
+    for (int i = 1; i < identifier_length; i++) {
+
+      if (!((arg[i] >= 'A' && arg[i] <= 'Z') || (arg[i] >= 'a' && arg[i] <= 'z') ||
+            (arg[i] >= '0' && arg[i] <= '9') ||  arg[i] == '_')) {
+
+        return false;
+      }
+    }
+
+    return true;
+}
@@ -0,0 +1,56 @@
+#ifndef MESSAGE_VIEW_H
+#define MESSAGE_VIEW_H
+
+#include <string_view>
+#include "message.h"
+#include "hashed_key.h"
+
+/*
+ * A decoded Message whose arguments point into the encoded line instead of owning
+ * copies of it. A MessageView is only valid as long as that line is unchanged, so
+ * anything kept after the request is handled (a value pushed on the stack or stored
+ * in a Table) has to be copied out of it.
+ */
+class MessageView {
+private:
+  // No valid message has more arguments; any further arguments are only counted
+  static const unsigned MAX_ARGS = 2;
+
+  MessageType m_message_type;
+  std::string_view m_args[MAX_ARGS];
+  unsigned m_num_args;
+
+  /* Hashes of the arguments, once hash_args has computed them. */
+  size_t m_hashes[MAX_ARGS];
+
+public:
+  MessageView( MessageType message_type = MessageType::NONE );
+
+  MessageType get_message_type() const { return m_message_type; }
+  void set_message_type( MessageType message_type ) { m_message_type = message_type; }
+
+  std::string_view get_username() const { return m_args[0]; }
+  std::string_view get_table() const { return m_args[0]; }
+  std::string_view get_key() const { return m_args[1]; }
+  HashedKey get_hashed_table() const { return HashedKey(m_args[0], m_hashes[0]); }
+  HashedKey get_hashed_key() const { return HashedKey(m_args[1], m_hashes[1]); }
+  std::string_view get_value() const { return m_args[0]; }
+  std::string_view get_quoted_text() const { return m_args[0]; }
+
+  void push_arg( std::string_view arg );
+
+  void clear_args() { m_num_args = 0; }
+
+  /* Hashes the table and key of a GET or SET, for get_hashed_table and get_hashed_key. */
+  void hash_args();
+
+  /* Checks that the message follows the network protocol. */
+  bool is_valid() const;
+
+  static bool is_valid_identifier( std::string_view arg );
+
+  unsigned get_num_args() const { return m_num_args; }
+  std::string_view get_arg( unsigned i ) const { return m_args[i]; }
+};
+
+#endif // MESSAGE_VIEW_H
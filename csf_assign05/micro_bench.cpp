@@ -0,0 +1,887 @@
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <fstream>
+#include "message.h"
+#include "message_view.h"
+#include "message_serialization.h"
+#include "server.h"
+#include "client_connection.h"
+#include "table.h"
+#include "flat_map.h"
+#include "arena.h"
+#include "table_directory.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "parallel_restore.h"
+
+using namespace MessageSerialization;
+
+typedef std::chrono::steady_clock Clock;
+
+/* Requests timed by the benchmarks: a mix of short and two-argument requests, as a client
+incrementing a value would send them. Each batch leaves the stack as it found it. */
+const char BATCH[] = "PUSH 1\nSET bench counter\nGET bench counter\nPUSH 2\nADD\nTOP\nPOP\n";
+const int MESSAGES_PER_BATCH = 7;
+
+
+namespace {
+  // Counts calls to the global allocation functions below while set
+  bool count_allocations = false;
+  long num_allocations = 0;
+
+  void *counted_malloc( size_t size ) {
+    if ( count_allocations ) { num_allocations++; }
+    void *p = malloc( size ? size : 1 );
+    if ( p == nullptr ) { throw std::bad_alloc(); }
+    return p;
+  }
+}
+
+void *operator new( size_t size ) { return counted_malloc( size ); }
+void *operator new[]( size_t size ) { return counted_malloc( size ); }
+
+// Every form of operator new above takes its memory from malloc, which GCC cannot see when it
+// inlines one of these into a caller that used a new expression
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete( void *p ) noexcept { free( p ); }
+void operator delete[]( void *p ) noexcept { free( p ); }
+void operator delete( void *p, size_t ) noexcept { free( p ); }
+void operator delete[]( void *p, size_t ) noexcept { free( p ); }
+#pragma GCC diagnostic pop
+
+
+/* Print the cost of one message for a benchmark that handled num_messages in elapsed time. */
+void report(const std::string &name, long num_messages, std::chrono::duration<double> elapsed) {
+  std::cout << name << "  messages " << num_messages
+            << "  ns/message " << (elapsed.count() * 1e9 / num_messages) << "\n";
+}
+
+
+/* Decodes and dispatches requests through a ClientConnection, without any socket I/O. */
+void bench_dispatch(long num_batches) {
+  Server server;
+  server.create_table("bench");
+
+  // The connection never touches its socket while it is fed through on_data
+  ClientConnection conn(&server, -1);
+  std::string login = "LOGIN bench\n";
+  std::string out;
+  conn.on_data(login.data(), login.size());
+  conn.take_output(out);
+
+  Clock::time_point start = Clock::now();
+  for (long i = 0; i < num_batches; i++) {
+    conn.on_data(BATCH, sizeof(BATCH) - 1);
+    conn.take_output(out);
+  }
+  report("dispatch", num_batches * MESSAGES_PER_BATCH, Clock::now() - start);
+}
+
+
+/* Autocommit GETs of one key, and of keys spread over a large table, each followed by a
+POP, through a ClientConnection without any socket I/O. */
+void bench_get(long num_gets) {
+  const int KEY_COUNTS[] = { 1, 100000 };
+  const int GETS_PER_BATCH = 256;
+
+  for (int num_keys : KEY_COUNTS) {
+    Server server;
+    server.create_table("bench");
+    Table *table = server.find_table("bench");
+    for (int i = 0; i < num_keys; i++) { table->restore("key" + std::to_string(i), std::to_string(i)); }
+
+    std::string batch;
+    for (int i = 0; i < GETS_PER_BATCH; i++) {
+      batch += "GET bench key" + std::to_string(i * 7919 % num_keys) + "\nPOP\n";
+    }
+
+    ClientConnection conn(&server, -1);
+    std::string login = "LOGIN bench\n";
+    std::string out;
+    conn.on_data(login.data(), login.size());
+    conn.take_output(out);
+
+    long num_batches = std::max(num_gets / GETS_PER_BATCH, 1L);
+    Clock::time_point start = Clock::now();
+    for (long i = 0; i < num_batches; i++) {
+      conn.on_data(batch.data(), batch.size());
+      conn.take_output(out);
+    }
+    report("get+pop  keys " + std::to_string(num_keys), num_batches * GETS_PER_BATCH, Clock::now() - start);
+  }
+}
+
+
+/* Decodes every line of a batch into an owning Message and into a MessageView. */
+void bench_decode(long num_batches) {
+  std::string batch = BATCH;
+  long num_messages = num_batches * MESSAGES_PER_BATCH;
+
+  Message msg;
+  Clock::time_point start = Clock::now();
+  for (long i = 0; i < num_batches; i++) {
+    size_t line_start = 0;
+    for (int j = 0; j < MESSAGES_PER_BATCH; j++) {
+      size_t newline = batch.find('\n', line_start);
+      decode(batch.substr(line_start, newline - line_start + 1), msg);
+      line_start = newline + 1;
+    }
+  }
+  report("decode Message", num_messages, Clock::now() - start);
+
+  MessageView view;
+  std::string_view batch_view = batch;
+  start = Clock::now();
+  for (long i = 0; i < num_batches; i++) {
+    size_t line_start = 0;
+    for (int j = 0; j < MESSAGES_PER_BATCH; j++) {
+      size_t newline = batch_view.find('\n', line_start);
+      decode_view(batch_view.substr(line_start, newline - line_start + 1), view);
+      line_start = newline + 1;
+    }
+  }
+  report("decode MessageView", num_messages, Clock::now() - start);
+}
+
+
+/* Threads reading one table at once, as autocommit GETs do (sharing their key's stripe), and
+under an exclusive table lock. */
+void bench_table_get(long num_gets) {
+  Table table("bench");
+  const int NUM_KEYS = 1024;
+  for (int i = 0; i < NUM_KEYS; i++) { table.restore("key" + std::to_string(i), std::to_string(i)); }
+
+  for (int shared = 1; shared >= 0; shared--) {
+    for (int num_threads = 1; num_threads <= 16; num_threads *= 2) {
+      std::vector<std::thread> threads;
+
+      Clock::time_point start = Clock::now();
+      for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&table, shared, num_gets, t]() {
+          std::string key = "key" + std::to_string(t % NUM_KEYS);
+          unsigned stripe = table.get_stripe(key);
+          for (long i = 0; i < num_gets; i++) {
+            if (shared) { table.lock_stripe(stripe, true); }
+            else { table.lock(); }
+            if (table.has_key(key)) { table.get(key); }
+            if (shared) { table.unlock_stripe(stripe); }
+            else { table.unlock(); }
+          }
+        });
+      }
+      for (auto it = threads.begin(); it != threads.end(); it++) { it->join(); }
+      std::chrono::duration<double> elapsed = Clock::now() - start;
+
+      std::cout << (shared ? "get shared" : "get exclusive") << "  threads " << num_threads
+                << "  gets/s " << (long) (num_gets * num_threads / elapsed.count()) << "\n";
+    }
+  }
+}
+
+
+/* Threads setting their own keys of one table, as autocommit SETs do, with the table's keys
+in a single stripe and spread over many. */
+void bench_table_set(long num_sets) {
+  const unsigned STRIPE_COUNTS[] = { 1, 64 };
+  const int THREAD_COUNTS[] = { 1, 4, 16, 64 };
+  const int KEYS_PER_THREAD = 1024;
+
+  for (unsigned num_stripes : STRIPE_COUNTS) {
+    for (int num_threads : THREAD_COUNTS) {
+      Table table("bench", num_stripes);
+      std::vector<std::thread> threads;
+
+      Clock::time_point start = Clock::now();
+      for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&table, num_sets, t]() {
+          for (long i = 0; i < num_sets; i++) {
+            std::string key = std::to_string(t) + ":" + std::to_string(i % KEYS_PER_THREAD);
+            unsigned stripe = table.get_stripe(key);
+            table.lock_stripe(stripe, false);
+            table.set(key, "1");
+            table.commit_stripe(stripe);
+            table.unlock_stripe(stripe);
+          }
+        });
+      }
+      for (auto it = threads.begin(); it != threads.end(); it++) { it->join(); }
+      std::chrono::duration<double> elapsed = Clock::now() - start;
+
+      std::cout << "set  stripes " << num_stripes << "  threads " << num_threads
+                << "  sets/s " << (long) (num_sets * num_threads / elapsed.count()) << "\n";
+    }
+  }
+}
+
+
+/* Threads looking tables up by name, alone and while another thread creates tables as fast
+as it can (up to MAX_CREATES), through find and insert. */
+template<typename Find, typename Insert>
+void bench_lookups(const std::string &name, long num_lookups, Find find, Insert insert) {
+  const int NUM_TABLES = 64;
+  const int THREAD_COUNTS[] = { 1, 2, 4 };
+  const long MAX_CREATES = 1000000;
+
+  std::vector<std::string> names;
+  for (int i = 0; i < NUM_TABLES; i++) { names.push_back("table" + std::to_string(i)); }
+  for (auto it = names.begin(); it != names.end(); it++) { insert(*it); }
+  long num_created = 0;
+
+  for (int storm = 0; storm <= 1; storm++) {
+    for (int num_threads : THREAD_COUNTS) {
+      std::atomic<bool> readers_done(false);
+      long creates = 0;
+      std::thread creator;
+      if (storm) {
+        creator = std::thread([&]() {
+          while (!readers_done.load() && creates < MAX_CREATES) {
+            insert("storm" + std::to_string(num_created++));
+            creates++;
+          }
+        });
+      }
+
+      std::vector<std::thread> threads;
+      Clock::time_point start = Clock::now();
+      for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&names, &find, num_lookups, t]() {
+          long found = 0;
+          for (long i = 0; i < num_lookups; i++) { found += find(names[(i + t) % NUM_TABLES]) != nullptr; }
+          if (found != num_lookups) { std::cerr << "Error: missing table\n"; }
+        });
+      }
+      for (auto it = threads.begin(); it != threads.end(); it++) { it->join(); }
+      std::chrono::duration<double> elapsed = Clock::now() - start;
+      readers_done = true;
+      if (storm) { creator.join(); }
+
+      std::cout << name << "  " << (storm ? "create storm" : "lookups only") << "  threads " << num_threads
+                << "  lookups/s " << (long) (num_lookups * num_threads / elapsed.count())
+                << "  creates/s " << (long) (creates / elapsed.count()) << "\n";
+    }
+  }
+}
+
+/* Server's TableDirectory, which looks names up without locking, against a std::unordered_map
+behind a mutex, as the directory would have to be to let CREATE change it safely. */
+void bench_directory(long num_lookups) {
+  Table table("bench");
+
+  TableDirectory directory;
+  bench_lookups("directory", num_lookups,
+                [&directory](const std::string &name) { return directory.find(HashedKey(name)); },
+                [&directory, &table](const std::string &name) { directory.insert(name, &table); });
+
+  std::unordered_map<std::string, Table *> map;
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  bench_lookups("locked map", num_lookups,
+                [&map, &mutex](const std::string &name) {
+                  pthread_mutex_lock(&mutex);
+                  auto it = map.find(name);
+                  Table *found = it == map.end() ? nullptr : it->second;
+                  pthread_mutex_unlock(&mutex);
+                  return found;
+                },
+                [&map, &mutex, &table](const std::string &name) {
+                  pthread_mutex_lock(&mutex);
+                  map.emplace(name, &table);
+                  pthread_mutex_unlock(&mutex);
+                });
+}
+
+
+/* Threads committing autocommit-SET-sized records to a write-ahead log in each durability
+mode, with the throughput and the latency of a commit. */
+void bench_wal(long num_commits) {
+  const std::string PATH = "micro_bench_wal.log";
+  const int THREAD_COUNTS[] = { 1, 4, 16 };
+  const int PERIOD_MS = 10;
+
+  struct Mode {
+    const char *name;
+    WriteAheadLog::Durability durability;
+  };
+  const Mode MODES[] = {
+    { "fsync", WriteAheadLog::Durability::EVERY_COMMIT },
+    { "group", WriteAheadLog::Durability::GROUP_COMMIT },
+    { "periodic", WriteAheadLog::Durability::PERIODIC },
+  };
+
+  for (const Mode &mode : MODES) {
+    for (int num_threads : THREAD_COUNTS) {
+      unlink(PATH.c_str());
+      WriteAheadLog *log = new WriteAheadLog(PATH, mode.durability, PERIOD_MS);
+      std::vector<std::vector<double>> latencies(num_threads);
+      std::vector<std::thread> threads;
+
+      Clock::time_point start = Clock::now();
+      for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([log, num_commits, t, &latencies]() {
+          std::string record;
+          for (long i = 0; i < num_commits; i++) {
+            record.clear();
+            WriteAheadLog::append_set(record, "bench", "user:" + std::to_string(t * num_commits + i),
+                                      "first value of thirty-two bytes.");
+            Clock::time_point committed = Clock::now();
+            log->commit(record);
+            latencies[t].push_back(std::chrono::duration<double, std::micro>(Clock::now() - committed).count());
+          }
+        });
+      }
+      for (auto it = threads.begin(); it != threads.end(); it++) { it->join(); }
+      std::chrono::duration<double> elapsed = Clock::now() - start;
+      delete log;
+
+      std::vector<double> all;
+      for (auto it = latencies.begin(); it != latencies.end(); it++) { all.insert(all.end(), it->begin(), it->end()); }
+      std::sort(all.begin(), all.end());
+      std::cout << "wal  " << mode.name << "  threads " << num_threads
+                << "  commits/s " << (long) (all.size() / elapsed.count())
+                << "  p50 " << all[all.size() / 2] << "us  p99 " << all[all.size() * 99 / 100] << "us\n";
+    }
+  }
+  unlink(PATH.c_str());
+}
+
+
+/* Startup of a server whose log SETs each of num_keys keys twice: replaying the whole log,
+and loading a snapshot of the same tables (with nothing after it in the log to replay). */
+void bench_startup(long num_keys) {
+  const std::string PATH = "micro_bench_startup.log";
+  const int OVERWRITES = 2;
+  unlink(PATH.c_str());
+  unlink((PATH + ".snapshot").c_str());
+
+  {
+    WriteAheadLog log(PATH, WriteAheadLog::Durability::PERIODIC, 1000);
+    std::string record;
+    WriteAheadLog::append_create(record, "bench");
+    log.commit(record);
+    for (int round = 0; round < OVERWRITES; round++) {
+      for (long i = 0; i < num_keys; i++) {
+        record.clear();
+        WriteAheadLog::append_set(record, "bench", "user:" + std::to_string(i),
+                                  (round == 0 ? "first" : "later") + std::string(" value of thirty-two bytes."));
+        log.commit(record);
+      }
+    }
+  }
+
+  auto file_size = [](const std::string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? (long long) st.st_size : 0LL;
+  };
+
+  Server *server = new Server;
+  Clock::time_point start = Clock::now();
+  server->open_log(PATH, WriteAheadLog::Durability::PERIODIC, 1000, true);
+  std::chrono::duration<double> replayed = Clock::now() - start;
+
+  start = Clock::now();
+  server->write_snapshot();
+  std::chrono::duration<double> written = Clock::now() - start;
+  delete server;
+
+  server = new Server;
+  start = Clock::now();
+  server->open_log(PATH, WriteAheadLog::Durability::PERIODIC, 1000, true);
+  std::chrono::duration<double> loaded = Clock::now() - start;
+  delete server;
+
+  std::cout << "startup  keys " << num_keys << "  log " << file_size(PATH) / (1 << 20) << " MiB replayed in "
+            << replayed.count() << "s\n";
+  std::cout << "startup  snapshot " << file_size(PATH + ".snapshot") / (1 << 20) << " MiB written in "
+            << written.count() << "s, loaded in " << loaded.count() << "s\n";
+  unlink(PATH.c_str());
+  unlink((PATH + ".snapshot").c_str());
+}
+
+
+/* Seconds until a server is ready to serve clients, from 1 to 8 recovery threads, with
+NUM_TABLES tables holding num_keys keys in all: replaying a log that SETs each key twice,
+and loading a snapshot of the same tables. Each start runs in a new child process, like a
+real restart, which reports its time and exits. */
+void bench_recovery(long num_keys) {
+  const std::string PATH = "micro_bench_recovery.log";
+  const std::string SNAPSHOT_PATH = PATH + ".snapshot";
+  const int NUM_TABLES = 4;
+  const int OVERWRITES = 2;
+  const int THREAD_COUNTS[] = { 1, 2, 4, 8 };
+  unlink(PATH.c_str());
+  unlink(SNAPSHOT_PATH.c_str());
+
+  {
+    WriteAheadLog log(PATH, WriteAheadLog::Durability::PERIODIC, 1000);
+    std::string record;
+    for (int t = 0; t < NUM_TABLES; t++) {
+      record.clear();
+      WriteAheadLog::append_create(record, "bench" + std::to_string(t));
+      log.commit(record);
+    }
+    for (int round = 0; round < OVERWRITES; round++) {
+      for (long i = 0; i < num_keys; i++) {
+        record.clear();
+        WriteAheadLog::append_set(record, "bench" + std::to_string(i % NUM_TABLES), "user:" + std::to_string(i),
+                                  (round == 0 ? "first" : "later") + std::string(" value of thirty-two bytes."));
+        log.commit(record);
+      }
+    }
+  }
+
+  // Returns the seconds open_log took, after writing a snapshot if asked to
+  auto start_server = [&PATH](int num_threads, bool snapshot) {
+    int fds[2];
+    double seconds = -1;
+    if (pipe(fds) != 0) { return seconds; }
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+      Server server;
+      server.set_recovery_threads(num_threads);
+      Clock::time_point start = Clock::now();
+      server.open_log(PATH, WriteAheadLog::Durability::PERIODIC, 1000, true);
+      seconds = std::chrono::duration<double>(Clock::now() - start).count();
+      if (snapshot) { server.write_snapshot(); }
+      _exit(write(fds[1], &seconds, sizeof(seconds)) == sizeof(seconds) ? 0 : 1);
+    }
+    if (pid > 0) {
+      if (read(fds[0], &seconds, sizeof(seconds)) != sizeof(seconds)) { seconds = -1; }
+      waitpid(pid, nullptr, 0);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return seconds;
+  };
+
+  start_server(1, true);
+  for (int num_threads : THREAD_COUNTS) {
+    rename(SNAPSHOT_PATH.c_str(), (SNAPSHOT_PATH + ".aside").c_str());
+    double replayed = start_server(num_threads, false);
+    rename((SNAPSHOT_PATH + ".aside").c_str(), SNAPSHOT_PATH.c_str());
+    double loaded = start_server(num_threads, false);
+    std::cout << "recovery  keys " << num_keys << "  threads " << num_threads
+              << "  log replay " << replayed << "s  snapshot " << loaded << "s\n";
+  }
+  unlink(PATH.c_str());
+  unlink(SNAPSHOT_PATH.c_str());
+}
+
+
+/* A table of num_keys keys written to a snapshot, then served by a table that loads the
+snapshot into memory and by one that maps it: the time from opening the snapshot to the
+first GET answered (with the file in the page cache, and evicted from it first), and the
+latency of autocommit-style GETs of random keys, as the first ones page the file in and
+once everything is in memory. */
+void bench_mapped(long num_keys) {
+  const std::string PATH = "micro_bench_mapped.snapshot";
+  const long NUM_GETS = 1000000;
+  const long COLD_GETS = 10000;
+
+  {
+    Table source("bench");
+    for (long i = 0; i < num_keys; i++) {
+      source.restore("user:" + std::to_string(i), "value of thirty-two bytes " + std::to_string(i % 100000));
+    }
+    Snapshot::write(PATH, 0, { &source });
+  }
+
+  std::mt19937_64 rng(42);
+  std::vector<std::string> keys;
+  for (long i = 0; i < NUM_GETS; i++) { keys.push_back("user:" + std::to_string(rng() % num_keys)); }
+
+  // Returns the latencies of GETs of keys[first, last), sorted
+  auto get_keys = [&keys](Table *table, long first, long last) {
+    std::vector<double> latencies;
+    for (long i = first; i < last; i++) {
+      Clock::time_point start = Clock::now();
+      HashedKey key(keys[i]);
+      unsigned stripe = table->get_stripe(key);
+      std::string_view value;
+      table->lock_stripe(stripe, true);
+      bool found = table->find(key, value);
+      table->unlock_stripe(stripe);
+      latencies.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count());
+      if (!found) { std::cerr << "Missing key " << keys[i] << "\n"; }
+    }
+    std::sort(latencies.begin(), latencies.end());
+    return latencies;
+  };
+  auto report_gets = [](const std::string &name, const std::vector<double> &latencies) {
+    double total = 0;
+    for (double latency : latencies) { total += latency; }
+    std::cout << "mapped  " << name << "  mean " << (long) (total / latencies.size()) << "ns  p50 "
+              << (long) latencies[latencies.size() / 2] << "ns  p99 " << (long) latencies[latencies.size() * 99 / 100]
+              << "ns\n";
+  };
+  auto evict = [&PATH]() {
+    int fd = open(PATH.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+    }
+  };
+
+  for (int cold = 1; cold >= 0; cold--) {
+    const char *cache = cold ? "cold" : "warm";
+
+    if (cold) { evict(); }
+    Clock::time_point start = Clock::now();
+    Table *loaded = new Table("bench");
+    {
+      ParallelRestore restorer(1);
+      unsigned long long log_end, num_pairs;
+      Snapshot::load(PATH, [loaded](const std::string &) { return loaded; }, restorer, log_end, num_pairs);
+    }
+    get_keys(loaded, 0, 1);
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    std::cout << "mapped  " << cache << "  in-memory table  first GET after " << elapsed.count() << "s\n";
+    if (!cold) { report_gets("in-memory table, steady state", get_keys(loaded, 0, NUM_GETS)); }
+    delete loaded;
+
+    if (cold) { evict(); }
+    start = Clock::now();
+    MappedSnapshot *snapshot = MappedSnapshot::open(PATH);
+    Table *mapped = new Table("bench");
+    mapped->set_image(snapshot->get_tables()[0]);
+    get_keys(mapped, 0, 1);
+    elapsed = Clock::now() - start;
+    std::cout << "mapped  " << cache << "  mapped table     first GET after " << elapsed.count() << "s\n";
+    if (cold) {
+      report_gets("mapped table, first GETs (paging in)", get_keys(mapped, 1, COLD_GETS));
+    } else {
+      get_keys(mapped, 0, NUM_GETS);
+      report_gets("mapped table, steady state", get_keys(mapped, 0, NUM_GETS));
+    }
+    delete mapped;
+    delete snapshot;
+  }
+  unlink(PATH.c_str());
+}
+
+
+/* A log that SETs each of num_keys counters OVERWRITES times, rewritten while WRITERS threads
+keep SETting random counters through the same path as an autocommit SET, in each durability
+mode: the log's size before and after, how long the rewrite took, and the latency of the
+foreground SETs started before and during it. */
+void bench_rewrite(long num_keys) {
+  const std::string PATH = "micro_bench_rewrite.log";
+  const int OVERWRITES = 10;
+  const int WRITERS = 4;
+  const int PERIOD_MS = 10;
+  const int BASELINE_MS = 1000;
+
+  struct Mode {
+    const char *name;
+    WriteAheadLog::Durability durability;
+  };
+  const Mode MODES[] = {
+    { "periodic", WriteAheadLog::Durability::PERIODIC },
+    { "group", WriteAheadLog::Durability::GROUP_COMMIT },
+  };
+
+  auto file_size = [](const std::string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? (long long) st.st_size : 0LL;
+  };
+
+  for (const Mode &mode : MODES) {
+    unlink(PATH.c_str());
+    unlink((PATH + ".snapshot").c_str());
+    {
+      WriteAheadLog log(PATH, WriteAheadLog::Durability::PERIODIC, 1000);
+      std::string record;
+      WriteAheadLog::append_create(record, "bench");
+      log.commit(record);
+      for (int round = 0; round < OVERWRITES; round++) {
+        for (long i = 0; i < num_keys; i++) {
+          record.clear();
+          WriteAheadLog::append_set(record, "bench", "counter:" + std::to_string(i), std::to_string(round * 1000 + i));
+          log.commit(record);
+        }
+      }
+    }
+
+    Server *server = new Server;
+    server->set_recovery_threads(1);
+    server->open_log(PATH, mode.durability, PERIOD_MS, true);
+    Table *table = server->find_table("bench");
+    long long size_before = file_size(PATH);
+
+    // Each writer records when each of its SETs started (relative to start) and how long it took
+    std::atomic<bool> stop(false);
+    std::vector<std::vector<std::pair<double, double>>> latencies(WRITERS);
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    for (int t = 0; t < WRITERS; t++) {
+      threads.emplace_back([server, table, num_keys, t, start, &stop, &latencies]() {
+        std::mt19937_64 rng(t);
+        std::string record;
+        while (!stop.load(std::memory_order_relaxed)) {
+          std::string key = "counter:" + std::to_string(rng() % num_keys);
+          std::string value = std::to_string(rng() % 1000000);
+          Clock::time_point set_start = Clock::now();
+          unsigned stripe = table->get_stripe(key);
+          table->lock_stripe(stripe, false);
+          record.clear();
+          WriteAheadLog::append_set(record, "bench", key, value);
+          server->get_log()->commit(record);
+          table->set(key, value);
+          table->commit_stripe(stripe);
+          table->unlock_stripe(stripe);
+          Clock::time_point set_end = Clock::now();
+          latencies[t].push_back(std::make_pair(std::chrono::duration<double>(set_start - start).count(),
+                                                std::chrono::duration<double, std::micro>(set_end - set_start).count()));
+        }
+      });
+    }
+
+    usleep(BASELINE_MS * 1000);
+    double rewrite_start = std::chrono::duration<double>(Clock::now() - start).count();
+    bool rewritten = server->rewrite_log();
+    double rewrite_end = std::chrono::duration<double>(Clock::now() - start).count();
+    stop.store(true);
+    for (auto it = threads.begin(); it != threads.end(); it++) { it->join(); }
+    long long size_after = file_size(PATH);
+    delete server;
+
+    std::vector<double> before, during;
+    for (auto it = latencies.begin(); it != latencies.end(); it++) {
+      for (auto set = it->begin(); set != it->end(); set++) {
+        (set->first < rewrite_start ? before : during).push_back(set->second);
+      }
+    }
+    std::cout << "rewrite  " << mode.name << "  keys " << num_keys << "  log " << size_before / (double) (1 << 20)
+              << " MiB -> " << size_after / (double) (1 << 20) << " MiB in " << (rewrite_end - rewrite_start) << "s"
+              << (rewritten ? "" : " (failed)") << "\n";
+    auto report = [mode](const char *when, std::vector<double> &sets, double seconds) {
+      if (sets.empty()) { return; }
+      std::sort(sets.begin(), sets.end());
+      std::cout << "rewrite  " << mode.name << "  SETs " << when << "  SETs/s " << (long) (sets.size() / seconds)
+                << "  p50 " << sets[sets.size() / 2] << "us  p99 " << sets[sets.size() * 99 / 100]
+                << "us  max " << sets.back() << "us\n";
+    };
+    report("before", before, rewrite_start);
+    report("during", during, rewrite_end - rewrite_start);
+  }
+  unlink(PATH.c_str());
+  unlink((PATH + ".snapshot").c_str());
+}
+
+
+/* Bytes currently allocated from the heap, including large blocks that malloc mapped separately. */
+size_t heap_in_use() {
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+/* Inserts num_keys keys into a map, then looks each of them up in random order. Bytes per
+entry include the keys and values, which FlatMap keeps in an arena. */
+template<typename Map, typename Insert, typename Find>
+void bench_map(const std::string &name, long num_keys, Insert insert, Find find) {
+  std::vector<std::string> keys;
+  for (long i = 0; i < num_keys; i++) { keys.push_back("key:" + std::to_string(i)); }
+  std::vector<long> order(num_keys);
+  for (long i = 0; i < num_keys; i++) { order[i] = i; }
+  std::shuffle(order.begin(), order.end(), std::mt19937(42));
+
+  size_t heap_before = heap_in_use();
+  Map *map = new Map;
+
+  Clock::time_point start = Clock::now();
+  for (long i = 0; i < num_keys; i++) { insert(*map, keys[i]); }
+  std::chrono::duration<double> insert_time = Clock::now() - start;
+  size_t heap_used = heap_in_use() - heap_before;
+
+  long found = 0;
+  start = Clock::now();
+  for (long i = 0; i < num_keys; i++) { found += find(*map, keys[order[i]]); }
+  std::chrono::duration<double> lookup_time = Clock::now() - start;
+
+  std::cout << name << "  keys " << num_keys
+            << "  ns/insert " << (insert_time.count() * 1e9 / num_keys)
+            << "  ns/lookup " << (lookup_time.count() * 1e9 / num_keys)
+            << "  bytes/entry " << (double) heap_used / num_keys
+            << (found == num_keys ? "" : "  (lookups failed!)") << "\n";
+  delete map;
+}
+
+/* Table's storage, FlatMap, against the std::unordered_map it replaced. */
+void bench_flat_map(long num_keys) {
+  typedef std::unordered_map<std::string, std::string> StdMap;
+  bench_map<StdMap>("unordered_map", num_keys, [](StdMap &map, const std::string &key) {
+    map[key] = "value";
+  }, [](StdMap &map, const std::string &key) {
+    return map.find(key) != map.end();
+  });
+
+  // As in a table stripe, the keys and values are copied into an arena
+  Arena *arena = new Arena;
+  bench_map<FlatMap>("FlatMap      ", num_keys, [arena](FlatMap &map, const std::string &key) {
+    map.insert(arena->copy(key)) = arena->copy("value");
+  }, [](FlatMap &map, const std::string &key) {
+    return map.find(key) != nullptr;
+  });
+  delete arena;
+}
+
+
+/* Resident memory of the process in bytes. */
+size_t resident_bytes() {
+  size_t pages = 0, resident = 0;
+  std::ifstream statm("/proc/self/statm");
+  statm >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Loads num_keys keys into a table with autocommit SETs, overwrites every value once, and
+compacts the table. */
+void bench_table_load(long num_keys) {
+  Table *table = new Table("bench");
+  size_t rss_before = resident_bytes();
+
+  for (int pass = 0; pass < 2; pass++) {
+    std::string value = (pass == 0 ? "first value of thirty-two bytes." : "second value, of thirty-two byte");
+
+    count_allocations = true;
+    num_allocations = 0;
+    Clock::time_point start = Clock::now();
+    for (long i = 0; i < num_keys; i++) {
+      std::string key = "user:" + std::to_string(1000000000000 + i);
+      unsigned stripe = table->get_stripe(key);
+      table->lock_stripe(stripe, false);
+      table->set(key, value);
+      table->commit_stripe(stripe);
+      table->unlock_stripe(stripe);
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    count_allocations = false;
+
+    // The key string of each iteration is one allocation of the benchmark itself
+    std::cout << (pass == 0 ? "load     " : "overwrite") << "  keys " << num_keys
+              << "  ns/set " << (elapsed.count() * 1e9 / num_keys)
+              << "  allocations/set " << ((double) num_allocations / num_keys - 1)
+              << "  rss MB " << (resident_bytes() - rss_before) / 1e6 << "\n";
+  }
+
+  // What the background compactor would reclaim of the overwritten values (malloc_trim
+  // returns the freed chunks to the system, which malloc would otherwise reuse)
+  Clock::time_point start = Clock::now();
+  unsigned num_compacted = table->compact();
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+  malloc_trim(0);
+  std::cout << "compact  " << "  stripes " << num_compacted << "  ms " << elapsed.count() * 1e3
+            << "  rss MB " << (resident_bytes() - rss_before) / 1e6 << "\n";
+
+  delete table;
+}
+
+
+/* Times every SET while loading num_keys keys into a table, with its keys in one stripe
+(one map, so that it grows the most) and in the default number of stripes. */
+void bench_set_latency(long num_keys) {
+  const unsigned STRIPE_COUNTS[] = { 1, Table::DEFAULT_STRIPES };
+
+  // Latencies are counted in microsecond buckets, and the largest is kept exactly
+  const size_t NUM_BUCKETS = 100000;
+
+  for (unsigned num_stripes : STRIPE_COUNTS) {
+    Table *table = new Table("bench", num_stripes);
+    std::vector<long> buckets(NUM_BUCKETS + 1);
+    double max_us = 0;
+
+    for (long i = 0; i < num_keys; i++) {
+      std::string key = "user:" + std::to_string(1000000000000 + i);
+
+      Clock::time_point start = Clock::now();
+      unsigned stripe = table->get_stripe(key);
+      table->lock_stripe(stripe, false);
+      table->set(key, "first value of thirty-two bytes.");
+      table->commit_stripe(stripe);
+      table->unlock_stripe(stripe);
+      double us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+
+      buckets[std::min((size_t) us, NUM_BUCKETS)]++;
+      max_us = std::max(max_us, us);
+    }
+
+    // The bucket holding a percentile, as its upper bound
+    auto percentile = [&buckets, num_keys](double fraction) {
+      long seen = 0;
+      for (size_t us = 0; us < buckets.size(); us++) {
+        seen += buckets[us];
+        if (seen >= fraction * num_keys) { return (double) us + 1; }
+      }
+      return (double) buckets.size();
+    };
+
+    std::cout << "set  stripes " << num_stripes << "  keys " << num_keys
+              << "  p50 <" << percentile(0.5) << "us  p99 <" << percentile(0.99)
+              << "us  p99.99 <" << percentile(0.9999) << "us  max " << max_us << "us\n";
+    delete table;
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  if ( argc < 2 || argc > 3 ) {
+    std::cerr << "Usage: ./micro_bench <benchmark> [<iterations>]\n";
+    std::cerr << "Benchmarks:\n";
+    std::cerr << "  dispatch   decode and handle requests through a ClientConnection\n";
+    std::cerr << "  get        autocommit GET (and POP) requests for one key and for keys of a large table\n";
+    std::cerr << "  decode     decode requests into a Message and into a MessageView\n";
+    std::cerr << "  table_get  GETs from 1 to 16 threads on one table, with shared and exclusive locking\n";
+    std::cerr << "  table_set  SETs from 1 to 64 threads on one table, with 1 and 64 lock stripes\n";
+    std::cerr << "  directory  table lookups from 1 to 4 threads, alone and during a storm of CREATEs\n";
+    std::cerr << "  wal        commits from 1 to 16 threads to a write-ahead log in each durability mode\n";
+    std::cerr << "  startup    start a server from a log of 2 x <iterations> SETs, and from a snapshot\n";
+    std::cerr << "  recovery   start a server from a log and from a snapshot of <iterations> keys, with 1 to\n";
+    std::cerr << "             8 recovery threads\n";
+    std::cerr << "  mapped     time to the first GET and GET latency of <iterations> keys, loaded from a\n";
+    std::cerr << "             snapshot and mapped\n";
+    std::cerr << "  rewrite    rewrite a log of 10 SETs to each of <iterations> counters, with SETs\n";
+    std::cerr << "             going on, in two durability modes\n";
+    std::cerr << "  flat_map   insert and look up <iterations> keys in FlatMap and std::unordered_map\n";
+    std::cerr << "  table_load SET <iterations> keys in a table, then overwrite each of them\n";
+    std::cerr << "  set_latency SET latency percentiles while loading <iterations> keys into a table\n";
+    return 1;
+  }
+
+  std::string benchmark = argv[1];
+  long iterations = (argc == 3) ? atol(argv[2]) : 200000;
+
+  if (benchmark == "dispatch") { bench_dispatch(iterations); }
+  else if (benchmark == "get") { bench_get(iterations); }
+  else if (benchmark == "decode") { bench_decode(iterations); }
+  else if (benchmark == "table_get") { bench_table_get(iterations); }
+  else if (benchmark == "table_set") { bench_table_set(iterations); }
+  else if (benchmark == "directory") { bench_directory(iterations); }
+  else if (benchmark == "wal") { bench_wal(iterations); }
+  else if (benchmark == "startup") { bench_startup(iterations); }
+  else if (benchmark == "recovery") { bench_recovery(iterations); }
+  else if (benchmark == "mapped") { bench_mapped(iterations); }
+  else if (benchmark == "rewrite") { bench_rewrite(iterations); }
+  else if (benchmark == "flat_map") { bench_flat_map(iterations); }
+  else if (benchmark == "table_load") { bench_table_load(iterations); }
+  else if (benchmark == "set_latency") { bench_set_latency(iterations); }
+  else {
+    std::cerr << "Error: unknown benchmark " << benchmark << ".\n";
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,102 @@
+#include <cstring>
+#include "exceptions.h"
+#include "output_buffer.h"
+
+namespace {
+  // Capacity reserved up front, enough for a few small responses
+  const size_t INITIAL_CAPACITY = 128;
+
+  const char OK_ENCODED[] = "OK\n";
+  const char NOT_LOGGED_IN_ENCODED[] = "ERROR \"Please log in first.\"\n";
+  const char TIMED_OUT_ENCODED[] = "ERROR \"Connection timed out.\"\n";
+  const char TOO_MANY_CLIENTS_ENCODED[] = "ERROR \"Too many connections, try again later.\"\n";
+}
+
+OutputBuffer::OutputBuffer()
+  : m_written(0)
+  , m_num_responses(0)
+{
+  m_data.reserve(INITIAL_CAPACITY);
+}
+
+OutputBuffer::~OutputBuffer()
+{
+}
+
+std::string_view OutputBuffer::fixed_encoding( FixedResponse response )
+{
+  switch (response) {
+    case FixedResponse::OK:
+      return std::string_view(OK_ENCODED, sizeof(OK_ENCODED) - 1);
+    case FixedResponse::NOT_LOGGED_IN:
+      return std::string_view(NOT_LOGGED_IN_ENCODED, sizeof(NOT_LOGGED_IN_ENCODED) - 1);
+    case FixedResponse::TIMED_OUT:
+      return std::string_view(TIMED_OUT_ENCODED, sizeof(TIMED_OUT_ENCODED) - 1);
+    case FixedResponse::TOO_MANY_CLIENTS:
+      return std::string_view(TOO_MANY_CLIENTS_ENCODED, sizeof(TOO_MANY_CLIENTS_ENCODED) - 1);
+  }
+  return std::string_view();
+}
+
+void OutputBuffer::append( FixedResponse response )
+{
+  std::string_view encoded = fixed_encoding(response);
+  m_data.append(encoded.data(), encoded.size());
+  m_num_responses++;
+}
+
+void OutputBuffer::append_data( const std::string &value )
+{
+  // "DATA " plus the value and the newline must fit in an encoded message
+  if (value.size() + 6 > Message::MAX_ENCODED_LEN) { throw InvalidMessage("Message is too long."); }
+
+  m_data.append("DATA ", 5);
+  m_data += value;
+  m_data += '\n';
+  m_num_responses++;
+}
+
+void OutputBuffer::append_failure( MessageType type, const char *text )
+{
+  const char *type_name = (type == MessageType::FAILED) ? "FAILED \"" : "ERROR \"";
+  size_t text_len = strlen(text);
+
+  // Overlong texts are cut off so the response still fits in an encoded message
+  size_t max_text_len = Message::MAX_ENCODED_LEN - strlen(type_name) - 2;
+  if (text_len > max_text_len) { text_len = max_text_len; }
+
+  m_data.append(type_name);
+  m_data.append(text, text_len);
+  m_data.append("\"\n", 2);
+  m_num_responses++;
+}
+
+void OutputBuffer::append_encoded( const std::string &encoded_msg )
+{
+  m_data += encoded_msg;
+  m_num_responses++;
+}
+
+void OutputBuffer::consume( size_t n )
+{
+  m_written += n;
+  if (m_written == m_data.size()) { clear(); }
+}
+
+void OutputBuffer::clear()
+{
+  m_data.clear();
+  m_written = 0;
+  m_num_responses = 0;
+}
+
+void OutputBuffer::take( std::string &out )
+{
+  if (m_written > 0) { m_data.erase(0, m_written); }
+
+  // out's old storage is cleared and reused for later responses
+  out.clear();
+  m_data.swap(out);
+  m_written = 0;
+  m_num_responses = 0;
+}
@@ -0,0 +1,76 @@
+#ifndef OUTPUT_BUFFER_H
+#define OUTPUT_BUFFER_H
+
+#include <string>
+#include <string_view>
+#include "message.h"
+
+/* 
+ * Responses a ClientConnection has produced but not yet written. Responses are
+ * encoded straight into one reusable byte buffer, and fixed responses are copied
+ * from precomputed encodings, so answering with OK does not allocate once the
+ * buffer has grown to the size of a batch.
+ */
+class OutputBuffer {
+private:
+  std::string m_data;
+
+  /* Bytes at the front of m_data that have already been written to the socket. */
+  size_t m_written;
+
+  unsigned m_num_responses;
+
+  // copy constructor and assignment operator are prohibited
+  OutputBuffer( const OutputBuffer & );
+  OutputBuffer &operator=( const OutputBuffer & );
+
+public:
+  /* Responses whose encoding never changes. */
+  enum class FixedResponse {
+    OK,
+    NOT_LOGGED_IN,
+    TIMED_OUT,
+    TOO_MANY_CLIENTS,
+  };
+
+  /* The encoding of a fixed response, for code that writes one without a buffer. */
+  static std::string_view fixed_encoding( FixedResponse response );
+
+  OutputBuffer();
+  ~OutputBuffer();
+
+  void append( FixedResponse response );
+
+  /* Appends an OK response. */
+  void append_ok() { append( FixedResponse::OK ); }
+
+  /* Appends a DATA response carrying a value. */
+  void append_data( const std::string &value );
+
+  /* Appends a FAILED or ERROR response carrying quoted text. */
+  void append_failure( MessageType type, const char *text );
+
+  /* Appends a response that has already been encoded. */
+  void append_encoded( const std::string &encoded_msg );
+
+  /* The bytes that still have to be written. */
+  const char *data() const { return m_data.data() + m_written; }
+  size_t size() const { return m_data.size() - m_written; }
+  bool empty() const { return size() == 0; }
+
+  /* Bytes the buffer can hold before it has to grow its storage. */
+  size_t capacity() const { return m_data.capacity(); }
+
+  unsigned get_num_responses() const { return m_num_responses; }
+
+  /* Marks the first n unwritten bytes as written. */
+  void consume( size_t n );
+
+  /* Discards all responses, keeping the buffer's capacity. */
+  void clear();
+
+  /* Moves the unwritten bytes into out and takes over out's storage for later responses. */
+  void take( std::string &out );
+};
+
+#endif // OUTPUT_BUFFER_H
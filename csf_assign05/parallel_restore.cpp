@@ -0,0 +1,128 @@
+#include <cstdint>
+#include "exceptions.h"
+#include "table.h"
+#include "parallel_restore.h"
+
+namespace {
+  // Bytes of keys and values a batch collects before it is handed to its worker
+  const size_t BATCH_BYTES = 256 * 1024;
+
+  // Batches that may wait for each worker
+  const size_t QUEUE_DEPTH = 8;
+}
+
+ParallelRestore::ParallelRestore( unsigned num_threads )
+  : m_stopping( false )
+{
+  sem_init(&m_drained, 0, 0);
+  if (num_threads < 2) { return; }
+
+  for (unsigned i = 0; i < num_threads; i++) {
+    Worker *worker = new Worker(this, QUEUE_DEPTH);
+    sem_init(&worker->queued, 0, 0);
+    sem_init(&worker->free_slots, 0, QUEUE_DEPTH);
+    if (pthread_create(&worker->thread, nullptr, worker_main, worker) != 0) {
+      sem_destroy(&worker->queued);
+      sem_destroy(&worker->free_slots);
+      delete worker->filling;
+      delete worker;
+      stop_workers();
+      sem_destroy(&m_drained);
+      throw CommException("Could not create recovery thread");
+    }
+    m_workers.push_back(worker);
+  }
+}
+
+ParallelRestore::~ParallelRestore()
+{
+  stop_workers();
+  sem_destroy(&m_drained);
+}
+
+void ParallelRestore::stop_workers()
+{
+  m_stopping.store(true);
+  finish();
+  for (auto it = m_workers.begin(); it != m_workers.end(); it++) {
+    Worker *worker = *it;
+    pthread_join(worker->thread, nullptr);
+    sem_destroy(&worker->queued);
+    sem_destroy(&worker->free_slots);
+    delete worker->filling;
+    delete worker;
+  }
+  m_workers.clear();
+}
+
+void ParallelRestore::restore( Table *table, const HashedKey &key, std::string_view value )
+{
+  if (m_workers.empty()) {
+    table->restore(key, value);
+    return;
+  }
+
+  // Consecutive stripes of a table go to consecutive workers, so one big table keeps them all busy
+  unsigned stripe = table->get_stripe(key);
+  Worker *worker = m_workers[((reinterpret_cast<uintptr_t>(table) >> 4) + stripe) % m_workers.size()];
+
+  Batch *batch = worker->filling;
+  batch->pairs.push_back(Batch::Pair{ table, key.hash, (unsigned) key.key.size(), (unsigned) value.size() });
+  batch->bytes.append(key.key);
+  batch->bytes.append(value);
+  if (batch->bytes.size() >= BATCH_BYTES) {
+    push(worker, batch);
+    worker->filling = new Batch;
+  }
+}
+
+void ParallelRestore::finish()
+{
+  for (auto it = m_workers.begin(); it != m_workers.end(); it++) {
+    Worker *worker = *it;
+    if (!worker->filling->pairs.empty()) {
+      push(worker, worker->filling);
+      worker->filling = new Batch;
+    }
+    push(worker, nullptr);
+  }
+  for (unsigned i = 0; i < m_workers.size(); i++) { sem_wait(&m_drained); }
+}
+
+void ParallelRestore::push( Worker *worker, Batch *batch )
+{
+  sem_wait(&worker->free_slots);
+  worker->queue.try_push(batch);
+  sem_post(&worker->queued);
+}
+
+void *ParallelRestore::worker_main( void *arg )
+{
+  Worker *worker = static_cast<Worker *>( arg );
+  ParallelRestore *owner = worker->owner;
+
+  while (1) {
+    sem_wait(&worker->queued);
+    Batch *batch;
+    worker->queue.try_pop(batch);
+    sem_post(&worker->free_slots);
+
+    if (batch == nullptr) {
+      bool stopping = owner->m_stopping.load();
+      sem_post(&owner->m_drained);
+      if (stopping) { break; }
+      continue;
+    }
+
+    size_t pos = 0;
+    for (auto it = batch->pairs.begin(); it != batch->pairs.end(); it++) {
+      std::string_view key(batch->bytes.data() + pos, it->key_len);
+      std::string_view value(batch->bytes.data() + pos + it->key_len, it->value_len);
+      it->table->restore(HashedKey(key, it->hash), value);
+      pos += it->key_len + it->value_len;
+    }
+    delete batch;
+  }
+
+  return nullptr;
+}
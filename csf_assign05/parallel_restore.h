@@ -0,0 +1,91 @@
+#ifndef PARALLEL_RESTORE_H
+#define PARALLEL_RESTORE_H
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <pthread.h>
+#include <semaphore.h>
+#include "hashed_key.h"
+#include "spsc_ring.h"
+
+class Table;
+
+/*
+ * Restores pairs read at startup (from a snapshot, and then from the log) into tables
+ * from several worker threads, while one thread reads and routes them. Every stripe of
+ * every table belongs to one worker, which restores its pairs in the order they were
+ * routed, so a later pair for a key still replaces an earlier one, and no stripe is
+ * ever touched by two threads.
+ *
+ * Pairs are copied into batches of about BATCH_BYTES per worker, and handed over through
+ * a bounded ring, so the reader waits rather than queueing a whole log in memory when
+ * the workers fall behind. With one thread, pairs are restored as they are routed.
+ */
+class ParallelRestore {
+private:
+  struct Batch {
+    struct Pair {
+      Table *table;
+      size_t hash;
+      unsigned key_len;
+      unsigned value_len;
+    };
+
+    std::vector<Pair> pairs;
+
+    /* Each pair's key and then value, one pair after the other. */
+    std::string bytes;
+  };
+
+  struct Worker {
+    ParallelRestore *owner;
+    pthread_t thread;
+
+    /* Batches to restore, and nullptr when the worker is to report being drained. */
+    SpscRing<Batch *> queue;
+    sem_t queued;
+    sem_t free_slots;
+
+    /* Batch the reader is adding this worker's pairs to. */
+    Batch *filling;
+
+    Worker( ParallelRestore *owner, size_t depth ) : owner( owner ), queue( depth ), filling( new Batch ) { }
+  };
+
+  std::vector<Worker *> m_workers;
+
+  /* Posted by each worker once it has restored everything queued before a drain. */
+  sem_t m_drained;
+
+  std::atomic<bool> m_stopping;
+
+  // copy constructor and assignment operator are prohibited
+  ParallelRestore( const ParallelRestore & );
+  ParallelRestore &operator=( const ParallelRestore & );
+
+  void push( Worker *worker, Batch *batch );
+
+  /* Finishes restoring, and joins and frees the workers. */
+  void stop_workers();
+
+  static void *worker_main( void *arg );
+
+public:
+  /* Starts num_threads workers (none with fewer than two). Throws a CommException if a
+  thread cannot be created. */
+  explicit ParallelRestore( unsigned num_threads );
+
+  /* Finishes restoring, and stops the workers. */
+  ~ParallelRestore();
+
+  /* Queues key and value to be restored into table. Only one thread may route pairs,
+  and the table must not be used by anything else until finish returns. */
+  void restore( Table *table, const HashedKey &key, std::string_view value );
+
+  /* Returns once every pair routed so far is restored. */
+  void finish();
+};
+
+#endif // PARALLEL_RESTORE_H
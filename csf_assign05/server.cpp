@@ -1,61 +1,1218 @@
 #include <iostream>
+#include <algorithm>
 #include <cassert>
 #include <memory>
 #include <iterator>
+#include <cstring>
+#include <chrono>
 #include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "csapp.h"
 #include "exceptions.h"
 #include "guard.h"
+#include "hot_restart.h"
+#include "parallel_restore.h"
 #include "server.h"
+#include "snapshot.h"
+#include "unix_socket.h"
+#include "uring.h"
+
+namespace {
+  // Maximum number of events returned by one epoll_wait call
+  const int MAX_EPOLL_EVENTS = 256;
+
+  // How often event loops check their connections for timeouts
+  const int TIMEOUT_SWEEP_MS = 1000;
+
+  // How often the background compactor looks for table arenas worth compacting
+  const int COMPACTION_INTERVAL_MS = 1000;
+
+  // How often the log rewriter checks how much the log has grown, and the smallest log it rewrites
+  const int LOG_REWRITE_CHECK_MS = 1000;
+  const unsigned long long LOG_REWRITE_MIN_BYTES = 1 << 20;
+
+  // How long a handoff waits for ongoing transactions, snapshots and log rewrites to finish
+  const int HANDOFF_LOCK_TIMEOUT_S = 5;
+
+  // How soon a connection or coroutine session waiting for a table's lock or the log tries again
+  const int LOCK_RETRY_MS = 1;
+
+  // Size of the io_uring and of its provided receive buffers
+  const unsigned URING_ENTRIES = 4096;
+  const unsigned URING_NUM_BUFFERS = 1024;
+  const unsigned URING_BUFFER_SIZE = 4096;
+
+  // Operation tags kept in the low bits of io_uring user_data (the rest is a UringClient pointer)
+  const unsigned long long URING_ACCEPT = 0;
+  const unsigned long long URING_RECV = 1;
+  const unsigned long long URING_SEND = 2;
+  const unsigned long long URING_TIMER = 3;
+  const unsigned long long URING_TAG_MASK = 3;
+
+  // Timers, told apart by the user_data bits above the tag
+  const unsigned long long URING_SWEEP_TIMER = URING_TIMER;
+  const unsigned long long URING_RETRY_TIMER = URING_TIMER | (1 << 2);
+
+  /* A client served by the io_uring loop, and the I/O the ring has in flight for it. */
+  struct UringClient {
+    ClientConnection *client;
+    // Responses being sent, which must stay put until the send completes
+    std::string sending;
+    size_t sent;
+    bool recv_armed;
+    bool send_in_flight;
+    bool closing;
+    bool shut_down;
+    // Whether the client is already in this batch's list of clients to service
+    bool queued;
+    // Whether the client is in the list of clients retrying a table's lock or the log, which keeps it alive
+    bool retrying;
+  };
+
+  ClientConnection *connection_of( ClientConnection *client ) { return client; }
+  ClientConnection *connection_of( UringClient *conn ) { return conn->client; }
+
+  /* Adds a connection to an event loop's list of connections, which is swept for timeouts. */
+  template<typename T>
+  void track_client( std::vector<T *> &clients, T *client ) {
+    connection_of(client)->set_loop_slot(clients.size());
+    clients.push_back(client);
+  }
+
+  /* Removes a connection from its event loop's list by moving the last connection into its slot. */
+  template<typename T>
+  void untrack_client( std::vector<T *> &clients, T *client ) {
+    int slot = connection_of(client)->get_loop_slot();
+    if (slot < 0) { return; }
+    clients[slot] = clients.back();
+    connection_of(clients[slot])->set_loop_slot(slot);
+    clients.pop_back();
+    connection_of(client)->set_loop_slot(-1);
+  }
+
+  /* Starts the next send for a client, or closes it once it is finished. Returns false once
+  the client has been deleted. */
+  bool service_uring_client( IoUring &ring, UringClient *conn, std::vector<UringClient *> &clients ) {
+    int fd = conn->client->get_m_client_fd();
+    if (conn->send_in_flight) { return true; }
+
+    // A client whose requests wait for a table's lock or the log sends the batch's responses
+    // once they are all there, so a small first part does not wait for the client's ACK
+    if (!conn->closing && !conn->client->is_waiting_to_retry()) {
+      if (conn->sent == conn->sending.size()) {
+        conn->client->take_output(conn->sending);
+        conn->sent = 0;
+      }
+      if (conn->sent < conn->sending.size()) {
+        ring.prep_send(fd, conn->sending.data() + conn->sent, conn->sending.size() - conn->sent,
+                       (unsigned long long) conn | URING_SEND);
+        conn->send_in_flight = true;
+        return true;
+      }
+      if (conn->client->is_finished()) { conn->closing = true; }
+    }
+
+    // Shutting the socket down ends its multishot receive
+    if (conn->closing && !conn->shut_down) {
+      shutdown(fd, SHUT_RDWR);
+      conn->shut_down = true;
+    }
+    if (conn->closing && !conn->recv_armed && !conn->retrying) {
+      untrack_client(clients, conn);
+      delete conn->client;
+      delete conn;
+      return false;
+    }
+    return true;
+  }
+}
 
 Server::Server() 
 : server_fd(0)
+, loop_mode(LoopMode::THREAD_PER_CLIENT)
+, pin_acceptors(false)
+, connection_queue(nullptr)
+, next_loop(0)
+, login_timeout(0)
+, idle_timeout(0)
+, max_clients(0)
+, num_clients(0)
+, control_fd(-1)
+, wal(nullptr)
+, snapshot_log_end(0)
+, snapshot_interval(0)
+, log_rewrite_percent(0)
+, log_rewrite_base(0)
+, recovery_threads(sysconf(_SC_NPROCESSORS_ONLN))
+, map_snapshot(false)
+, mapped_snapshot(nullptr)
+, handoff_started(false)
+, handoff_event_fd(-1)
 {
   // Mutex is used to lock a server while tables are being created
   pthread_mutex_init(&mutex, NULL);
+  pthread_mutex_init(&maintenance_mutex, NULL);
+  sem_init(&acceptors_stopped, 0, 0);
+  sem_init(&acceptors_resumed, 0, 0);
 }
 
 Server::~Server()
 {
-  close(server_fd);
+  for (auto it = listen_fds.begin(); it != listen_fds.end(); it++) {
+    close(*it);
+  }
+  if (control_fd >= 0) { close(control_fd); }
+  if (handoff_event_fd >= 0) { close(handoff_event_fd); }
+  delete connection_queue;
+  delete wal;
+  delete mapped_snapshot;
+  for (auto it = shards.begin(); it != shards.end(); it++) {
+    delete *it;
+  }
+  sem_destroy(&acceptors_stopped);
+  sem_destroy(&acceptors_resumed);
+  pthread_mutex_destroy(&maintenance_mutex);
   pthread_mutex_destroy(&mutex);
 }
 
-void Server::listen( const std::string &port )
+void Server::listen( const std::string &port, int num_listeners )
+{
+  // A single listener keeps the plain csapp socket setup
+  if (num_listeners == 1) {
+    server_fd = open_listenfd(port.data());
+    if (server_fd < 0) { throw CommException("Failed to create server socket"); }
+    listen_fds.push_back(server_fd);
+    return;
+  }
+
+  for (int i = 0; i < num_listeners; i++) {
+    int listen_fd = open_reuseport_listenfd(port);
+    if (listen_fd < 0) { throw CommException("Failed to create server socket"); }
+    listen_fds.push_back(listen_fd);
+  }
+  server_fd = listen_fds[0];
+}
+
+void Server::listen_unix( const std::string &path )
+{
+  // Gets its own accept thread like any other listener
+  int listen_fd = open_unix_listenfd(path, LISTENQ);
+  if (listen_fd < 0) { throw CommException("Failed to create Unix domain socket"); }
+  listen_fds.push_back(listen_fd);
+}
+
+bool Server::take_over( const std::string &control_path )
+{
+  int handoff_fd = HotRestart::connect_control_socket(control_path);
+  if (handoff_fd < 0) { return false; }
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  unsigned long long num_pairs = 0;
+  // Closing the control socket without an acknowledgement tells the old server to carry on
+  try { num_pairs = receive_handoff(handoff_fd); }
+  catch (CommException const& ex) {
+    close(handoff_fd);
+    throw;
+  }
+  close(handoff_fd);
+
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+  std::cerr << "Took over " << listen_fds.size() << " listener(s), " << table_names.size() << " table(s) and "
+            << num_pairs << " pair(s) in " << elapsed.count() << " ms\n";
+  return true;
+}
+
+unsigned long long Server::receive_handoff( int handoff_fd )
+{
+  if (!HotRestart::receive_fds(handoff_fd, listen_fds)) { throw CommException("Could not receive listening sockets"); }
+  server_fd = listen_fds[0];
+
+  // Each table arrives as a length-prefixed chunk holding its name and pairs, and an empty chunk ends them
+  rio_t handoff_buf;
+  rio_readinitb(&handoff_buf, handoff_fd);
+  std::string chunk;
+  unsigned long long num_pairs = 0;
+  while (1) {
+    unsigned long long chunk_len;
+    if (rio_readnb(&handoff_buf, &chunk_len, sizeof(chunk_len)) != sizeof(chunk_len)) {
+      throw CommException("Truncated handoff data");
+    }
+    if (chunk_len == 0) { break; }
+
+    chunk.resize(chunk_len);
+    if (rio_readnb(&handoff_buf, &chunk[0], chunk_len) != (ssize_t) chunk_len) {
+      throw CommException("Truncated handoff data");
+    }
+
+    size_t pos = 0;
+    std::string name = HotRestart::read_bytes(chunk, pos, HotRestart::read_u32(chunk, pos));
+    create_table(name);
+    Table *table = find_table(name);
+    while (pos < chunk.size()) {
+      std::string key = HotRestart::read_bytes(chunk, pos, HotRestart::read_u32(chunk, pos));
+      std::string value = HotRestart::read_bytes(chunk, pos, HotRestart::read_u32(chunk, pos));
+      table->restore(key, value);
+      num_pairs++;
+    }
+  }
+
+  // The old server exits once it is acknowledged
+  if (!HotRestart::write_all(handoff_fd, "1")) { throw CommException("Could not acknowledge the handoff"); }
+  return num_pairs;
+}
+
+void Server::serve_handoffs( const std::string &control_path )
+{
+  control_fd = HotRestart::open_control_socket(control_path);
+  if (control_fd < 0) { throw CommException("Failed to create control socket"); }
+
+  handoff_event_fd = eventfd(0, EFD_CLOEXEC);
+  if (handoff_event_fd < 0) { throw CommException("Failed to create handoff event"); }
+
+  // Accept threads wait for clients with poll, so that a handoff can interrupt them
+  for (auto it = listen_fds.begin(); it != listen_fds.end(); it++) {
+    fcntl(*it, F_SETFL, fcntl(*it, F_GETFL) | O_NONBLOCK);
+  }
+
+  pthread_t thr_id;
+  if ( pthread_create( &thr_id, nullptr, handoff_worker, this ) != 0 ) {
+    throw CommException("Could not create handoff thread");
+  }
+  pthread_detach(thr_id);
+}
+
+void *Server::handoff_worker( void *arg )
+{
+  Server *server = static_cast<Server *>( arg );
+
+  while (1) {
+    int handoff_fd = accept(server->control_fd, nullptr, nullptr);
+    if (handoff_fd < 0) {
+      server->log_error( "Could not accept a new server" );
+      continue;
+    }
+
+    // Only returns if the handoff failed, in which case this server keeps running
+    server->hand_off(handoff_fd);
+    close(handoff_fd);
+  }
+
+  return nullptr;
+}
+
+void Server::hand_off( int handoff_fd )
+{
+  // From now on, new clients wait in the shared listen backlog until the new server accepts them
+  stop_acceptors();
+
+  // Taking every lock waits for ongoing operations and transactions to finish, and keeps
+  // the tables (and the set of tables) from changing until the process exits. A client may
+  // keep its transaction open indefinitely, so the handoff gives up at a deadline.
+  timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += HANDOFF_LOCK_TIMEOUT_S;
+
+  bool maintenance_locked = pthread_mutex_timedlock(&maintenance_mutex, &deadline) == 0;
+  bool directory_locked = maintenance_locked && table_names.timedlock(deadline);
+  bool ready = directory_locked;
+  std::vector<Table *> locked;
+  if (directory_locked) {
+    table_names.for_each([&ready, &locked, &deadline]( const std::string &, Table *table ) {
+      if (!ready) { return; }
+      if (table->timedlock(deadline)) { locked.push_back(table); }
+      else { ready = false; }
+    });
+  }
+
+  // The new server appends to the same log, after everything this one buffered
+  if (ready && wal != nullptr) { wal->sync(); }
+
+  bool sent = ready && HotRestart::send_fds(handoff_fd, listen_fds);
+
+  // Each table is sent as a chunk with its length, its name and its committed pairs
+  std::string chunk;
+  table_names.for_each([&chunk, &sent, handoff_fd]( const std::string &name, Table *table ) {
+    if (!sent) { return; }
+    chunk.clear();
+    HotRestart::append_u64(chunk, 0);
+    HotRestart::append_u32(chunk, name.size());
+    chunk += name;
+    table->for_each_pair([&chunk]( std::string_view key, std::string_view value ) {
+      HotRestart::append_u32(chunk, key.size());
+      chunk += key;
+      HotRestart::append_u32(chunk, value.size());
+      chunk += value;
+    });
+
+    unsigned long long chunk_len = chunk.size() - sizeof(chunk_len);
+    memcpy(&chunk[0], &chunk_len, sizeof(chunk_len));
+    sent = HotRestart::write_all(handoff_fd, chunk);
+  });
+
+  chunk.clear();
+  HotRestart::append_u64(chunk, 0);
+  sent = sent && HotRestart::write_all(handoff_fd, chunk);
+
+  // The new server acknowledges once it has loaded everything, and is about to serve clients
+  char ack;
+  if (sent && recv(handoff_fd, &ack, 1, 0) == 1) {
+    // Clients still connected here are cut off, like they would be by a restart
+    _exit(0);
+  }
+
+  for (auto it = locked.begin(); it != locked.end(); it++) { (*it)->unlock(); }
+  if (directory_locked) { table_names.unlock(); }
+  if (maintenance_locked) { pthread_mutex_unlock(&maintenance_mutex); }
+  resume_acceptors();
+  if (!ready) { log_error( "Could not hand the server over, as tables stayed locked too long" ); }
+  else { log_error( "Could not hand the server over to a new process" ); }
+}
+
+void Server::open_log( const std::string &path, WriteAheadLog::Durability durability, int period_ms, bool recover )
+{
+  log_path = path;
+
+  if (recover) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // This thread reads and routes the pairs, and creates the tables, while the workers fill
+    // the tables' stripes. A stripe's pairs are restored in order, so the log's pairs (for a
+    // key as well as for the tables) replace the snapshot's without waiting for all of them.
+    ParallelRestore restorer(recovery_threads);
+
+    // The snapshot holds everything the log does before snapshot_log_end, so only the rest is replayed
+    unsigned long long snapshot_pairs = 0;
+    if (map_snapshot && (mapped_snapshot = MappedSnapshot::open(path + ".snapshot")) != nullptr) {
+      // The tables serve the snapshot's pairs from the mapping, and only the log's from memory
+      const std::vector<TableImage *> &images = mapped_snapshot->get_tables();
+      for (auto it = images.begin(); it != images.end(); it++) {
+        create_table((*it)->get_name());
+        Table *table = find_table((*it)->get_name());
+        if (table->get_num_stripes() != (*it)->get_num_stripes()) {
+          throw CommException("The snapshot's table " + (*it)->get_name() + " has a different number of stripes");
+        }
+        table->set_image(*it);
+      }
+      snapshot_log_end = mapped_snapshot->get_log_end();
+      snapshot_pairs = mapped_snapshot->get_num_pairs();
+    } else {
+      Snapshot::load(path + ".snapshot", [this]( const std::string &name ) {
+          create_table(name);
+          return find_table(name);
+        }, restorer, snapshot_log_end, snapshot_pairs);
+    }
+
+    unsigned long long num_pairs = 0;
+    unsigned long long num_records = WriteAheadLog::recover(path, snapshot_log_end,
+      [this, &restorer, &num_pairs]( WriteAheadLog::Op op, std::string_view name, std::string_view key,
+                                     std::string_view value ) {
+        if (op == WriteAheadLog::Op::CREATE) {
+          create_table(std::string(name));
+          return;
+        }
+        Table *table = find_table(HashedKey(name));
+        if (table == nullptr) {
+          create_table(std::string(name));
+          table = find_table(HashedKey(name));
+        }
+        restorer.restore(table, HashedKey(key), value);
+        num_pairs++;
+      });
+    restorer.finish();
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << "Recovered " << table_names.size() << " table(s) from " << snapshot_pairs
+              << (mapped_snapshot != nullptr ? " mapped" : "") << " snapshot pair(s) and "
+              << num_records << " log record(s) with " << num_pairs << " pair(s) in " << elapsed.count() << " ms"
+              << " with " << recovery_threads << " thread(s)\n";
+  }
+
+  wal = new WriteAheadLog(path, durability, period_ms);
+  log_rewrite_base = wal->end();
+}
+
+bool Server::write_snapshot()
+{
+  if (wal == nullptr) { return false; }
+  pthread_mutex_lock(&maintenance_mutex);
+
+  // A CREATE is logged and its table inserted with the directory locked, so every table
+  // whose CREATE is in the log before log_end is in the list
+  std::vector<Table *> tables;
+  table_names.lock();
+  unsigned long long log_end = wal->end();
+  table_names.for_each([&tables]( const std::string &, Table *table ) { tables.push_back(table); });
+  table_names.unlock();
+
+  std::string path = log_path + ".snapshot";
+  try {
+    Snapshot::write(path + ".tmp", log_end, tables);
+
+    // Every change copied into the snapshot was logged before it was applied. Syncing the log
+    // before the snapshot replaces the old one means a crash can never leave a change (or part
+    // of a transaction) in the snapshot that is missing from the log after it.
+    if (!wal->sync()) { throw CommException("Could not write to the log"); }
+    Snapshot::install(path + ".tmp", path);
+  } catch (CommException &ex) {
+    pthread_mutex_unlock(&maintenance_mutex);
+    log_error( ex.what() );
+    return false;
+  } catch (OperationException &ex) {
+    pthread_mutex_unlock(&maintenance_mutex);
+    log_error( ex.what() );
+    return false;
+  }
+
+  snapshot_log_end = log_end;
+  pthread_mutex_unlock(&maintenance_mutex);
+  return true;
+}
+
+bool Server::rewrite_log()
+{
+  if (wal == nullptr) { return false; }
+  pthread_mutex_lock(&maintenance_mutex);
+
+  // As for a snapshot, every table whose CREATE is in the log before from is in the list, and
+  // every change logged before from is applied by the time its stripe is copied
+  std::vector<Table *> tables;
+  table_names.lock();
+  unsigned long long from = wal->end();
+  table_names.for_each([&tables]( const std::string &, Table *table ) { tables.push_back(table); });
+  table_names.unlock();
+
+  bool had_snapshot = false;
+  std::string error;
+  try {
+    WriteAheadLog::write_compacted(log_path + ".rewrite", tables);
+
+    // A crash before the new log is in place then replays the old one from the start, instead
+    // of replaying the new one from the snapshot's offset in the old one
+    had_snapshot = Snapshot::remove(log_path + ".snapshot");
+    snapshot_log_end = 0;
+    wal->replace(log_path + ".rewrite", from);
+  } catch (CommException &ex) {
+    error = ex.what();
+  } catch (OperationException &ex) {
+    error = ex.what();
+  }
+
+  if (error.empty()) { log_rewrite_base = wal->end(); }
+  else { unlink((log_path + ".rewrite").c_str()); }
+  pthread_mutex_unlock(&maintenance_mutex);
+
+  // Whether or not the log was replaced, startup is fast again once there is a snapshot
+  if (!error.empty()) { log_error( error ); }
+  if (had_snapshot) { write_snapshot(); }
+  return error.empty();
+}
+
+void Server::set_recovery_threads( int num_threads )
+{
+  recovery_threads = num_threads;
+}
+
+void Server::set_map_snapshot( bool map )
+{
+  map_snapshot = map;
+}
+
+void Server::start_snapshots( int interval_seconds )
+{
+  snapshot_interval = interval_seconds;
+  pthread_t thr_id;
+  if ( pthread_create( &thr_id, nullptr, snapshot_worker, this ) != 0 ) {
+    throw CommException("Could not create snapshot thread");
+  }
+  pthread_detach(thr_id);
+}
+
+void *Server::snapshot_worker( void *arg )
+{
+  Server *server = static_cast<Server *>( arg );
+
+  while (1) {
+    sleep(server->snapshot_interval);
+
+    // Nothing was committed since the last snapshot if the log has not grown
+    if (server->wal->end() != server->snapshot_log_end) { server->write_snapshot(); }
+  }
+
+  return nullptr;
+}
+
+void Server::start_log_rewrites( int percent )
+{
+  log_rewrite_percent = percent;
+  pthread_t thr_id;
+  if ( pthread_create( &thr_id, nullptr, log_rewrite_worker, this ) != 0 ) {
+    throw CommException("Could not create log rewrite thread");
+  }
+  pthread_detach(thr_id);
+}
+
+void *Server::log_rewrite_worker( void *arg )
+{
+  Server *server = static_cast<Server *>( arg );
+
+  while (1) {
+    usleep(LOG_REWRITE_CHECK_MS * 1000);
+
+    unsigned long long size = server->wal->end();
+    unsigned long long base = server->log_rewrite_base;
+    if (size >= LOG_REWRITE_MIN_BYTES && size > base && size - base >= base / 100 * server->log_rewrite_percent) {
+      server->rewrite_log();
+    }
+  }
+
+  return nullptr;
+}
+
+void Server::start_compactor()
+{
+  pthread_t thr_id;
+  if ( pthread_create( &thr_id, nullptr, compactor_worker, this ) != 0 ) {
+    throw CommException("Could not create compactor thread");
+  }
+  pthread_detach(thr_id);
+}
+
+void *Server::compactor_worker( void *arg )
+{
+  Server *server = static_cast<Server *>( arg );
+
+  while (1) {
+    usleep(COMPACTION_INTERVAL_MS * 1000);
+
+    // Tables are never deleted, so the directory can be walked without holding off CREATEs
+    server->table_names.for_each([]( const std::string &, Table *table ) { table->compact(); });
+  }
+
+  return nullptr;
+}
+
+void Server::stop_acceptors()
+{
+  handoff_started.store(true);
+  uint64_t one = 1;
+  if (write(handoff_event_fd, &one, sizeof(one)) != sizeof(one)) { log_error( "Could not wake up the accept threads" ); }
+
+  for (unsigned i = 0; i < listen_fds.size(); i++) {
+    sem_wait(&acceptors_stopped);
+  }
+}
+
+void Server::resume_acceptors()
+{
+  uint64_t count;
+  if (read(handoff_event_fd, &count, sizeof(count)) != sizeof(count)) { log_error( "Could not reset the handoff event" ); }
+  handoff_started.store(false);
+
+  for (unsigned i = 0; i < listen_fds.size(); i++) {
+    sem_post(&acceptors_resumed);
+  }
+}
+
+void Server::set_pin_acceptors( bool pin )
+{
+  pin_acceptors = pin;
+}
+
+void Server::set_timeouts( int login_seconds, int idle_seconds )
 {
-  server_fd = open_listenfd(port.data());
-  if (server_fd < 0) { throw CommException("Failed to create server socket"); }
+  login_timeout = login_seconds;
+  idle_timeout = idle_seconds;
+}
 
+void Server::set_max_clients( int max )
+{
+  max_clients = max;
+}
+
+int Server::open_reuseport_listenfd( const std::string &port )
+{
+  addrinfo hints;
+  addrinfo *listp;
+  memset(&hints, 0, sizeof(addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+  if (getaddrinfo(nullptr, port.data(), &hints, &listp) != 0) { return -1; }
+
+  // Same as open_listenfd, except that every socket bound to the port shares its connections
+  int listen_fd = -1;
+  for (addrinfo *p = listp; p; p = p->ai_next) {
+    listen_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (listen_fd < 0) { continue; }
+
+    int optval = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+
+    if (bind(listen_fd, p->ai_addr, p->ai_addrlen) == 0) { break; }
+    close(listen_fd);
+    listen_fd = -1;
+  }
+  freeaddrinfo(listp);
+
+  if (listen_fd >= 0 && ::listen(listen_fd, LISTENQ) < 0) {
+    close(listen_fd);
+    return -1;
+  }
+  return listen_fd;
 }
 
 void Server::server_loop() {
+  loop_mode = LoopMode::THREAD_PER_CLIENT;
+  run_acceptors();
+}
+
+
+void *Server::client_worker( void *arg )
+{
+  std::unique_ptr<ClientConnection> client( static_cast<ClientConnection *>( arg ) );
+
+  client->chat_with_client();
+  return nullptr;
+}
+
+
+void Server::run_acceptors() {
+  int num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  // Every listener but the first gets its own accept thread, and the first is served here
+  for (unsigned i = 1; i < listen_fds.size(); i++) {
+    AcceptorArgs *args = new AcceptorArgs{ this, listen_fds[i], (int) i % num_cpus };
+
+    pthread_t thr_id;
+    if ( pthread_create( &thr_id, nullptr, acceptor_worker, args ) != 0 ) {
+      throw CommException("Could not create accept thread");
+    }
+  }
+
+  acceptor_worker(new AcceptorArgs{ this, listen_fds[0], 0 });
+}
+
+
+void *Server::acceptor_worker( void *arg )
+{
+  std::unique_ptr<AcceptorArgs> args( static_cast<AcceptorArgs *>( arg ) );
+  Server *server = args->server;
+
+  if (server->pin_acceptors) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(args->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+      server->log_error( "Could not pin accept thread to a core" );
+    }
+  }
 
   while (1) {
-    int client_fd = accept(server_fd, nullptr, nullptr);
+    // During a handoff, the thread waits until the new server has taken over or has failed to
+    if (server->handoff_started.load(std::memory_order_relaxed)) {
+      sem_post(&server->acceptors_stopped);
+      sem_wait(&server->acceptors_resumed);
+      continue;
+    }
+
+    int client_fd = accept(args->listen_fd, nullptr, nullptr);
     if (client_fd < 0) {
-      log_error( "Could not accept a client" );
+      // Listeners that can be handed off are non-blocking, so that a handoff can interrupt the wait
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        pollfd fds[2] = { { args->listen_fd, POLLIN, 0 }, { server->handoff_event_fd, POLLIN, 0 } };
+        poll(fds, 2, -1);
+        continue;
+      }
+      server->log_error( "Could not accept a client" );
+      continue;
     }
 
+    server->dispatch_client(client_fd);
+  }
+
+  return nullptr;
+}
+
+
+void Server::dispatch_client( int client_fd ) {
+
+  if (!admit_client(client_fd)) { return; }
+
+  if (loop_mode == LoopMode::POOL) {
+    connection_queue->push(client_fd);
+  }
+
+  else if (loop_mode == LoopMode::EPOLL || loop_mode == LoopMode::SHARDED || loop_mode == LoopMode::COROUTINES) {
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    ClientConnection *client = new ClientConnection( this, client_fd );
+
+    // The event loop owns the connection as soon as it is registered
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = client;
+    unsigned loop = next_loop.fetch_add(1, std::memory_order_relaxed) % epoll_fds.size();
+    if (loop_mode == LoopMode::SHARDED) { client->set_shard(shards[loop]); }
+    if (loop_mode == LoopMode::COROUTINES) { client->start_session(); }
+    if (loop_mode != LoopMode::SHARDED) { client->set_event_loop(); }
+    if (epoll_ctl(epoll_fds[loop], EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+      log_error( "Could not register a client with the event loop" );
+      delete client;
+    }
+  }
+
+  else {
     ClientConnection *client = new ClientConnection( this, client_fd );
 
     pthread_t thr_id;
     if ( pthread_create( &thr_id, nullptr, client_worker, client ) != 0 ) {
       log_error( "Could not create client thread" );
+      delete client;
+    } else {
+      pthread_detach(thr_id);
     }
-    
   }
 }
 
 
-void *Server::client_worker( void *arg )
+bool Server::admit_client( int client_fd ) {
+
+  if (num_clients.fetch_add(1, std::memory_order_relaxed) < max_clients || max_clients <= 0) { return true; }
+
+  // The socket's send buffer is empty, so the rejection is written without blocking the accept thread
+  num_clients.fetch_sub(1, std::memory_order_relaxed);
+  std::string_view rejection = OutputBuffer::fixed_encoding(OutputBuffer::FixedResponse::TOO_MANY_CLIENTS);
+  send(client_fd, rejection.data(), rejection.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+  close(client_fd);
+  return false;
+}
+
+
+void Server::release_client() {
+  num_clients.fetch_sub(1, std::memory_order_relaxed);
+}
+
+
+void Server::server_loop_epoll( int num_threads ) {
+
+  for (int i = 0; i < num_threads; i++) {
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) { throw CommException("Could not create epoll instance"); }
+    epoll_fds.push_back(epoll_fd);
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_t thr_id;
+    if ( pthread_create( &thr_id, nullptr, epoll_worker, new EventLoopArgs{ this, epoll_fds[i], nullptr } ) != 0 ) {
+      throw CommException("Could not create event loop thread");
+    }
+  }
+
+  loop_mode = LoopMode::EPOLL;
+  run_acceptors();
+}
+
+
+void Server::server_loop_sharded( int num_shards ) {
+
+  // The rings between shards can only be set up once every shard exists
+  for (int i = 0; i < num_shards; i++) {
+    shards.push_back(new Shard( i, shards ));
+  }
+  for (int i = 0; i < num_shards; i++) {
+    shards[i]->connect_peers();
+  }
+
+  for (int i = 0; i < num_shards; i++) {
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) { throw CommException("Could not create epoll instance"); }
+    epoll_fds.push_back(epoll_fd);
+
+    // Other shards wake the loop up through its event, which is told apart from clients by a null pointer
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shards[i]->get_event_fd(), &ev) < 0) {
+      throw CommException("Could not register a shard's event");
+    }
+  }
+
+  for (int i = 0; i < num_shards; i++) {
+    pthread_t thr_id;
+    if ( pthread_create( &thr_id, nullptr, epoll_worker, new EventLoopArgs{ this, epoll_fds[i], shards[i] } ) != 0 ) {
+      throw CommException("Could not create shard thread");
+    }
+  }
+
+  loop_mode = LoopMode::SHARDED;
+  run_acceptors();
+}
+
+
+void *Server::epoll_worker( void *arg )
 {
-  std::unique_ptr<ClientConnection> client( static_cast<ClientConnection *>( arg ) );
+  std::unique_ptr<EventLoopArgs> args( static_cast<EventLoopArgs *>( arg ) );
+  Server *server = args->server;
+  epoll_event events[MAX_EPOLL_EVENTS];
+
+  // With timeouts, the loop keeps a list of its connections and wakes up regularly to sweep it
+  bool timeouts = server->login_timeout > 0 || server->idle_timeout > 0;
+  std::vector<ClientConnection *> clients;
+  std::chrono::steady_clock::time_point next_sweep = std::chrono::steady_clock::now();
+
+  // Connections whose next request waits for a table's lock or the log, which are retried on every pass
+  std::vector<ClientConnection *> waiters;
+  std::vector<ClientConnection *> retrying;
+
+  // Closes a finished connection, or lists it to retry once it waits for a lock or the log
+  auto settle = [&clients, &waiters]( ClientConnection *client, bool keep_open ) {
+    auto waiter = std::find(waiters.begin(), waiters.end(), client);
+    if (!keep_open) {
+      if (waiter != waiters.end()) { waiters.erase(waiter); }
+      untrack_client(clients, client);
+      delete client;
+    } else if (client->is_waiting_to_retry() && waiter == waiters.end()) {
+      waiters.push_back(client);
+    }
+  };
+
+  // A shard's thread stays on its core, next to the tables it owns
+  Shard *shard = args->shard;
+  std::vector<ShardMessage *> answers;
+  if (shard != nullptr) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(shard->get_index() % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+      server->log_error( "Could not pin shard thread to a core" );
+    }
+  }
+
+  while (1) {
+    int wait_ms = !waiters.empty() ? LOCK_RETRY_MS : (timeouts ? TIMEOUT_SWEEP_MS : -1);
+
+    // A shard only sleeps once every message sent to it is handled, and retries full rings soon
+    if (shard != nullptr && shard->flush_overflow()) { wait_ms = 1; }
+    if (shard != nullptr && !shard->prepare_to_sleep()) { wait_ms = 0; }
+
+    int num_events = epoll_wait(args->epoll_fd, events, MAX_EPOLL_EVENTS, wait_ms);
+    if (shard != nullptr) { shard->woke_up(); }
+    if (num_events < 0) { continue; }
+
+    for (int i = 0; i < num_events; i++) {
+      ClientConnection *client = static_cast<ClientConnection *>( events[i].data.ptr );
+      bool keep_open = true;
+
+      // The shard's event was already reset by woke_up
+      if (client == nullptr) { continue; }
+
+      // A new socket is writable as soon as it is registered, so its first event lists it
+      if (timeouts && client->get_loop_slot() < 0) { track_client(clients, client); }
+
+      // Errors and hangups are reported through read(), so they are handled as input
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        keep_open = client->on_readable();
+      }
+      if (keep_open && (events[i].events & EPOLLOUT)) {
+        keep_open = client->on_writable();
+      }
+
+      // Closing the socket in the destructor also removes it from the epoll instance
+      settle(client, keep_open);
+    }
+
+    retrying.swap(waiters);
+    for (auto it = retrying.begin(); it != retrying.end(); it++) {
+      (*it)->on_retry();
+      settle(*it, (*it)->on_writable());
+    }
+    retrying.clear();
+
+    // Answers let connections carry on, and their next operations may be answered at once
+    while (shard != nullptr && shard->take_answers(answers)) {
+      for (auto it = answers.begin(); it != answers.end(); it++) {
+        ClientConnection *client = (*it)->client;
+        bool keep_open = client->on_shard_answer(**it);
+        delete *it;
+        settle(client, keep_open);
+      }
+    }
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (timeouts && now >= next_sweep) {
+      next_sweep = now + std::chrono::milliseconds(TIMEOUT_SWEEP_MS);
+
+      // Going backwards, removing a connection only moves one that was already checked
+      for (size_t i = clients.size(); i-- > 0; ) {
+        ClientConnection *client = clients[i];
+        if (client->check_timeout(now)) { settle(client, client->on_writable()); }
+      }
+    }
+  }
+
+  return nullptr;
+}
+
+
+void Server::server_loop_coroutines( int num_threads ) {
+
+  for (int i = 0; i < num_threads; i++) {
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) { throw CommException("Could not create epoll instance"); }
+    epoll_fds.push_back(epoll_fd);
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_t thr_id;
+    if ( pthread_create( &thr_id, nullptr, coroutine_worker, new EventLoopArgs{ this, epoll_fds[i], nullptr } ) != 0 ) {
+      throw CommException("Could not create coroutine scheduler thread");
+    }
+  }
+
+  loop_mode = LoopMode::COROUTINES;
+  run_acceptors();
+}
+
+
+void *Server::coroutine_worker( void *arg )
+{
+  std::unique_ptr<EventLoopArgs> args( static_cast<EventLoopArgs *>( arg ) );
+  Server *server = args->server;
+  epoll_event events[MAX_EPOLL_EVENTS];
+
+  bool timeouts = server->login_timeout > 0 || server->idle_timeout > 0;
+  std::vector<ClientConnection *> clients;
+  std::chrono::steady_clock::time_point next_sweep = std::chrono::steady_clock::now();
+
+  // Sessions waiting for a table's lock or the log, which are resumed on every pass to try again
+  std::vector<ClientConnection *> waiters;
+  std::vector<ClientConnection *> retrying;
+
+  // Resumes a session, and closes its connection once it has finished
+  auto run = [&clients, &waiters]( ClientConnection *client ) {
+    if (!client->resume_session()) {
+      untrack_client(clients, client);
+      delete client;
+    } else if (client->is_waiting_to_retry()) {
+      waiters.push_back(client);
+    }
+  };
+
+  while (1) {
+    int wait_ms = !waiters.empty() ? LOCK_RETRY_MS : (timeouts ? TIMEOUT_SWEEP_MS : -1);
+    int num_events = epoll_wait(args->epoll_fd, events, MAX_EPOLL_EVENTS, wait_ms);
+    if (num_events < 0) { continue; }
+
+    for (int i = 0; i < num_events; i++) {
+      ClientConnection *client = static_cast<ClientConnection *>( events[i].data.ptr );
+      if (timeouts && client->get_loop_slot() < 0) { track_client(clients, client); }
+
+      // A session waiting for a lock or the log reads and writes until the socket would block before it
+      // waits for I/O again, so it misses nothing by ignoring the event
+      if (client->is_waiting_for_io()) { run(client); }
+    }
+
+    retrying.swap(waiters);
+    for (auto it = retrying.begin(); it != retrying.end(); it++) { run(*it); }
+    retrying.clear();
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (timeouts && now >= next_sweep) {
+      next_sweep = now + std::chrono::milliseconds(TIMEOUT_SWEEP_MS);
+
+      // A timed out session is resumed to send its ERROR and finish
+      for (size_t i = clients.size(); i-- > 0; ) {
+        ClientConnection *client = clients[i];
+        if (client->is_waiting_for_io() && client->check_timeout(now)) { run(client); }
+      }
+    }
+  }
+
+  return nullptr;
+}
+
+
+void Server::server_loop_pool( int num_workers, int queue_depth ) {
+  connection_queue = new ConnectionQueue( queue_depth );
+
+  for (int i = 0; i < num_workers; i++) {
+    pthread_t thr_id;
+    if ( pthread_create( &thr_id, nullptr, pool_worker, this ) != 0 ) {
+      throw CommException("Could not create pool worker thread");
+    }
+  }
+
+  loop_mode = LoopMode::POOL;
+  run_acceptors();
+}
+
+
+void *Server::pool_worker( void *arg )
+{
+  Server *server = static_cast<Server *>( arg );
+
+  // Each worker serves one client at a time, so it keeps reusing a single connection object
+  ClientConnection client( server, -1 );
+
+  while (1) {
+    client.reset( server->connection_queue->pop() );
+    client.chat_with_client();
+    client.close_connection();
+  }
 
-  client->chat_with_client();
   return nullptr;
 }
 
 
+void Server::server_loop_uring() {
+  IoUring ring;
+
+  if (!ring.init(URING_ENTRIES, URING_NUM_BUFFERS, URING_BUFFER_SIZE)) {
+    log_error( "io_uring is not supported, falling back to one thread per client" );
+    server_loop();
+    return;
+  }
+
+  // The listener's index is kept in the user_data bits that hold a pointer for other operations
+  for (unsigned i = 0; i < listen_fds.size(); i++) {
+    ring.prep_multishot_accept(listen_fds[i], URING_ACCEPT | (i << 2));
+  }
+  std::vector<UringClient *> touched;
+
+  // With timeouts, a timer wakes the loop up regularly to sweep its connections
+  bool timeouts = login_timeout > 0 || idle_timeout > 0;
+  std::vector<UringClient *> clients;
+  __kernel_timespec sweep_interval = { TIMEOUT_SWEEP_MS / 1000, (TIMEOUT_SWEEP_MS % 1000) * 1000000 };
+  bool sweep = false;
+  if (timeouts) { ring.prep_timeout(&sweep_interval, URING_SWEEP_TIMER); }
+
+  // Clients whose next request waits for a table's lock or the log, which another timer has retried soon
+  std::vector<UringClient *> waiters;
+  std::vector<UringClient *> retrying;
+  __kernel_timespec retry_interval = { 0, LOCK_RETRY_MS * 1000000 };
+  bool retry_armed = false;
+  bool retry = false;
+
+  while (1) {
+    // One system call submits every send and receive queued by the last batch
+    if (ring.submit_and_wait(1) < 0) {
+      log_error( "Could not wait for io_uring completions" );
+      continue;
+    }
+
+    io_uring_cqe *cqe;
+    while ((cqe = ring.peek_cqe()) != nullptr) {
+      unsigned long long user_data = cqe->user_data;
+      unsigned long long tag = user_data & URING_TAG_MASK;
+      UringClient *conn = reinterpret_cast<UringClient *>( user_data & ~URING_TAG_MASK );
+      int res = cqe->res;
+      bool more = cqe->flags & IORING_CQE_F_MORE;
+      unsigned buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      ring.cqe_seen();
+
+      if (user_data == URING_RETRY_TIMER) {
+        retry_armed = false;
+        retry = true;
+        continue;
+      }
+      if (tag == URING_TIMER) {
+        sweep = true;
+        continue;
+      }
+
+      if (tag == URING_ACCEPT) {
+        if (res >= 0 && admit_client(res)) {
+          conn = new UringClient{ new ClientConnection( this, res ), "", 0, true, false, false, false, false, false };
+          conn->client->set_event_loop();
+          ring.prep_multishot_recv(res, (unsigned long long) conn | URING_RECV);
+          track_client(clients, conn);
+        } else if (res < 0) {
+          log_error( "Could not accept a client" );
+        }
+        if (!more) { ring.prep_multishot_accept(listen_fds[user_data >> 2], user_data); }
+        continue;
+      }
+
+      if (tag == URING_RECV) {
+        if (res > 0) {
+          if (!conn->closing) { conn->client->on_data(ring.get_buffer(buffer_id), res); }
+          ring.recycle_buffer(buffer_id);
+        } else if (res != -ENOBUFS && !conn->closing) {
+          conn->client->on_eof();
+        }
+
+        if (!more) {
+          conn->recv_armed = false;
+          // Running out of provided buffers stops the receive, but not the connection
+          if (res == -ENOBUFS && !conn->closing && !conn->client->is_finished()) {
+            ring.prep_multishot_recv(conn->client->get_m_client_fd(), (unsigned long long) conn | URING_RECV);
+            conn->recv_armed = true;
+          }
+        }
+      } else {
+        conn->send_in_flight = false;
+        if (res < 0) { conn->closing = true; }
+        else { conn->sent += res; }
+      }
+
+      if (!conn->queued) {
+        conn->queued = true;
+        touched.push_back(conn);
+      }
+    }
+
+    if (sweep) {
+      sweep = false;
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      ring.prep_timeout(&sweep_interval, URING_SWEEP_TIMER);
+
+      // A timed out client only has its ERROR to send before it is closed
+      for (auto it = clients.begin(); it != clients.end(); it++) {
+        if ((*it)->client->check_timeout(now) && !(*it)->queued) {
+          (*it)->queued = true;
+          touched.push_back(*it);
+        }
+      }
+    }
+
+    if (retry) {
+      retry = false;
+      retrying.swap(waiters);
+      for (auto it = retrying.begin(); it != retrying.end(); it++) {
+        (*it)->retrying = false;
+        if (!(*it)->closing) { (*it)->client->on_retry(); }
+        if (!(*it)->queued) {
+          (*it)->queued = true;
+          touched.push_back(*it);
+        }
+      }
+      retrying.clear();
+    }
+
+    // Queue the responses produced by this batch so they are all sent with the next submission
+    for (auto it = touched.begin(); it != touched.end(); it++) {
+      UringClient *conn = *it;
+      conn->queued = false;
+      if (service_uring_client(ring, conn, clients) && !conn->closing && !conn->retrying &&
+          conn->client->is_waiting_to_retry()) {
+        conn->retrying = true;
+        waiters.push_back(conn);
+      }
+    }
+    touched.clear();
+
+    // The ring's only thread must not block on a lock or an fsync, so waiting clients try again a little later
+    if (!waiters.empty() && !retry_armed) {
+      ring.prep_timeout(&retry_interval, URING_RETRY_TIMER);
+      retry_armed = true;
+    }
+  }
+}
+
+
 void Server::log_error( const std::string &what )
 {
   std::cerr << "Error: " << what << "\n";
@@ -75,19 +1232,39 @@ void Server::unlock() {
 }
 
 
-void Server::create_table( const std::string &name ) {
+bool Server::create_table( const std::string &name ) {
+  // The table is built before the directory is locked, so CREATEs only wait for each other to insert
   Table* new_table = new Table(name);
 
-  table_names[name] = new_table;
+  // The CREATE is logged before the table exists, so it precedes every SET to the table in the log.
+  // The directory stays locked until the table is inserted, so that a snapshot, which notes where
+  // the log ends with the directory locked, has every table created before that point.
+  table_names.lock();
+  bool created = table_names.find(HashedKey(name)) == nullptr;
+  if (created && wal != nullptr) {
+    std::string record;
+    WriteAheadLog::append_create(record, name);
+    try {
+      wal->commit(record);
+    } catch (...) {
+      table_names.unlock();
+      delete new_table;
+      throw;
+    }
+  }
+  if (created) { table_names.insert_locked(name, new_table); }
+  table_names.unlock();
+
+  if (!created) { delete new_table; }
+  return created;
 }
 
 
 Table* Server::find_table( const std::string &name ) {
+  return find_table(HashedKey(name));
+}
 
-  // If the table name is in the map, return its corresponding table
-  if (table_names.find(name) != table_names.end()) {
-    return table_names[name];
-  }
 
-  return nullptr;
+Table* Server::find_table( const HashedKey &name ) {
+  return table_names.find(name);
 }
@@ -1,49 +1,283 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-#include <unordered_map>
+#include <atomic>
+#include <vector>
 #include <string>
 #include <pthread.h>
+#include <semaphore.h>
 #include "table.h"
+#include "table_directory.h"
+#include "wal.h"
+#include "snapshot.h"
 #include "client_connection.h"
+#include "connection_queue.h"
+#include "shard.h"
 
 class Server {
 private:
+  /* How accepted clients are handed to the threads that serve them. */
+  enum class LoopMode {
+    THREAD_PER_CLIENT,
+    EPOLL,
+    POOL,
+    SHARDED,
+    COROUTINES,
+  };
+
+  /* What an event loop thread needs to know about its epoll instance, and the shard
+  it runs (nullptr outside of server_loop_sharded). */
+  struct EventLoopArgs {
+    Server *server;
+    int epoll_fd;
+    Shard *shard;
+  };
+
+  /* What an accept thread needs to know about its listener. */
+  struct AcceptorArgs {
+    Server *server;
+    int listen_fd;
+    int cpu;
+  };
+
   int server_fd;
 
-  std::unordered_map<std::string, Table*> table_names;
+  /* Listening sockets: the TCP listener(s), which all share the port when there is more
+  than one, and then the Unix domain listener, if any. */
+  std::vector<int> listen_fds;
+
+  LoopMode loop_mode;
+
+  /* Whether each accept thread is pinned to its own core. */
+  bool pin_acceptors;
+
+  /* Looked up without locking by every request; CREATE only waits for other CREATEs. */
+  TableDirectory table_names;
 
   pthread_mutex_t mutex;
 
   bool mutex_is_locked;
 
+  /* One epoll instance per event loop thread (only used by server_loop_epoll, server_loop_sharded
+  and server_loop_coroutines). */
+  std::vector<int> epoll_fds;
+
+  /* Each core's shard of the tables, which replace table_names (only used by server_loop_sharded). */
+  std::vector<Shard *> shards;
+
+  /* Accepted sockets waiting for a pool worker (only used by server_loop_pool). */
+  ConnectionQueue *connection_queue;
+
+  /* Event loop that receives the next accepted client (only used by server_loop_epoll,
+  server_loop_sharded and server_loop_coroutines). */
+  std::atomic<unsigned> next_loop;
+
+  /* Seconds a client may take to log in, and may stay silent afterwards (0 for no limit). */
+  int login_timeout;
+  int idle_timeout;
+
+  /* Clients that may be connected at once (0 for no limit), and the clients connected now. */
+  int max_clients;
+  std::atomic<int> num_clients;
+
+  /* Control socket a new server process connects to in order to take over (-1 if none). */
+  int control_fd;
+
+  /* Write-ahead log every commit is appended to (nullptr if the server keeps no log). */
+  WriteAheadLog *wal;
+  std::string log_path;
+
+  /* Where in the log the last snapshot written or loaded was taken (0 if there is none),
+  and the seconds between snapshots. */
+  unsigned long long snapshot_log_end;
+  int snapshot_interval;
+
+  /* How much (in percent) the log may grow past its size after it was last rewritten (or
+  opened) before it is rewritten again, and that size. */
+  int log_rewrite_percent;
+  std::atomic<unsigned long long> log_rewrite_base;
+
+  /* Held while a snapshot is written or the log rewritten, so they never overlap, and by a
+  handoff, so the new server never appends to a log this one is about to replace. */
+  pthread_mutex_t maintenance_mutex;
+
+  /* Threads that rebuild the tables in open_log (one per core unless set). */
+  int recovery_threads;
+
+  /* Whether open_log maps the snapshot instead of loading it, and the mapping the tables
+  serve their snapshot pairs from (nullptr if none). */
+  bool map_snapshot;
+  MappedSnapshot *mapped_snapshot;
+
+  /* Set while the server is being handed over. The accept threads stop, post acceptors_stopped,
+  and wait on acceptors_resumed in case the handoff fails. handoff_event_fd wakes them up. */
+  std::atomic<bool> handoff_started;
+  int handoff_event_fd;
+  sem_t acceptors_stopped;
+  sem_t acceptors_resumed;
+
   // copy constructor and assignment operator are prohibited
   Server( const Server & );
   Server &operator=( const Server & );
 
+  /* Opens a listening socket with SO_REUSEPORT, so the kernel spreads connections over
+  every socket bound to the port. Returns -1 on failure. */
+  static int open_reuseport_listenfd( const std::string &port );
+
+  /* Runs an accept loop for every listener (the first on the calling thread). */
+  void run_acceptors();
+
+  static void *acceptor_worker( void *arg );
+
+  /* Hands an accepted client to the threads of the current loop mode. */
+  void dispatch_client( int client_fd );
+
+  /* Receives the listening sockets and tables sent by hand_off, and acknowledges them.
+  Returns the number of pairs received. */
+  unsigned long long receive_handoff( int handoff_fd );
+
+  static void *handoff_worker( void *arg );
+
+  static void *compactor_worker( void *arg );
+
+  static void *snapshot_worker( void *arg );
+
+  static void *log_rewrite_worker( void *arg );
+
+  /* Hands the listening sockets and the tables over to a new server process connected to the
+  control socket, and exits once it has taken them over. Returns if the handoff fails. */
+  void hand_off( int handoff_fd );
+
+  /* Stops the accept threads, or lets them carry on after a failed handoff. */
+  void stop_acceptors();
+  void resume_acceptors();
+
+  /* Counts a newly accepted client. If the server is full, the client is sent an ERROR
+  and disconnected right away, and false is returned. */
+  bool admit_client( int client_fd );
+
 public:
   Server();
   ~Server();
 
-  void listen( const std::string &port );
+  /* Opens the listening socket(s). With more than one listener, each gets its own
+  SO_REUSEPORT socket and accept thread. */
+  void listen( const std::string &port, int num_listeners = 1 );
+
+  /* Also accepts clients on the same host through a Unix domain socket at path. */
+  void listen_unix( const std::string &path );
+
+  /* Takes the listening sockets and tables over from the server whose control socket is at
+  control_path. Returns false if no server is listening there. */
+  bool take_over( const std::string &control_path );
+
+  /* Lets a new server process take this one over through a control socket at control_path.
+  Must be called before the server loop starts. */
+  void serve_handoffs( const std::string &control_path );
+
+  /* Pin each accept thread to its own core. */
+  void set_pin_acceptors( bool pin );
+
+  /* Disconnect clients that have not logged in after login_seconds, or that have not sent
+  anything for idle_seconds. 0 disables a timeout. */
+  void set_timeouts( int login_seconds, int idle_seconds );
+
+  /* Reject clients beyond max connected at once. 0 disables the limit. */
+  void set_max_clients( int max );
+
+  /* Starts a background thread that periodically compacts the tables' arenas, reclaiming
+  the memory of overwritten values. */
+  void start_compactor();
+
+  /* Rebuilds the tables, if recover is set, from the snapshot at path.snapshot (if there is
+  one) and the part of the write-ahead log at path written after it, and then appends every
+  later commit to the log with the given durability. Throws a CommException if the snapshot
+  or the log cannot be read, or the log cannot be opened. */
+  void open_log( const std::string &path, WriteAheadLog::Durability durability, int period_ms, bool recover );
+
+  /* Rebuild the tables from num_threads threads in open_log: one reading the snapshot and
+  the log, and num_threads restoring pairs, each into its own share of the tables' stripes
+  (see ParallelRestore). 1 restores them on the reading thread. */
+  void set_recovery_threads( int num_threads );
+
+  /* Have open_log map the snapshot, and the tables serve the pairs in it from the mapping
+  (see MappedSnapshot), rather than load them into memory. Pairs from the log, and those
+  committed later, are still kept in memory. */
+  void set_map_snapshot( bool map );
+
+  /* Writes a snapshot of every table to the log's path.snapshot, replacing the previous one
+  once the new one is complete. Clients carry on meanwhile (see Snapshot::write). Returns
+  false, after logging the error, if there is no log or the snapshot could not be written. */
+  bool write_snapshot();
+
+  /* Starts a background thread that writes a snapshot every interval_seconds, if anything
+  was committed since the last one. Requires open_log. */
+  void start_snapshots( int interval_seconds );
+
+  /* Rewrites the log to one record per live key, followed by the records committed while
+  that was written, and puts the new log in place of the old one (see WriteAheadLog::replace).
+  Clients carry on meanwhile. The snapshot is removed first, as the offset it was taken at
+  means nothing in the new log, and written again afterwards. Returns false, after logging the
+  error, if there is no log or it could not be rewritten. */
+  bool rewrite_log();
+
+  /* Starts a background thread that rewrites the log whenever it has grown by percent since
+  it was last rewritten (or opened), and is at least a megabyte. Requires open_log. */
+  void start_log_rewrites( int percent );
+
+  /* The write-ahead log, or nullptr if the server keeps none. */
+  WriteAheadLog *get_log() const { return wal; }
+
+  int get_login_timeout() const { return login_timeout; }
+  int get_idle_timeout() const { return idle_timeout; }
+
+  /* Called when a client's socket is closed, to make room for another client. */
+  void release_client();
 
   void server_loop();
 
   static void *client_worker( void *arg );
 
+  /* Serves every client from a fixed number of threads, each running an edge-triggered
+  epoll loop over non-blocking ClientConnections. Accepted sockets are handed out round-robin. */
+  void server_loop_epoll( int num_threads );
+
+  static void *epoll_worker( void *arg );
+
+  /* Shared-nothing mode: one epoll loop per core, pinned to it, which owns the tables whose
+  names hash to it (see Shard). Operations on other cores' tables are sent to their owner. */
+  void server_loop_sharded( int num_shards );
+
+  /* Serves every client from a fixed number of scheduler threads, each resuming the
+  coroutine sessions of its clients (see ClientConnection::session) from an epoll loop. */
+  void server_loop_coroutines( int num_threads );
+
+  static void *coroutine_worker( void *arg );
+
+  /* Serves clients from a fixed pool of worker threads, which take accepted sockets
+  from a bounded queue. The accept loop waits while the queue is full. */
+  void server_loop_pool( int num_workers, int queue_depth );
+
+  static void *pool_worker( void *arg );
+
+  /* Serves every client from one thread driving an io_uring (multishot accept, multishot
+  receive into provided buffers, and all sends of a batch submitted with one system call).
+  Falls back to server_loop if the kernel lacks the needed io_uring features. */
+  void server_loop_uring();
+
   void log_error( const std::string &what );
 
   void lock();
 
   void unlock();
 
-  std::unordered_map<std::string, Table*> get_table_map() { return table_names; }
-
-  void create_table( const std::string &name );
+  /* Creates a table called name, unless there is one already, and returns false then. */
+  bool create_table( const std::string &name );
 
   /* Check if a table is in the server's table map. Return the table if it is, and 
   return nullptr otherwise. */
   Table* find_table( const std::string &name );
+  Table* find_table( const HashedKey &name );
 };
 
 
@@ -1,18 +1,223 @@
 #include <iostream>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
 #include "server.h"
 
+void print_usage() {
+  std::cerr << "Usage: ./server [-e <threads> | -p <workers> [-q <depth>] | -i | -s <shards> |\n";
+  std::cerr << "                -C <threads>] [-a <listeners> [-P]]\n";
+  std::cerr << "                [-l <seconds>] [-t <seconds>] [-m <clients>] [-c <path>] [-u <path>]\n";
+  std::cerr << "                [-w <path> [-d <mode>] [-S <seconds>] [-L <percent>] [-R <threads>] [-M]]\n";
+  std::cerr << "                <port>\n";
+  std::cerr << "Options:\n";
+  std::cerr << "  -e <threads>   serve clients from <threads> epoll event loops\n";
+  std::cerr << "                 instead of one thread per client\n";
+  std::cerr << "  -p <workers>   serve clients from a pool of <workers> threads\n";
+  std::cerr << "  -q <depth>     accepted clients that may wait for a pool worker (default 1024)\n";
+  std::cerr << "  -i             serve clients from a single io_uring loop, if the kernel\n";
+  std::cerr << "                 supports it\n";
+  std::cerr << "  -s <shards>    shared-nothing mode: <shards> epoll event loops, each pinned to a core\n";
+  std::cerr << "                 and owning the tables whose names hash to it\n";
+  std::cerr << "  -C <threads>   serve clients as coroutine sessions, scheduled on <threads> threads\n";
+  std::cerr << "  -a <listeners> accept clients on <listeners> SO_REUSEPORT sockets, each with\n";
+  std::cerr << "                 its own accept thread (default 1)\n";
+  std::cerr << "  -P             pin each accept thread to its own core\n";
+  std::cerr << "  -l <seconds>   disconnect clients that have not logged in after <seconds>\n";
+  std::cerr << "  -t <seconds>   disconnect clients that have sent nothing for <seconds>\n";
+  std::cerr << "  -m <clients>   reject clients beyond <clients> connected at once with an ERROR\n";
+  std::cerr << "  -c <path>      hot restart through a control socket at <path>: take the port and\n";
+  std::cerr << "                 tables over from the server listening there, if any, and let the\n";
+  std::cerr << "                 next server started with -c <path> take over in turn (not with -i or -s)\n";
+  std::cerr << "  -u <path>      also accept clients on this host through a Unix domain socket at <path>\n";
+  std::cerr << "  -w <path>      log every commit to a write-ahead log at <path>, and rebuild the tables\n";
+  std::cerr << "                 from it at startup (not with -s)\n";
+  std::cerr << "  -d <mode>      when a commit is answered: fsync (after its own fsync, the default),\n";
+  std::cerr << "                 group (after an fsync shared with concurrent commits), or a number\n";
+  std::cerr << "                 of milliseconds (at once, with the log fsynced that often)\n";
+  std::cerr << "  -S <seconds>   write a snapshot of the tables to <path>.snapshot every <seconds>, so\n";
+  std::cerr << "                 that startup only replays the log written after it\n";
+  std::cerr << "  -L <percent>   rewrite the log to one record per key in the background whenever it has\n";
+  std::cerr << "                 grown by <percent> since it was last rewritten (and is at least 1 MiB)\n";
+  std::cerr << "  -R <threads>   rebuild the tables at startup from <threads> threads (default: one\n";
+  std::cerr << "                 per core)\n";
+  std::cerr << "  -M             serve the pairs in the snapshot from the file, mapped into memory,\n";
+  std::cerr << "                 instead of loading them at startup\n";
+}
+
 int main(int argc, char **argv)
 {
-  if ( argc != 2 ) {
-    std::cerr << "Usage: ./server <port>\n";
+  bool use_epoll = false;
+  int event_loop_threads = 0;
+  bool use_pool = false;
+  int pool_workers = 0;
+  int queue_depth = 1024;
+  bool use_uring = false;
+  bool use_shards = false;
+  int num_shards = 0;
+  bool use_coroutines = false;
+  int coroutine_threads = 0;
+  int num_listeners = 1;
+  bool pin_acceptors = false;
+  int login_timeout = 0;
+  int idle_timeout = 0;
+  int max_clients = 0;
+  std::string control_path;
+  std::string socket_path;
+  std::string log_path;
+  WriteAheadLog::Durability durability = WriteAheadLog::Durability::EVERY_COMMIT;
+  int log_period_ms = 0;
+  int snapshot_interval = 0;
+  int log_rewrite_percent = 0;
+  int recovery_threads = 0;
+  bool map_snapshot = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "e:p:q:is:C:a:Pl:t:m:c:u:w:d:S:L:R:M")) != -1) {
+    switch (opt) {
+      case 'e':
+        use_epoll = true;
+        event_loop_threads = atoi(optarg);
+        break;
+      case 'p':
+        use_pool = true;
+        pool_workers = atoi(optarg);
+        break;
+      case 'q':
+        queue_depth = atoi(optarg);
+        break;
+      case 'i':
+        use_uring = true;
+        break;
+      case 's':
+        use_shards = true;
+        num_shards = atoi(optarg);
+        break;
+      case 'C':
+        use_coroutines = true;
+        coroutine_threads = atoi(optarg);
+        break;
+      case 'a':
+        num_listeners = atoi(optarg);
+        break;
+      case 'P':
+        pin_acceptors = true;
+        break;
+      case 'l':
+        login_timeout = atoi(optarg);
+        break;
+      case 't':
+        idle_timeout = atoi(optarg);
+        break;
+      case 'm':
+        max_clients = atoi(optarg);
+        break;
+      case 'c':
+        control_path = optarg;
+        break;
+      case 'u':
+        socket_path = optarg;
+        break;
+      case 'w':
+        log_path = optarg;
+        break;
+      case 'd':
+        if (std::string(optarg) == "fsync") {
+          durability = WriteAheadLog::Durability::EVERY_COMMIT;
+        } else if (std::string(optarg) == "group") {
+          durability = WriteAheadLog::Durability::GROUP_COMMIT;
+        } else {
+          durability = WriteAheadLog::Durability::PERIODIC;
+          log_period_ms = atoi(optarg);
+          if (log_period_ms < 1) {
+            print_usage();
+            return 1;
+          }
+        }
+        break;
+      case 'S':
+        snapshot_interval = atoi(optarg);
+        if (snapshot_interval < 1) {
+          print_usage();
+          return 1;
+        }
+        break;
+      case 'L':
+        log_rewrite_percent = atoi(optarg);
+        if (log_rewrite_percent < 1) {
+          print_usage();
+          return 1;
+        }
+        break;
+      case 'R':
+        recovery_threads = atoi(optarg);
+        if (recovery_threads < 1) {
+          print_usage();
+          return 1;
+        }
+        break;
+      case 'M':
+        map_snapshot = true;
+        break;
+      default:
+        print_usage();
+        return 1;
+    }
+  }
+
+  if ( argc - optind != 1 || (use_epoll + use_pool + use_uring + use_shards + use_coroutines > 1) ||
+       (use_epoll && event_loop_threads < 1) || (use_shards && num_shards < 1) ||
+       (use_coroutines && coroutine_threads < 1) ||
+       (use_pool && pool_workers < 1) || queue_depth < 1 || num_listeners < 1 ||
+       login_timeout < 0 || idle_timeout < 0 || max_clients < 0 || ((use_uring || use_shards) && !control_path.empty()) ||
+       (use_shards && !log_path.empty()) || ((snapshot_interval > 0 || log_rewrite_percent > 0 || map_snapshot) && log_path.empty()) ) {
+    print_usage();
     return 1;
   }
 
   Server server;
 
   try {
-    server.listen( argv[1] );
-    server.server_loop();
+    // A server taking over keeps its predecessor's listeners, including its Unix domain socket
+    bool took_over = !control_path.empty() && server.take_over( control_path );
+    if (!took_over) {
+      server.listen( argv[optind], num_listeners );
+      if (!socket_path.empty()) { server.listen_unix( socket_path ); }
+    }
+    // Tables taken over are already up to date with the log, which the new server goes on appending to
+    if (recovery_threads > 0) {
+      server.set_recovery_threads( recovery_threads );
+    }
+    server.set_map_snapshot( map_snapshot );
+    if (!log_path.empty()) {
+      server.open_log( log_path, durability, log_period_ms, !took_over );
+    }
+    if (!control_path.empty()) {
+      server.serve_handoffs( control_path );
+    }
+    server.set_pin_acceptors( pin_acceptors );
+    server.set_timeouts( login_timeout, idle_timeout );
+    server.set_max_clients( max_clients );
+    server.start_compactor();
+    if (snapshot_interval > 0) {
+      server.start_snapshots( snapshot_interval );
+    }
+    if (log_rewrite_percent > 0) {
+      server.start_log_rewrites( log_rewrite_percent );
+    }
+    if (use_epoll) {
+      server.server_loop_epoll( event_loop_threads );
+    } else if (use_pool) {
+      server.server_loop_pool( pool_workers, queue_depth );
+    } else if (use_coroutines) {
+      server.server_loop_coroutines( coroutine_threads );
+    } else if (use_shards) {
+      server.server_loop_sharded( num_shards );
+    } else if (use_uring) {
+      server.server_loop_uring();
+    } else {
+      server.server_loop();
+    }
     std::cerr << "Hit loop\n";
   } catch ( std::runtime_error &ex ) {
     server.log_error( "Fatal error starting server" );
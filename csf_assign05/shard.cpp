@@ -0,0 +1,229 @@
+#include <functional>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "exceptions.h"
+#include "table.h"
+#include "shard.h"
+
+namespace {
+  // Messages that can wait in each ring between two shards
+  const size_t SHARD_RING_CAPACITY = 4096;
+}
+
+Shard::Shard( unsigned index, std::vector<Shard *> &shards )
+  : m_index( index )
+  , m_shards( shards )
+  , m_event_fd( eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK) )
+  , m_sleeping( false )
+  , m_next_txn( 0 )
+{
+  if (m_event_fd < 0) { throw CommException("Failed to create shard event"); }
+}
+
+Shard::~Shard()
+{
+  for (auto it = m_tables.begin(); it != m_tables.end(); it++) {
+    delete it->second;
+  }
+  for (auto it = m_inbound.begin(); it != m_inbound.end(); it++) {
+    delete *it;
+  }
+  close(m_event_fd);
+}
+
+void Shard::connect_peers()
+{
+  m_overflow.resize(m_shards.size());
+  for (unsigned i = 0; i < m_shards.size(); i++) {
+    m_inbound.push_back(i == m_index ? nullptr : new SpscRing<ShardMessage *>( SHARD_RING_CAPACITY ));
+  }
+}
+
+unsigned Shard::owner_of( const std::string &table, size_t num_shards )
+{
+  return std::hash<std::string>()(table) % num_shards;
+}
+
+unsigned long long Shard::new_transaction()
+{
+  // Unique across shards without any shared counter
+  return m_next_txn++ * m_shards.size() + m_index;
+}
+
+bool Shard::submit( ShardMessage &msg )
+{
+  unsigned owner = owner_of(msg.table, m_shards.size());
+  msg.origin = m_index;
+
+  if (owner != m_index) {
+    send(owner, new ShardMessage(std::move(msg)));
+    return false;
+  }
+
+  if (execute(msg)) { return true; }
+  m_waiting[msg.table_obj].push_back(new ShardMessage(std::move(msg)));
+  return false;
+}
+
+bool Shard::execute( ShardMessage &msg )
+{
+  msg.failed = false;
+
+  if (msg.op == ShardMessage::Op::CREATE) {
+    if (m_tables.find(msg.table) != m_tables.end()) {
+      msg.failed = true;
+      msg.value = "A table with this name already exists.";
+    } else {
+      // Only this shard's thread uses the table, so it needs no stripes
+      m_tables[msg.table] = new Table(msg.table, 1);
+    }
+    return true;
+  }
+
+  // COMMIT and ROLLBACK name a table their transaction has already claimed
+  if (msg.op == ShardMessage::Op::COMMIT || msg.op == ShardMessage::Op::ROLLBACK) {
+    if (msg.op == ShardMessage::Op::COMMIT) { msg.table_obj->commit_changes(); }
+    else { msg.table_obj->rollback_changes(); }
+    release(msg.table_obj);
+    return true;
+  }
+
+  auto found = m_tables.find(msg.table);
+  if (found == m_tables.end()) {
+    msg.failed = true;
+    msg.value = "Could not find table.";
+    return true;
+  }
+  Table *table = found->second;
+  msg.table_obj = table;
+
+  auto claim = m_claims.find(table);
+  bool newly_claimed = false;
+  if (!msg.in_transaction) {
+    if (claim != m_claims.end()) { return false; }
+  } else if (claim == m_claims.end()) {
+    m_claims[table] = msg.txn;
+    newly_claimed = true;
+  } else if (claim->second != msg.txn) {
+    msg.failed = true;
+    msg.value = "Could not gain access to table.";
+    msg.table_obj = nullptr;
+    return true;
+  }
+
+  std::string_view value;
+  if (msg.op == ShardMessage::Op::SET) {
+    table->set(msg.key, msg.value);
+    if (!msg.in_transaction) { table->commit_changes(); }
+
+    // The shard's thread is the only one using its tables, so it compacts them itself
+    table->compact();
+  } else if (table->find(HashedKey(msg.key), value)) {
+    msg.value = value;
+  } else {
+    msg.failed = true;
+    msg.value = "Could not find key in specified table.";
+    // The connection only rolls back tables its transaction had already used
+    if (newly_claimed) { release(table); }
+    msg.table_obj = nullptr;
+  }
+  return true;
+}
+
+void Shard::release( Table *table )
+{
+  m_claims.erase(table);
+
+  auto waiting = m_waiting.find(table);
+  if (waiting == m_waiting.end()) { return; }
+
+  // Only autocommit operations wait, and they never claim the table again
+  std::deque<ShardMessage *> ready;
+  ready.swap(waiting->second);
+  m_waiting.erase(waiting);
+  for (auto it = ready.begin(); it != ready.end(); it++) {
+    execute(**it);
+    answer(*it);
+  }
+}
+
+void Shard::answer( ShardMessage *msg )
+{
+  if (msg->client == nullptr) { delete msg; }
+  else if (msg->origin == m_index) { m_answers.push_back(msg); }
+  else { send(msg->origin, msg); }
+}
+
+void Shard::send( unsigned dest, ShardMessage *msg )
+{
+  Shard *receiver = m_shards[dest];
+
+  // Messages to a shard stay in order, so nothing overtakes the ones already waiting
+  if (!m_overflow[dest].empty() || !receiver->m_inbound[m_index]->try_push(msg)) {
+    m_overflow[dest].push_back(msg);
+    return;
+  }
+
+  // Pairs with the fence in prepare_to_sleep: either the receiver sees the message, or we see it asleep
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (receiver->m_sleeping.load(std::memory_order_relaxed) && receiver->m_sleeping.exchange(false)) {
+    // Writing to an eventfd only fails if its counter overflows
+    uint64_t one = 1;
+    ssize_t written = write(receiver->m_event_fd, &one, sizeof(one));
+    (void) written;
+  }
+}
+
+bool Shard::take_answers( std::vector<ShardMessage *> &answers )
+{
+  for (unsigned i = 0; i < m_inbound.size(); i++) {
+    if (m_inbound[i] == nullptr) { continue; }
+
+    ShardMessage *msg;
+    while (m_inbound[i]->try_pop(msg)) {
+      // Answers come back to the shard that sent the operation
+      if (msg->origin == m_index) { m_answers.push_back(msg); }
+      else if (execute(*msg)) { answer(msg); }
+      else { m_waiting[msg->table_obj].push_back(msg); }
+    }
+  }
+
+  answers.swap(m_answers);
+  m_answers.clear();
+  return !answers.empty();
+}
+
+bool Shard::flush_overflow()
+{
+  bool left = false;
+
+  for (unsigned dest = 0; dest < m_overflow.size(); dest++) {
+    std::deque<ShardMessage *> pending;
+    pending.swap(m_overflow[dest]);
+    for (auto it = pending.begin(); it != pending.end(); it++) { send(dest, *it); }
+    left = left || !m_overflow[dest].empty();
+  }
+  return left;
+}
+
+bool Shard::prepare_to_sleep()
+{
+  m_sleeping.store(true);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  bool idle = m_answers.empty();
+  for (unsigned i = 0; idle && i < m_inbound.size(); i++) {
+    if (m_inbound[i] != nullptr && !m_inbound[i]->empty()) { idle = false; }
+  }
+
+  if (!idle) { m_sleeping.store(false); }
+  return idle;
+}
+
+void Shard::woke_up()
+{
+  m_sleeping.store(false, std::memory_order_relaxed);
+
+  uint64_t count;
+  while (read(m_event_fd, &count, sizeof(count)) == sizeof(count)) { }
+}
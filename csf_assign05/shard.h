@@ -0,0 +1,136 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "spsc_ring.h"
+
+class ClientConnection; // forward declaration
+class Table; // forward declaration
+
+/* A table operation sent to the shard that owns the table, which sends it back as the answer. */
+struct ShardMessage {
+  enum class Op {
+    CREATE,
+    GET,
+    SET,
+    COMMIT,
+    ROLLBACK,
+  };
+
+  Op op;
+
+  // Connection waiting for the answer (nullptr if none is expected), and the shard serving it
+  ClientConnection *client;
+  unsigned origin;
+
+  // The operation's transaction, if it is part of one
+  bool in_transaction;
+  unsigned long long txn;
+
+  std::string table;
+  std::string key;
+
+  // The value to SET, and in the answer the value found by a GET or the reason for a failure
+  std::string value;
+
+  // Answer: the table that was used (which a transaction must later commit or roll back)
+  Table *table_obj;
+  bool failed;
+};
+
+/*
+ * One core's share of a shared-nothing server. A shard owns the tables whose names
+ * hash to it, and only its own thread ever touches them, so tables are not locked.
+ * Operations on another shard's tables travel there and back over lock-free
+ * single-producer/single-consumer rings, one for each pair of shards.
+ *
+ * A transaction claims each table it uses on the table's shard, and fails if another
+ * transaction has claimed it (like a failed trylock). COMMIT and rollback are sent to
+ * every shard the transaction used, and release its claims. Autocommit operations on
+ * a claimed table wait on its shard until the claim is released.
+ */
+class Shard {
+private:
+  unsigned m_index;
+  std::vector<Shard *> &m_shards;
+
+  std::unordered_map<std::string, Table *> m_tables;
+
+  /* Transactions that have claimed a table, and the operations waiting for them to end. */
+  std::unordered_map<Table *, unsigned long long> m_claims;
+  std::unordered_map<Table *, std::deque<ShardMessage *>> m_waiting;
+
+  /* Messages from every other shard (indexed by the sending shard). */
+  std::vector<SpscRing<ShardMessage *> *> m_inbound;
+
+  /* Messages that did not fit in the receiving shard's ring (indexed by the receiving shard). */
+  std::vector<std::deque<ShardMessage *>> m_overflow;
+
+  /* Answers for this shard's own connections. */
+  std::vector<ShardMessage *> m_answers;
+
+  /* Wakes up the shard's thread. Senders only write to it while the thread is asleep. */
+  int m_event_fd;
+  std::atomic<bool> m_sleeping;
+
+  unsigned long long m_next_txn;
+
+  // copy constructor and assignment operator are prohibited
+  Shard( const Shard & );
+  Shard &operator=( const Shard & );
+
+  /* Runs an operation on a table of this shard. Returns false if it has to wait for a
+  transaction to release the table. */
+  bool execute( ShardMessage &msg );
+
+  /* Releases a transaction's claim on a table, and runs the operations waiting for it. */
+  void release( Table *table );
+
+  /* Hands an executed operation back to the connection that sent it. */
+  void answer( ShardMessage *msg );
+
+  /* Passes a message to another shard's ring, or keeps it until the ring has room. */
+  void send( unsigned dest, ShardMessage *msg );
+
+public:
+  /* Every shard must exist in shards before connect_peers is called. */
+  Shard( unsigned index, std::vector<Shard *> &shards );
+  ~Shard();
+
+  /* Creates the rings from every other shard. */
+  void connect_peers();
+
+  unsigned get_index() const { return m_index; }
+  int get_event_fd() const { return m_event_fd; }
+
+  /* Identifies a new transaction of one of this shard's connections. */
+  unsigned long long new_transaction();
+
+  /* The shard owning a table. */
+  static unsigned owner_of( const std::string &table, size_t num_shards );
+
+  /*
+   * Runs an operation on its table's shard. Returns true if that is this shard and msg
+   * holds the answer already. Otherwise msg is moved away, and the answer arrives later
+   * through take_answers.
+   */
+  bool submit( ShardMessage &msg );
+
+  /* Runs the operations sent by other shards, and collects the answers for this shard's
+  connections (which the caller deletes). Returns false if there were none. */
+  bool take_answers( std::vector<ShardMessage *> &answers );
+
+  /* Retries sending the messages that did not fit in a ring. Returns true if some are left. */
+  bool flush_overflow();
+
+  /* Called before the shard's thread waits for events. Returns false if messages have
+  already arrived, in which case it must not wait. */
+  bool prepare_to_sleep();
+  void woke_up();
+};
+
+#endif // SHARD_H
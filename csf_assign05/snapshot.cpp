@@ -0,0 +1,366 @@
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "csapp.h"
+#include "exceptions.h"
+#include "hashed_key.h"
+#include "table.h"
+#include "table_image.h"
+#include "parallel_restore.h"
+#include "snapshot.h"
+
+namespace {
+  // Snapshots without indexes (and without the number of stripes of each table) can still be loaded
+  const char MAGIC[8] = { 'K', 'V', 'S', 'N', 'A', 'P', '0', '2' };
+  const char UNINDEXED_MAGIC[8] = { 'K', 'V', 'S', 'N', 'A', 'P', '0', '1' };
+
+  // What a block holds
+  const char TABLE_BLOCK = 'T';
+  const char PAIRS_BLOCK = 'P';
+  const char INDEX_BLOCK = 'I';
+  const char END_BLOCK = 'E';
+
+  // An index block's slots start after its kind, padding and stripe
+  const size_t INDEX_SLOTS_POS = 8;
+
+  struct FileHeader {
+    char magic[sizeof(MAGIC)];
+    unsigned long long log_end;
+    unsigned long long checksum;
+  };
+
+  struct BlockHeader {
+    unsigned long long length;
+    unsigned long long checksum;
+  };
+
+  unsigned long long checksum_of( std::string_view bytes ) {
+    return HashedKey::hash_of(bytes);
+  }
+
+  unsigned long long header_checksum( const FileHeader &header ) {
+    return checksum_of(std::string_view(reinterpret_cast<const char *>(&header), offsetof(FileHeader, checksum)));
+  }
+
+  void append_string( std::string &block, std::string_view bytes ) {
+    unsigned len = bytes.size();
+    block.append(reinterpret_cast<const char *>(&len), sizeof(len));
+    block.append(bytes);
+  }
+
+  // Reads a string written by append_string, and advances pos past it
+  bool read_string( std::string_view block, size_t &pos, std::string_view &out ) {
+    unsigned len;
+    if (block.size() - pos < sizeof(len)) { return false; }
+    memcpy(&len, block.data() + pos, sizeof(len));
+    pos += sizeof(len);
+    if (block.size() - pos < len) { return false; }
+    out = std::string_view(block.data() + pos, len);
+    pos += len;
+    return true;
+  }
+
+  void write_all( int fd, const char *data, size_t size ) {
+    size_t written = 0;
+    while (written < size) {
+      ssize_t n = ::write(fd, data + written, size - written);
+      if (n < 0 && errno == EINTR) { continue; }
+      if (n <= 0) { throw CommException("Could not write the snapshot"); }
+      written += n;
+    }
+  }
+
+  // A block is built after room for its header, which is filled in once its length is known
+  void start_block( std::string &block, char kind ) {
+    block.assign(sizeof(BlockHeader), '\0');
+    block += kind;
+  }
+
+  bool sync_directory_of( const std::string &path ) {
+    size_t slash = path.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    bool synced = dir_fd >= 0 && fsync(dir_fd) == 0;
+    if (dir_fd >= 0) { close(dir_fd); }
+    return synced;
+  }
+
+  void write_block( int fd, std::string &block ) {
+    std::string_view body = std::string_view(block).substr(sizeof(BlockHeader));
+    BlockHeader header = { body.size(), checksum_of(body) };
+    memcpy(&block[0], &header, sizeof(header));
+    write_all(fd, block.data(), block.size());
+  }
+}
+
+unsigned long long Snapshot::write( const std::string &path, unsigned long long log_end,
+                                    const std::vector<Table *> &tables )
+{
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) { throw CommException("Could not create the snapshot " + path); }
+
+  unsigned long long num_pairs = 0;
+  try {
+    FileHeader header;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.log_end = log_end;
+    header.checksum = header_checksum(header);
+    write_all(fd, reinterpret_cast<const char *>(&header), sizeof(header));
+    unsigned long long written = sizeof(header);
+
+    std::string block;
+    std::vector<std::pair<size_t, unsigned long long>> placed;
+    for (auto it = tables.begin(); it != tables.end(); it++) {
+      Table *table = *it;
+      unsigned num_stripes = table->get_num_stripes();
+
+      // Each stripe's pairs are a block (the first one also naming the table), followed by their index
+      for (unsigned i = 0; i < num_stripes; i++) {
+        if (i == 0) {
+          start_block(block, TABLE_BLOCK);
+          append_string(block, table->get_name());
+          block.append(reinterpret_cast<const char *>(&num_stripes), sizeof(num_stripes));
+        } else {
+          start_block(block, PAIRS_BLOCK);
+        }
+
+        // The stripe is only locked while its pairs are copied, not while they are written
+        placed.clear();
+        table->lock_stripe(i, true);
+        table->for_each_pair(i, [&block, &placed, written]( std::string_view key, std::string_view value ) {
+          placed.push_back(std::make_pair(HashedKey::hash_of(key), written + block.size()));
+          append_string(block, key);
+          append_string(block, value);
+        });
+        table->unlock_stripe(i);
+
+        if (i == 0 || !placed.empty()) {
+          write_block(fd, block);
+          written += block.size();
+        }
+        if (placed.empty()) { continue; }
+        num_pairs += placed.size();
+
+        size_t capacity = TableImage::index_capacity(placed.size());
+        std::vector<uint64_t> slots(capacity, 0);
+        for (auto pair = placed.begin(); pair != placed.end(); pair++) {
+          size_t slot = pair->first & (capacity - 1);
+          while (slots[slot] != 0) { slot = (slot + 1) & (capacity - 1); }
+          slots[slot] = TableImage::make_entry(pair->first, pair->second);
+        }
+        start_block(block, INDEX_BLOCK);
+        block.append(INDEX_SLOTS_POS - 1 - sizeof(i), '\0');
+        block.append(reinterpret_cast<const char *>(&i), sizeof(i));
+        block.append(reinterpret_cast<const char *>(slots.data()), capacity * sizeof(uint64_t));
+        write_block(fd, block);
+        written += block.size();
+      }
+    }
+
+    unsigned long long num_tables = tables.size();
+    start_block(block, END_BLOCK);
+    block.append(reinterpret_cast<const char *>(&num_tables), sizeof(num_tables));
+    block.append(reinterpret_cast<const char *>(&num_pairs), sizeof(num_pairs));
+    write_block(fd, block);
+
+    if (fsync(fd) != 0) { throw CommException("Could not write the snapshot " + path); }
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+  return num_pairs;
+}
+
+void Snapshot::install( const std::string &tmp_path, const std::string &path )
+{
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) { throw CommException("Could not install the snapshot " + path); }
+
+  // The rename is only durable once the directory holding both names is
+  if (!sync_directory_of(path)) { throw CommException("Could not install the snapshot " + path); }
+}
+
+bool Snapshot::remove( const std::string &path )
+{
+  if (unlink(path.c_str()) != 0) {
+    if (errno == ENOENT) { return false; }
+    throw CommException("Could not remove the snapshot " + path);
+  }
+  if (!sync_directory_of(path)) { throw CommException("Could not remove the snapshot " + path); }
+  return true;
+}
+
+bool Snapshot::load( const std::string &path, const std::function<Table *( const std::string & )> &open_table,
+                     ParallelRestore &restorer, unsigned long long &log_end, unsigned long long &num_pairs )
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0 && errno == ENOENT) { return false; }
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) { throw CommException("Could not read the snapshot " + path); }
+
+  rio_t snapshot_buf;
+  rio_readinitb(&snapshot_buf, fd);
+  FileHeader header;
+  bool valid = rio_readnb(&snapshot_buf, &header, sizeof(header)) == sizeof(header) &&
+               header.checksum == header_checksum(header);
+  bool indexed = valid && memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0;
+  valid = indexed || (valid && memcmp(header.magic, UNINDEXED_MAGIC, sizeof(MAGIC)) == 0);
+
+  unsigned long long num_tables = 0;
+  num_pairs = 0;
+  bool ended = false;
+  Table *table = nullptr;
+  std::string block;
+  while (valid && !ended) {
+    BlockHeader block_header;
+    valid = rio_readnb(&snapshot_buf, &block_header, sizeof(block_header)) == sizeof(block_header) &&
+            block_header.length > 0 && block_header.length <= (unsigned long long) st.st_size;
+    if (!valid) { break; }
+    block.resize(block_header.length);
+    valid = rio_readnb(&snapshot_buf, &block[0], block.size()) == (ssize_t) block.size() &&
+            checksum_of(block) == block_header.checksum;
+    if (!valid) { break; }
+
+    size_t pos = 1;
+    if (block[0] == END_BLOCK) {
+      unsigned long long counts[2];
+      valid = block.size() == 1 + sizeof(counts);
+      if (valid) { memcpy(counts, block.data() + 1, sizeof(counts)); }
+      valid = valid && counts[0] == num_tables && counts[1] == num_pairs;
+      ended = true;
+      break;
+    }
+
+    // The pairs are all restored into the tables' own maps, so the indexes are not needed
+    if (block[0] == INDEX_BLOCK) { continue; }
+
+    if (block[0] == TABLE_BLOCK) {
+      std::string_view name;
+      valid = read_string(block, pos, name);
+      if (indexed) {
+        pos += sizeof(unsigned);
+        valid = valid && pos <= block.size();
+      }
+      table = valid ? open_table(std::string(name)) : nullptr;
+      num_tables++;
+    } else {
+      valid = block[0] == PAIRS_BLOCK;
+    }
+    valid = valid && table != nullptr;
+
+    while (valid && pos < block.size()) {
+      std::string_view key, value;
+      valid = read_string(block, pos, key) && read_string(block, pos, value);
+      if (valid) {
+        restorer.restore(table, HashedKey(key), value);
+        num_pairs++;
+      }
+    }
+  }
+  close(fd);
+
+  if (!valid || !ended) { throw CommException("Corrupt or incomplete snapshot " + path); }
+  log_end = header.log_end;
+  return true;
+}
+
+MappedSnapshot::MappedSnapshot( const char *data, size_t size, unsigned long long log_end )
+  : m_data( data )
+  , m_size( size )
+  , m_log_end( log_end )
+  , m_num_pairs( 0 )
+{
+}
+
+MappedSnapshot::~MappedSnapshot()
+{
+  for (auto it = m_tables.begin(); it != m_tables.end(); it++) { delete *it; }
+  munmap(const_cast<char *>(m_data), m_size);
+}
+
+MappedSnapshot *MappedSnapshot::open( const std::string &path )
+{
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0 && errno == ENOENT) { return nullptr; }
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) { throw CommException("Could not read the snapshot " + path); }
+  if ((size_t) st.st_size < sizeof(FileHeader)) {
+    close(fd);
+    throw CommException("Corrupt or incomplete snapshot " + path);
+  }
+
+  // The mapping outlives the file being replaced by a later snapshot
+  void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) { throw CommException("Could not map the snapshot " + path); }
+  const char *data = static_cast<const char *>(mapped);
+  size_t size = st.st_size;
+
+  FileHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (header.checksum != header_checksum(header) || memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+    munmap(mapped, size);
+    throw CommException("Snapshot " + path + " is corrupt, or has no indexes to be mapped");
+  }
+  MappedSnapshot *snapshot = new MappedSnapshot(data, size, header.log_end);
+
+  // Only the block headers, table names and the end block are read now (and only the end
+  // block's checksum checked); pairs and indexes are paged in by the lookups that need them
+  TableImage *image = nullptr;
+  size_t pos = sizeof(header);
+  bool valid = true, ended = false;
+  unsigned long long num_pairs = 0;
+  while (valid && !ended) {
+    BlockHeader block_header;
+    valid = size - pos >= sizeof(block_header);
+    if (valid) {
+      memcpy(&block_header, data + pos, sizeof(block_header));
+      pos += sizeof(block_header);
+      valid = block_header.length > 0 && block_header.length <= size - pos;
+    }
+    if (!valid) { break; }
+    std::string_view body(data + pos, block_header.length);
+    pos += block_header.length;
+
+    if (body[0] == TABLE_BLOCK) {
+      std::string_view name;
+      unsigned num_stripes = 0;
+      size_t name_pos = 1;
+      valid = read_string(body, name_pos, name) && body.size() - name_pos >= sizeof(num_stripes);
+      if (valid) { memcpy(&num_stripes, body.data() + name_pos, sizeof(num_stripes)); }
+      valid = valid && num_stripes > 0;
+      if (valid) {
+        image = new TableImage(std::string(name), num_stripes, data, size);
+        snapshot->m_tables.push_back(image);
+      }
+    } else if (body[0] == INDEX_BLOCK) {
+      unsigned stripe;
+      size_t capacity = (body.size() - INDEX_SLOTS_POS) / sizeof(uint64_t);
+      valid = image != nullptr && body.size() > INDEX_SLOTS_POS &&
+              (body.size() - INDEX_SLOTS_POS) % sizeof(uint64_t) == 0 && (capacity & (capacity - 1)) == 0;
+      if (valid) { memcpy(&stripe, body.data() + INDEX_SLOTS_POS - sizeof(stripe), sizeof(stripe)); }
+      valid = valid && stripe < image->get_num_stripes();
+      if (valid) { image->set_stripe_index(stripe, body.data() + INDEX_SLOTS_POS, capacity); }
+    } else if (body[0] == END_BLOCK) {
+      unsigned long long counts[2];
+      valid = body.size() == 1 + sizeof(counts) && checksum_of(body) == block_header.checksum;
+      if (valid) { memcpy(counts, body.data() + 1, sizeof(counts)); }
+      valid = valid && counts[0] == snapshot->m_tables.size();
+      num_pairs = valid ? counts[1] : 0;
+      ended = true;
+    } else {
+      valid = body[0] == PAIRS_BLOCK;
+    }
+  }
+
+  if (!valid || !ended) {
+    delete snapshot;
+    throw CommException("Corrupt or incomplete snapshot " + path);
+  }
+  snapshot->m_num_pairs = num_pairs;
+  return snapshot;
+}
@@ -0,0 +1,104 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+class Table;
+class TableImage;
+class ParallelRestore;
+
+/*
+ * Point-in-time snapshots of the committed pairs of every table, from which the server
+ * starts instead of replaying its whole write-ahead log. A snapshot records the offset
+ * in the log where it was taken, and only the records from there on are replayed.
+ *
+ * The file starts with a header (magic, log offset, checksum), followed by blocks, each
+ * framed by its length and a checksum of its bytes like a log record. Every table is a
+ * section with two blocks per stripe: the stripe's pairs, each key and value as a 32-bit
+ * length and the bytes (the first stripe's block also holds the table's name and number of
+ * stripes), and an index of the pairs' offsets, by which a MappedSnapshot finds them. A
+ * last block with the number of tables and pairs ends the file, so a snapshot cut short
+ * is never mistaken for a complete one.
+ */
+namespace Snapshot {
+
+  /*
+   * Writes the committed pairs of tables to a snapshot file at path, and fsyncs it. Each
+   * stripe is copied with only that stripe locked (shared), and written once unlocked, so
+   * clients wait for one stripe at a time at most. Changes committed while the snapshot is
+   * written may or may not be in it: log_end must be an offset the log had reached before
+   * it started, so that replaying the log from there brings every pair up to date.
+   * @return The number of pairs written.
+   * Throws a CommException if the file cannot be written.
+  */
+  unsigned long long write(const std::string &path, unsigned long long log_end, const std::vector<Table *> &tables);
+
+  /*
+   * Moves a snapshot written to tmp_path to path, in place of the previous one, and
+   * fsyncs the directory so that the new one survives a crash.
+   * Throws a CommException if it cannot.
+  */
+  void install(const std::string &tmp_path, const std::string &path);
+
+  /*
+   * Removes the snapshot at path, if there is one, and fsyncs the directory, so that it is
+   * gone for good before the log it was taken from is replaced.
+   * @return false if there was no snapshot.
+   * Throws a CommException if it cannot.
+  */
+  bool remove(const std::string &path);
+
+  /*
+   * Loads the snapshot at path: for every table in it, open_table( name ) returns the
+   * (new, unshared) table its pairs are routed to through restorer, and they are restored
+   * once restorer.finish() returns. Pairs routed afterwards (such as the log's) replace
+   * them. Sets log_end to the log offset replay continues from, and num_pairs to the number
+   * of pairs loaded.
+   * @return false if there is no snapshot at path.
+   * Throws a CommException if the snapshot cannot be read, or is corrupt or incomplete.
+  */
+  bool load(const std::string &path, const std::function<Table *(const std::string &)> &open_table,
+            ParallelRestore &restorer, unsigned long long &log_end, unsigned long long &num_pairs);
+
+};
+
+/*
+ * A snapshot mapped into memory instead of loaded, whose tables serve their committed
+ * pairs from the mapping (see TableImage and Table::set_image), so the server is ready
+ * as soon as the blocks' headers are read, and the page cache decides which pairs stay
+ * in memory. Unlike Snapshot::load, only the header's and the end block's checksums are
+ * checked: checking the others would read the whole file.
+ */
+class MappedSnapshot {
+private:
+  const char *m_data;
+  size_t m_size;
+  unsigned long long m_log_end;
+  unsigned long long m_num_pairs;
+  std::vector<TableImage *> m_tables;
+
+  MappedSnapshot( const char *data, size_t size, unsigned long long log_end );
+
+  // copy constructor and assignment operator are prohibited
+  MappedSnapshot( const MappedSnapshot & );
+  MappedSnapshot &operator=( const MappedSnapshot & );
+
+public:
+  /* Unmaps the snapshot, which no table may use any more. */
+  ~MappedSnapshot();
+
+  /* Maps the snapshot at path. Returns nullptr if there is none. Throws a CommException if
+  it cannot be mapped, is corrupt or incomplete, or was written without indexes. */
+  static MappedSnapshot *open( const std::string &path );
+
+  /* The log offset replay continues from, as for Snapshot::load. */
+  unsigned long long get_log_end() const { return m_log_end; }
+
+  unsigned long long get_num_pairs() const { return m_num_pairs; }
+
+  const std::vector<TableImage *> &get_tables() const { return m_tables; }
+};
+
+#endif // SNAPSHOT_H
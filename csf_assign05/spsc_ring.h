@@ -0,0 +1,65 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+/*
+ * Bounded lock-free ring for exactly one producer thread and one consumer thread.
+ * Each side only writes its own position, so a push or pop is a load of the other
+ * side's position and one release store. The capacity is rounded up to a power of two.
+ */
+template<typename T>
+class SpscRing {
+private:
+  std::vector<T> slots;
+  size_t mask;
+
+  // Producer and consumer positions live on separate cache lines
+  alignas(64) std::atomic<size_t> head;
+  alignas(64) std::atomic<size_t> tail;
+
+  // copy constructor and assignment operator are prohibited
+  SpscRing( const SpscRing & );
+  SpscRing &operator=( const SpscRing & );
+
+public:
+  SpscRing( size_t capacity )
+    : mask( 0 )
+    , head( 0 )
+    , tail( 0 )
+  {
+    size_t size = 1;
+    while (size < capacity) { size *= 2; }
+    slots.resize(size);
+    mask = size - 1;
+  }
+
+  /* Producer only. Returns false if the ring is full. */
+  bool try_push( const T &item ) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    if (pos - head.load(std::memory_order_acquire) == slots.size()) { return false; }
+
+    slots[pos & mask] = item;
+    tail.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /* Consumer only. Returns false if the ring is empty. */
+  bool try_pop( T &item ) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    if (pos == tail.load(std::memory_order_acquire)) { return false; }
+
+    item = slots[pos & mask];
+    head.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /* Either side. The answer may be out of date as soon as it is returned. */
+  bool empty() const {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+  }
+};
+
+#endif // SPSC_RING_H
@@ -3,49 +3,144 @@
 #include "exceptions.h"
 #include "guard.h"
 
-Table::Table( const std::string &name )
-  : m_name( name ), key_value_pairs(), proposed_pairs() {
+Table::Table( const std::string &name, unsigned num_stripes )
+  : m_name( name ), m_version( 0 ), m_num_stripes( num_stripes ), m_stripes( new Stripe[num_stripes] ),
+    m_image( nullptr ) {
 
-    pthread_mutex_init(&mutex, NULL);
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&rwlock, &attr);
+    for (unsigned i = 0; i < m_num_stripes; i++) { pthread_rwlock_init(&m_stripes[i].rwlock, &attr); }
+    pthread_rwlockattr_destroy(&attr);
   }
 
 Table::~Table()
 {
-  pthread_mutex_destroy(&mutex);
+  for (unsigned i = 0; i < m_num_stripes; i++) { pthread_rwlock_destroy(&m_stripes[i].rwlock); }
+  delete[] m_stripes;
+  pthread_rwlock_destroy(&rwlock);
 }
 
 void Table::lock()
 {
-  pthread_mutex_lock(&mutex);
+  // Fails if this thread holds the write lock already. A read lock of its own is not detected.
+  if (pthread_rwlock_wrlock(&rwlock) != 0) { throw OperationException("Could not gain access to table."); }
 }
 
 void Table::unlock()
 {
-  pthread_mutex_unlock(&mutex); 
+  pthread_rwlock_unlock(&rwlock);
+}
+
+void Table::unlock_shared()
+{
+  for (unsigned i = 0; i < m_num_stripes; i++) { pthread_rwlock_unlock(&m_stripes[i].rwlock); }
+  pthread_rwlock_unlock(&rwlock);
 }
 
 bool Table::trylock()
 {
-  return pthread_mutex_trylock(&mutex) == 0;
+  return pthread_rwlock_trywrlock(&rwlock) == 0;
+}
+
+bool Table::trylock_shared()
+{
+  if (pthread_rwlock_tryrdlock(&rwlock) != 0) { return false; }
+
+  // Autocommit SETs only lock the table shared, so a reader also keeps them out of every stripe
+  for (unsigned i = 0; i < m_num_stripes; i++) {
+    if (pthread_rwlock_tryrdlock(&m_stripes[i].rwlock) != 0) {
+      while (i-- > 0) { pthread_rwlock_unlock(&m_stripes[i].rwlock); }
+      pthread_rwlock_unlock(&rwlock);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Table::timedlock( const timespec &deadline )
+{
+  return pthread_rwlock_timedwrlock(&rwlock, &deadline) == 0;
+}
+
+bool Table::try_upgrade()
+{
+  // pthread locks cannot be upgraded in place, so the version shows whether anything
+  // was committed between releasing the shared lock and taking the exclusive one
+  unsigned long version = m_version;
+  unlock_shared();
+  if (!trylock()) { return false; }
+
+  if (m_version != version) {
+    unlock();
+    return false;
+  }
+  return true;
+}
+
+unsigned Table::get_stripe( std::string_view key ) const
+{
+  return get_stripe(HashedKey(key));
+}
+
+unsigned Table::get_stripe( const HashedKey &key ) const
+{
+  // The stripe's maps use the low bits of the hash, so the stripe is picked by the high ones
+  return (key.hash >> 32) % m_num_stripes;
+}
+
+void Table::lock_stripe( unsigned stripe, bool shared )
+{
+  if (pthread_rwlock_rdlock(&rwlock) != 0) { throw OperationException("Could not gain access to table."); }
+
+  pthread_rwlock_t *stripe_lock = &m_stripes[stripe].rwlock;
+  if ((shared ? pthread_rwlock_rdlock(stripe_lock) : pthread_rwlock_wrlock(stripe_lock)) != 0) {
+    pthread_rwlock_unlock(&rwlock);
+    throw OperationException("Could not gain access to table.");
+  }
+}
+
+bool Table::trylock_stripe( unsigned stripe, bool shared )
+{
+  if (pthread_rwlock_tryrdlock(&rwlock) != 0) { return false; }
+
+  pthread_rwlock_t *stripe_lock = &m_stripes[stripe].rwlock;
+  if ((shared ? pthread_rwlock_tryrdlock(stripe_lock) : pthread_rwlock_trywrlock(stripe_lock)) != 0) {
+    pthread_rwlock_unlock(&rwlock);
+    return false;
+  }
+  return true;
+}
+
+void Table::unlock_stripe( unsigned stripe )
+{
+  pthread_rwlock_unlock(&m_stripes[stripe].rwlock);
+  pthread_rwlock_unlock(&rwlock);
 }
 
 void Table::set( const std::string &key, const std::string &value )
 {
-  proposed_pairs[key] = value;
+  set(HashedKey(key), value);
 }
 
-std::string Table::get( const std::string &key )
+void Table::set( const HashedKey &key, const std::string &value )
 {
-  // If the key is in the current table
-  if (key_value_pairs.find(key) != key_value_pairs.end()) {
+  Stripe &stripe = stripe_of(key);
 
-    return key_value_pairs.at(key);
-  } 
-  // If the key is in a proposed entry
-  else if (proposed_pairs.find(key) != proposed_pairs.end()) {
+  // The arena keeps every key and value of the stripe, so replacing a value only releases the old one
+  if (std::string_view *proposed = stripe.proposed_pairs.find(key.key, key.hash)) {
+    stripe.arena.release(*proposed);
+    *proposed = stripe.arena.copy(value);
+  } else {
+    stripe.proposed_pairs.insert(stripe.arena.copy(key.key), key.hash) = stripe.arena.copy(value);
+  }
+}
 
-    return proposed_pairs.at(key);
-  } 
+std::string Table::get( const std::string &key )
+{
+  std::string_view value;
+  if (find(HashedKey(key), value)) { return std::string(value); }
 
   throw OperationException("Key that does not exist requested");
   // Return statement never reached
@@ -54,25 +149,108 @@ std::string Table::get( const std::string &key )
 
 bool Table::has_key( const std::string &key )
 {
-  // If the key is in the commited or proposed entry map
-  if (key_value_pairs.find(key) != key_value_pairs.end() || 
-      proposed_pairs.find(key) != proposed_pairs.end()) {
+  std::string_view value;
+  return find(HashedKey(key), value);
+}
 
-    return true;
-  }
+bool Table::find( const HashedKey &key, std::string_view &value )
+{
+  unsigned stripe_index = get_stripe(key);
+  Stripe &stripe = m_stripes[stripe_index];
 
-  return false;
+  // If the key is in the current table (committed since the image, or in the image)
+  const std::string_view *found = stripe.key_value_pairs.find(key.key, key.hash);
+  if (found == nullptr && m_image != nullptr && m_image->find(key, stripe_index, value)) { return true; }
+
+  // If the key is in a proposed entry (or nowhere)
+  if (found == nullptr) { found = stripe.proposed_pairs.find(key.key, key.hash); }
+  if (found == nullptr) { return false; }
+  value = *found;
+  return true;
 }
 
 void Table::commit_changes()
 {
-  // Add every entry in the map with new or edited table entries to the commited table
-  for (auto it : proposed_pairs) {
-    key_value_pairs[it.first] = it.second;
-  }
+  for (unsigned i = 0; i < m_num_stripes; i++) { commit_stripe(i); }
+}
+
+void Table::commit_stripe( unsigned stripe )
+{
+  m_version++;
+
+  // Add every entry in the map with new or edited table entries to the commited table.
+  // The entries only move between maps: the bytes stay where they are in the arena.
+  Stripe &committed = m_stripes[stripe];
+  committed.proposed_pairs.for_each([&committed]( std::string_view key, std::string_view value ) {
+    size_t hash = HashedKey::hash_of(key);
+    if (std::string_view *old_value = committed.key_value_pairs.find(key, hash)) {
+      committed.arena.release(key);
+      committed.arena.release(*old_value);
+      *old_value = value;
+    } else {
+      committed.key_value_pairs.insert(key, hash) = value;
+    }
+  });
+  committed.proposed_pairs.clear();
 }
 
 void Table::rollback_changes()
 {
-  proposed_pairs.clear();
+  for (unsigned i = 0; i < m_num_stripes; i++) {
+    Stripe &stripe = m_stripes[i];
+    stripe.proposed_pairs.for_each([&stripe]( std::string_view key, std::string_view value ) {
+      stripe.arena.release(key);
+      stripe.arena.release(value);
+    });
+    stripe.proposed_pairs.clear();
+  }
+}
+
+void Table::restore( std::string_view key, std::string_view value )
+{
+  restore(HashedKey(key), value);
+}
+
+void Table::restore( const HashedKey &key, std::string_view value )
+{
+  Stripe &stripe = stripe_of(key);
+  if (std::string_view *old_value = stripe.key_value_pairs.find(key.key, key.hash)) {
+    stripe.arena.release(*old_value);
+    *old_value = stripe.arena.copy(value);
+  } else {
+    stripe.key_value_pairs.insert(stripe.arena.copy(key.key), key.hash) = stripe.arena.copy(value);
+  }
+}
+
+bool Table::compact_stripe( unsigned stripe )
+{
+  Stripe &compacted = m_stripes[stripe];
+  if (compacted.arena.get_released_bytes() < MIN_COMPACTION_BYTES ||
+      compacted.arena.get_released_bytes() < compacted.arena.get_live_bytes()) {
+    return false;
+  }
+
+  // Copy what is still used into a new arena, and let the old one free everything else
+  Arena live;
+  auto copy = [&live]( std::string_view &key, std::string_view &value ) {
+    key = live.copy(key);
+    value = live.copy(value);
+  };
+  compacted.key_value_pairs.for_each(copy);
+  compacted.proposed_pairs.for_each(copy);
+  compacted.arena.swap(live);
+  return true;
+}
+
+unsigned Table::compact()
+{
+  unsigned num_compacted = 0;
+
+  // Busy stripes are left for the next time
+  for (unsigned i = 0; i < m_num_stripes; i++) {
+    if (!trylock_stripe(i, false)) { continue; }
+    if (compact_stripe(i)) { num_compacted++; }
+    unlock_stripe(i);
+  }
+  return num_compacted;
 }
@@ -1,45 +1,165 @@
 #ifndef TABLE_H
 #define TABLE_H
 
-#include <unordered_map>
+#include <atomic>
 #include <string>
+#include <string_view>
 #include <pthread.h>
+#include "flat_map.h"
+#include "arena.h"
+#include "hashed_key.h"
+#include "table_image.h"
 
 class Table {
 private:
+  /*
+   * The keys are spread over stripes by hash, and each stripe has its own maps and lock.
+   * An autocommit operation only locks its key's stripe, so operations on keys of
+   * different stripes do not contend. They also take the table's lock shared, which
+   * keeps them out while a transaction locks the whole table.
+   *
+   * The maps hold views of keys and values whose bytes live in the stripe's arena, so a
+   * SET copies its key and value once, and a commit moves entries without copying them.
+   */
+  struct Stripe {
+    pthread_rwlock_t rwlock;
+
+    /* String keys are mapped to string values. */
+    FlatMap key_value_pairs;
+
+    /* Map of a) proposed new table entries and b) entries with committed keys and proposed new values. */
+    FlatMap proposed_pairs;
+
+    Arena arena;
+  };
+
   std::string m_name;
 
-  pthread_mutex_t mutex;
+  /* Shared by readers, exclusive for writers. Writers are preferred, so a stream of
+  GETs cannot hold off a SET forever. */
+  pthread_rwlock_t rwlock;
+
+  /* Counts commits, so that a reader upgrading its lock notices a writer that slipped in. */
+  std::atomic<unsigned long> m_version;
 
+  unsigned m_num_stripes;
+  Stripe *m_stripes;
 
-  /* String keys are mapped to string values. */
-  std::unordered_map<std::string, std::string> key_value_pairs;
+  /* Committed pairs served from a mapped snapshot, if any. The stripes' maps hold every
+  pair committed since, which replace the image's. */
+  const TableImage *m_image;
 
-  /* Map of a) proposed new table entries and b) entries with committed keys and proposed new values. */
-  std::unordered_map<std::string, std::string> proposed_pairs;
+  Stripe &stripe_of( const HashedKey &key ) { return m_stripes[get_stripe(key)]; }
+
+  /* Compacts a stripe's arena if it is worth it, while the stripe is locked exclusively.
+  Returns true if it did. */
+  bool compact_stripe( unsigned stripe );
 
   // copy constructor and assignment operator are prohibited
   Table( const Table & );
   Table &operator=( const Table & );
 
 public:
-  Table( const std::string &name );
+  // Stripes of a table created without a number of stripes
+  static const unsigned DEFAULT_STRIPES = 64;
+
+  // A stripe's arena is compacted once it has released this many bytes, and more than it still uses
+  static const size_t MIN_COMPACTION_BYTES = 64 * 1024;
+
+  Table( const std::string &name, unsigned num_stripes = DEFAULT_STRIPES );
   ~Table();
 
   std::string get_name() const { return m_name; }
 
+  /* Whole-table locking, as transactions use it. lock and trylock take exclusive access,
+  released by unlock, and trylock_shared shared access, released by unlock_shared. lock
+  throws an OperationException if the calling thread already holds the write lock, but
+  waits like any other caller while a reader holds the table, even if that reader is the
+  calling thread. Threads serving more than one client only use the try forms. */
   void lock();
   void unlock();
+  void unlock_shared();
   bool trylock();
+  bool trylock_shared();
+
+  /* Takes exclusive access like lock, but gives up and returns false once the CLOCK_REALTIME
+  deadline has passed. */
+  bool timedlock( const timespec &deadline );
+
+  /* Trades the caller's shared lock for exclusive access. Fails if another client holds
+  the lock, or changed the table while it was released, and the caller then holds no lock. */
+  bool try_upgrade();
+
+  /* Stripe locking, as autocommit operations use it. A stripe locked exclusively allows
+  set, has_key, get and commit_stripe for its keys, and a shared stripe has_key and get.
+  lock_stripe waits for transactions holding the table, so it is only for threads that
+  serve one client, or none. It throws like lock. */
+  unsigned get_stripe( std::string_view key ) const;
+  unsigned get_stripe( const HashedKey &key ) const;
+  void lock_stripe( unsigned stripe, bool shared );
+  bool trylock_stripe( unsigned stripe, bool shared );
+  void unlock_stripe( unsigned stripe );
 
   // Note: these functions should only be called while the
-  // table's lock is held!
+  // table's lock is held! (Exclusively, except for has_key and get.)
   void set( const std::string &key, const std::string &value );
+  void set( const HashedKey &key, const std::string &value );
   void suggest_set( const std::string &key, const std::string &value );
   bool has_key( const std::string &key );
   std::string get( const std::string &key );
+
+  /* Sets value to the value of key, committed or else proposed, and returns false if there
+  is none. Unlike has_key followed by get, this looks the key up once, with the hash it
+  already has. The view is valid until the key's stripe is unlocked. */
+  bool find( const HashedKey &key, std::string_view &value );
   void commit_changes();
   void rollback_changes();
+
+  /* Commits the changes to one stripe's keys, which is all an autocommit SET changes. */
+  void commit_stripe( unsigned stripe );
+
+  /* Reclaims the bytes of overwritten and rolled back keys and values, in each stripe
+  that has released enough of them and is not locked. Returns the number of stripes
+  compacted. Safe to call from any thread, such as a background compactor. */
+  unsigned compact();
+
+  /* Calls fn( key, value ) for every committed pair, as string_views. */
+  template<typename Fn>
+  void for_each_pair( Fn fn ) const {
+    for (unsigned i = 0; i < m_num_stripes; i++) { for_each_pair(i, fn); }
+  }
+
+  /* The same for the pairs of one stripe, which only needs that stripe locked (shared). */
+  template<typename Fn>
+  void for_each_pair( unsigned stripe, Fn fn ) const {
+    const FlatMap &pairs = m_stripes[stripe].key_value_pairs;
+    pairs.for_each(fn);
+    if (m_image != nullptr) {
+      m_image->for_each_pair(stripe, [&pairs, &fn]( std::string_view key, std::string_view value ) {
+        if (pairs.find(key) == nullptr) { fn(key, value); }
+      });
+    }
+  }
+
+  unsigned get_num_stripes() const { return m_num_stripes; }
+
+  /* Serves the committed pairs of image (which must have as many stripes) as if they had
+  been restored, until they are replaced. Must be called before the table is used. */
+  void set_image( const TableImage *image ) { m_image = image; }
+
+  /* Calls fn( key, value ) for every proposed pair, as string_views, while the table is
+  locked exclusively (to log a transaction's changes before they are committed). */
+  template<typename Fn>
+  void for_each_proposed( Fn fn ) const {
+    for (unsigned i = 0; i < m_num_stripes; i++) {
+      const FlatMap &pairs = m_stripes[i].proposed_pairs;
+      pairs.for_each(fn);
+    }
+  }
+
+  /* Adds a committed pair directly, when a table is restored from another server or from disk. */
+  void restore( std::string_view key, std::string_view value );
+  void restore( const HashedKey &key, std::string_view value );
 };
 
 #endif // TABLE_H
@@ -0,0 +1,103 @@
+#include "table_directory.h"
+
+namespace {
+  // Slots of a new directory
+  const size_t MIN_CAPACITY = 16;
+}
+
+TableDirectory::TableDirectory()
+  : m_slots( allocate_slots( MIN_CAPACITY ) )
+  , m_size( 0 )
+{
+  pthread_mutex_init(&m_mutex, nullptr);
+}
+
+TableDirectory::~TableDirectory()
+{
+  // Every entry is in the current array, and the retired ones only point to some of them
+  Slots *slots = m_slots.load();
+  for (size_t i = 0; i < slots->capacity; i++) { delete slots->entries[i].load(); }
+
+  m_retired.push_back(slots);
+  for (auto it = m_retired.begin(); it != m_retired.end(); it++) {
+    delete[] (*it)->entries;
+    delete *it;
+  }
+  pthread_mutex_destroy(&m_mutex);
+}
+
+TableDirectory::Slots *TableDirectory::allocate_slots( size_t capacity )
+{
+  Slots *slots = new Slots;
+  slots->capacity = capacity;
+  slots->entries = new std::atomic<const Entry *>[capacity];
+  for (size_t i = 0; i < capacity; i++) { slots->entries[i].store(nullptr, std::memory_order_relaxed); }
+  return slots;
+}
+
+void TableDirectory::place( Slots *slots, const Entry *entry )
+{
+  size_t mask = slots->capacity - 1;
+  size_t index = entry->hash & mask;
+  while (slots->entries[index].load(std::memory_order_relaxed) != nullptr) { index = (index + 1) & mask; }
+
+  // Release, so that a reader seeing the pointer also sees the entry it points to
+  slots->entries[index].store(entry, std::memory_order_release);
+}
+
+Table *TableDirectory::find( const HashedKey &name ) const
+{
+  const Slots *slots = m_slots.load(std::memory_order_acquire);
+  size_t mask = slots->capacity - 1;
+
+  for (size_t index = name.hash & mask; ; index = (index + 1) & mask) {
+    const Entry *entry = slots->entries[index].load(std::memory_order_acquire);
+    if (entry == nullptr) { return nullptr; }
+    if (entry->hash == name.hash && entry->name == name.key) { return entry->table; }
+  }
+}
+
+bool TableDirectory::insert( const std::string &name, Table *table )
+{
+  pthread_mutex_lock(&m_mutex);
+  bool inserted = insert_locked(name, table);
+  pthread_mutex_unlock(&m_mutex);
+  return inserted;
+}
+
+bool TableDirectory::insert_locked( const std::string &name, Table *table )
+{
+  if (find(HashedKey(name)) != nullptr) { return false; }
+
+  // Readers keep using the old array until the new one, with every entry in it, is published
+  Slots *slots = m_slots.load(std::memory_order_relaxed);
+  if ((m_size.load(std::memory_order_relaxed) + 1) * 2 > slots->capacity) {
+    Slots *grown = allocate_slots(slots->capacity * 2);
+    for (size_t i = 0; i < slots->capacity; i++) {
+      const Entry *entry = slots->entries[i].load(std::memory_order_relaxed);
+      if (entry != nullptr) { place(grown, entry); }
+    }
+    m_slots.store(grown, std::memory_order_release);
+    m_retired.push_back(slots);
+    slots = grown;
+  }
+
+  place(slots, new Entry{ name, HashedKey::hash_of(name), table });
+  m_size.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void TableDirectory::lock()
+{
+  pthread_mutex_lock(&m_mutex);
+}
+
+bool TableDirectory::timedlock( const timespec &deadline )
+{
+  return pthread_mutex_timedlock(&m_mutex, &deadline) == 0;
+}
+
+void TableDirectory::unlock()
+{
+  pthread_mutex_unlock(&m_mutex);
+}
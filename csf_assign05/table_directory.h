@@ -0,0 +1,89 @@
+#ifndef TABLE_DIRECTORY_H
+#define TABLE_DIRECTORY_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "hashed_key.h"
+
+class Table;
+
+/*
+ * The server's map from table names to tables, for a workload that looks tables up on
+ * every request and creates them rarely. Lookups take no lock: they probe an array of
+ * pointers to entries that never change once published, so they finish in a bounded
+ * number of steps whatever the writers do. Inserts are serialized by the directory's
+ * own mutex, which nothing else waits on.
+ *
+ * Entries are only ever added. When the array fills up, a twice as large one is
+ * published, and the old one is kept until the directory is destroyed, because a reader
+ * may still be probing it. The arrays kept that way add up to less than the current one.
+ */
+class TableDirectory {
+private:
+  struct Entry {
+    std::string name;
+    size_t hash;
+    Table *table;
+  };
+
+  /* Open-addressing array, at most half full, so probes end at an empty slot soon. */
+  struct Slots {
+    size_t capacity;
+    std::atomic<const Entry *> *entries;
+  };
+
+  std::atomic<Slots *> m_slots;
+
+  /* Arrays replaced by larger ones. */
+  std::vector<Slots *> m_retired;
+
+  std::atomic<size_t> m_size;
+
+  pthread_mutex_t m_mutex;
+
+  // copy constructor and assignment operator are prohibited
+  TableDirectory( const TableDirectory & );
+  TableDirectory &operator=( const TableDirectory & );
+
+  static Slots *allocate_slots( size_t capacity );
+
+  /* Stores entry in the first empty slot of its probe sequence. */
+  static void place( Slots *slots, const Entry *entry );
+
+public:
+  TableDirectory();
+  ~TableDirectory();
+
+  /* The table called name, or nullptr. Safe to call from any thread at any time. */
+  Table *find( const HashedKey &name ) const;
+
+  /* Adds table under name, unless a table has that name already, in which case nothing
+  changes and false is returned. The directory does not own the table. */
+  bool insert( const std::string &name, Table *table );
+
+  /* The same, for a caller that holds the directory locked. */
+  bool insert_locked( const std::string &name, Table *table );
+
+  size_t size() const { return m_size.load(std::memory_order_relaxed); }
+
+  /* Holds off inserts, so that the set of tables stays the same until unlock. timedlock
+  gives up and returns false once the CLOCK_REALTIME deadline has passed. */
+  void lock();
+  bool timedlock( const timespec &deadline );
+  void unlock();
+
+  /* Calls fn( name, table ) for every table. Tables inserted while it runs may be left
+  out, unless the directory is locked. */
+  template<typename Fn>
+  void for_each( Fn fn ) const {
+    const Slots *slots = m_slots.load(std::memory_order_acquire);
+    for (size_t i = 0; i < slots->capacity; i++) {
+      const Entry *entry = slots->entries[i].load(std::memory_order_acquire);
+      if (entry != nullptr) { fn(entry->name, entry->table); }
+    }
+  }
+};
+
+#endif // TABLE_DIRECTORY_H
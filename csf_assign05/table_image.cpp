@@ -0,0 +1,43 @@
+#include "table_image.h"
+
+TableImage::TableImage( const std::string &name, unsigned num_stripes, const char *data, size_t size )
+  : m_name( name )
+  , m_data( data )
+  , m_size( size )
+  , m_stripes( num_stripes, StripeIndex{ nullptr, 0 } )
+{
+}
+
+void TableImage::set_stripe_index( unsigned stripe, const char *slots, size_t capacity )
+{
+  m_stripes[stripe] = StripeIndex{ slots, capacity };
+}
+
+bool TableImage::find( const HashedKey &key, unsigned stripe, std::string_view &value ) const
+{
+  const StripeIndex &index = m_stripes[stripe];
+  if (index.capacity == 0) { return false; }
+
+  // Same probe sequence as the writer's: linear, from the low bits of the hash
+  uint64_t tag = make_entry(key.hash, 0);
+  uint64_t offset_mask = (uint64_t(1) << TAG_SHIFT) - 1;
+  size_t mask = index.capacity - 1;
+  size_t slot = key.hash & mask;
+  for (size_t probes = 0; probes < index.capacity; probes++, slot = (slot + 1) & mask) {
+    uint64_t entry = slot_at(index, slot);
+    if (entry == 0) { return false; }
+    if ((entry & ~offset_mask) != tag) { continue; }
+
+    std::string_view found_key;
+    if (read_pair(entry & offset_mask, found_key, value) && found_key == key.key) { return true; }
+  }
+  return false;
+}
+
+size_t TableImage::index_capacity( size_t num_pairs )
+{
+  // At most three quarters full, so that probes for missing keys stay short
+  size_t capacity = 2;
+  while (capacity * 3 < num_pairs * 4) { capacity *= 2; }
+  return capacity;
+}
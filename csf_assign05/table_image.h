@@ -0,0 +1,96 @@
+#ifndef TABLE_IMAGE_H
+#define TABLE_IMAGE_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "hashed_key.h"
+
+/*
+ * Read-only view of one table's committed pairs in a snapshot mapped into memory (see
+ * MappedSnapshot), which a Table serves GETs from without loading the pairs. Nothing is
+ * read at startup beyond the block headers: the pages holding an index or a pair are
+ * faulted in by the first lookup that touches them, and then stay in the page cache.
+ *
+ * The snapshot has one open-addressing index per stripe. Each slot is 0 if empty, or the
+ * offset in the file of a pair (its key's length, the key, the value's length and the
+ * value), with the top 16 bits of the key's hash above it, so that most probes that do
+ * not match are answered without touching the pair. Offsets found in the file are
+ * checked against its size, so a damaged index cannot make a lookup read outside it.
+ */
+class TableImage {
+private:
+  struct StripeIndex {
+    const char *slots;
+    size_t capacity;
+  };
+
+  std::string m_name;
+  const char *m_data;
+  size_t m_size;
+  std::vector<StripeIndex> m_stripes;
+
+  // copy constructor and assignment operator are prohibited
+  TableImage( const TableImage & );
+  TableImage &operator=( const TableImage & );
+
+  static const unsigned TAG_SHIFT = 48;
+
+  /* Reads the pair at offset. Returns false if it does not fit in the file. */
+  bool read_pair( uint64_t offset, std::string_view &key, std::string_view &value ) const {
+    uint32_t key_len, value_len;
+    if (offset >= m_size || m_size - offset < sizeof(key_len)) { return false; }
+    memcpy(&key_len, m_data + offset, sizeof(key_len));
+    offset += sizeof(key_len);
+    if (m_size - offset < key_len + (uint64_t) sizeof(value_len)) { return false; }
+    key = std::string_view(m_data + offset, key_len);
+    offset += key_len;
+    memcpy(&value_len, m_data + offset, sizeof(value_len));
+    offset += sizeof(value_len);
+    if (m_size - offset < value_len) { return false; }
+    value = std::string_view(m_data + offset, value_len);
+    return true;
+  }
+
+  uint64_t slot_at( const StripeIndex &index, size_t slot ) const {
+    uint64_t entry;
+    memcpy(&entry, index.slots + slot * sizeof(entry), sizeof(entry));
+    return entry;
+  }
+
+public:
+  /* An image with no pairs yet, of the num_stripes stripes of the table called name, in
+  the size bytes of a mapped snapshot at data. */
+  TableImage( const std::string &name, unsigned num_stripes, const char *data, size_t size );
+
+  /* Points stripe at its index, capacity slots (a power of two) starting at slots. */
+  void set_stripe_index( unsigned stripe, const char *slots, size_t capacity );
+
+  std::string get_name() const { return m_name; }
+  unsigned get_num_stripes() const { return m_stripes.size(); }
+
+  /* Finds key, which belongs to stripe, and sets value to a view into the mapping. */
+  bool find( const HashedKey &key, unsigned stripe, std::string_view &value ) const;
+
+  /* Calls fn( key, value ) for every pair of stripe, as views into the mapping. */
+  template<typename Fn>
+  void for_each_pair( unsigned stripe, Fn fn ) const {
+    const StripeIndex &index = m_stripes[stripe];
+    for (size_t slot = 0; slot < index.capacity; slot++) {
+      uint64_t entry = slot_at(index, slot);
+      std::string_view key, value;
+      if (entry != 0 && read_pair(entry & ((uint64_t(1) << TAG_SHIFT) - 1), key, value)) { fn(key, value); }
+    }
+  }
+
+  /* For the snapshot writer: the slots an index of num_pairs pairs has, and the slot
+  entry of a pair at offset whose key hashes to hash. */
+  static size_t index_capacity( size_t num_pairs );
+  static uint64_t make_entry( size_t hash, uint64_t offset ) {
+    return (uint64_t(hash) >> TAG_SHIFT << TAG_SHIFT) | offset;
+  }
+};
+
+#endif // TABLE_IMAGE_H
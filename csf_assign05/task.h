@@ -0,0 +1,105 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+/*
+ * A C++20 coroutine that returns nothing. A Task only starts running when it is
+ * awaited or passed to Task::run. Awaiting a Task runs it until it finishes, suspending
+ * the awaiting coroutine in between, so coroutines can be nested like function calls.
+ * The Task object owns the coroutine's frame.
+ *
+ * Control passes between nested Tasks through Task::run rather than by symmetric
+ * transfer, which GCC only turns into a tail call when optimizing: without it, every
+ * switch would grow the stack until a long session overflowed it.
+ */
+class Task {
+public:
+  struct promise_type {
+    // Coroutine awaiting this one, resumed once it finishes
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+
+    /* Hands control back to the awaiting coroutine, if any. */
+    struct FinalAwaiter {
+      bool await_ready() noexcept { return false; }
+      void await_suspend( std::coroutine_handle<promise_type> finished ) noexcept {
+        scheduled() = finished.promise().continuation;
+      }
+      void await_resume() noexcept { }
+    };
+
+    Task get_return_object() { return Task( std::coroutine_handle<promise_type>::from_promise( *this ) ); }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void return_void() { }
+    void unhandled_exception() { exception = std::current_exception(); }
+  };
+
+private:
+  std::coroutine_handle<promise_type> m_handle;
+
+  explicit Task( std::coroutine_handle<promise_type> handle )
+    : m_handle( handle )
+  { }
+
+  /* The coroutine Task::run resumes next on this thread. */
+  static std::coroutine_handle<> &scheduled() {
+    static thread_local std::coroutine_handle<> next;
+    return next;
+  }
+
+  // copy constructor and assignment operator are prohibited
+  Task( const Task & );
+  Task &operator=( const Task & );
+
+public:
+  Task()
+    : m_handle( nullptr )
+  { }
+
+  Task( Task &&other ) noexcept
+    : m_handle( std::exchange( other.m_handle, nullptr ) )
+  { }
+
+  Task &operator=( Task &&other ) noexcept {
+    if (this != &other) {
+      if (m_handle) { m_handle.destroy(); }
+      m_handle = std::exchange( other.m_handle, nullptr );
+    }
+    return *this;
+  }
+
+  ~Task() {
+    if (m_handle) { m_handle.destroy(); }
+  }
+
+  /* The point at which the Task starts running. */
+  std::coroutine_handle<> handle() const { return m_handle; }
+
+  bool done() const { return !m_handle || m_handle.done(); }
+
+  /* Resumes a suspended coroutine, and whatever it hands control to, until one of them
+  suspends without doing so (or the outermost Task finishes). */
+  static void run( std::coroutine_handle<> start ) {
+    scheduled() = start;
+    while (scheduled()) {
+      std::coroutine_handle<> next = std::exchange( scheduled(), nullptr );
+      next.resume();
+    }
+  }
+
+  // Awaiting a Task suspends the awaiting coroutine, and lets Task::run start this one
+  bool await_ready() const noexcept { return false; }
+  void await_suspend( std::coroutine_handle<> awaiting ) noexcept {
+    m_handle.promise().continuation = awaiting;
+    scheduled() = m_handle;
+  }
+  void await_resume() {
+    if (m_handle.promise().exception) { std::rethrow_exception( m_handle.promise().exception ); }
+  }
+};
+
+#endif // TASK_H
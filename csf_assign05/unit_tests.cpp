@@ -2,11 +2,29 @@
 
 #include "message.h"
 #include "message_serialization.h"
+#include "message_view.h"
 #include "table.h"
 #include "value_stack.h"
+#include "output_buffer.h"
+#include "spsc_ring.h"
+#include "flat_map.h"
+#include "arena.h"
+#include "table_directory.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "parallel_restore.h"
 #include "exceptions.h"
 #include "tctest.h"
 #include "iostream"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <new>
+#include <cstdlib>
+#include <unistd.h>
 
 struct TestObjs
 {
@@ -101,13 +119,28 @@ void test_message_serialization_encode_long( TestObjs *objs );
 void test_message_serialization_encode_too_long( TestObjs *objs );
 void test_message_serialization_decode( TestObjs *objs );
 void test_message_serialization_decode_invalid( TestObjs *objs );
+void test_message_serialization_decode_view( TestObjs *objs );
 void test_table_has_key( TestObjs *objs );
 void test_table_get( TestObjs *objs );
 void test_table_commit_changes( TestObjs *objs );
 void test_table_rollback_changes( TestObjs *objs );
 void test_table_commit_and_rollback( TestObjs *objs );
+void test_table_shared_lock( TestObjs *objs );
+void test_table_stripes( TestObjs *objs );
+void test_table_find_hashed( TestObjs *objs );
 void test_value_stack( TestObjs *objs );
 void test_value_stack_exceptions( TestObjs *objs );
+void test_output_buffer_format( TestObjs *objs );
+void test_output_buffer_no_allocation( TestObjs *objs );
+void test_spsc_ring( TestObjs *objs );
+void test_flat_map( TestObjs *objs );
+void test_table_compact( TestObjs *objs );
+void test_table_directory_concurrent( TestObjs *objs );
+void test_wal_recover( TestObjs *objs );
+void test_wal_rewrite( TestObjs *objs );
+void test_snapshot( TestObjs *objs );
+void test_parallel_restore( TestObjs *objs );
+void test_mapped_snapshot( TestObjs *objs );
 
 int main(int argc, char **argv)
 {
@@ -129,13 +162,28 @@ int main(int argc, char **argv)
   TEST( test_message_serialization_encode_too_long );
   TEST( test_message_serialization_decode );
   TEST( test_message_serialization_decode_invalid );
+  TEST( test_message_serialization_decode_view );
   TEST( test_table_has_key );
   TEST( test_table_get );
   TEST( test_table_commit_changes );
   TEST( test_table_rollback_changes );
   TEST( test_table_commit_and_rollback );
+  TEST( test_table_shared_lock );
+  TEST( test_table_stripes );
+  TEST( test_table_find_hashed );
   TEST( test_value_stack );
   TEST( test_value_stack_exceptions );
+  TEST( test_output_buffer_format );
+  TEST( test_output_buffer_no_allocation );
+  TEST( test_spsc_ring );
+  TEST( test_flat_map );
+  TEST( test_table_compact );
+  TEST( test_table_directory_concurrent );
+  TEST( test_wal_recover );
+  TEST( test_wal_rewrite );
+  TEST( test_snapshot );
+  TEST( test_parallel_restore );
+  TEST( test_mapped_snapshot );
 
   TEST_FINI();
 }
@@ -319,6 +367,12 @@ void test_message_serialization_encode( TestObjs *objs )
 
   MessageSerialization::encode( objs->data_resp, s );
   ASSERT( "DATA 10012\n" == s );
+
+  MessageSerialization::encode( objs->failed_resp, s );
+  ASSERT( "FAILED \"The operation failed\"\n" == s );
+
+  MessageSerialization::encode( objs->error_resp, s );
+  ASSERT( "ERROR \"An error occurred\"\n" == s );
 }
 
 void test_message_serialization_encode_long( TestObjs *objs )
@@ -399,6 +453,44 @@ void test_message_serialization_decode_invalid( TestObjs *objs )
   }
 }
 
+void test_message_serialization_decode_view( TestObjs *objs )
+{
+  MessageView view;
+
+  // Arguments point into the encoded message instead of being copied
+  MessageSerialization::decode_view( objs->encoded_get_req, view );
+  ASSERT( MessageType::GET == view.get_message_type() );
+  ASSERT( 2 == view.get_num_args() );
+  ASSERT( "lineitems" == view.get_table() );
+  ASSERT( "foobar" == view.get_key() );
+  ASSERT( objs->encoded_get_req.data() < view.get_table().data() );
+  ASSERT( view.get_key().data() < objs->encoded_get_req.data() + objs->encoded_get_req.size() );
+
+  MessageSerialization::decode_view( objs->encoded_error_resp, view );
+  ASSERT( MessageType::ERROR == view.get_message_type() );
+  ASSERT( "Wow, something really got messed up" == view.get_quoted_text() );
+
+  // A line may be decoded out of a larger buffer
+  std::string batch = "PUSH 1\nGET t k\n";
+  MessageSerialization::decode_view( std::string_view( batch ).substr( 7 ), view );
+  ASSERT( MessageType::GET == view.get_message_type() );
+  ASSERT( "k" == view.get_key() );
+
+  try {
+    MessageSerialization::decode_view( "GET t k extra\n", view );
+    FAIL( "decode_view accepted a request with too many arguments" );
+  } catch ( InvalidMessage &ex ) {
+    // good
+  }
+
+  try {
+    MessageSerialization::decode_view( "", view );
+    FAIL( "decode_view accepted an empty message" );
+  } catch ( InvalidMessage &ex ) {
+    // good
+  }
+}
+
 void test_table_has_key( TestObjs *objs )
 {
   {
@@ -570,6 +662,79 @@ void test_table_commit_and_rollback( TestObjs *objs )
   }
 }
 
+void test_table_shared_lock( TestObjs *objs )
+{
+  // Readers share the lock, and keep writers out
+  ASSERT( objs->invoices->trylock_shared() );
+  ASSERT( objs->invoices->trylock_shared() );
+  ASSERT( !objs->invoices->trylock() );
+
+  // A reader cannot upgrade while another reader holds the lock, and loses its own.
+  // The last reader can.
+  ASSERT( !objs->invoices->try_upgrade() );
+  ASSERT( objs->invoices->try_upgrade() );
+  ASSERT( !objs->invoices->trylock_shared() );
+  objs->invoices->unlock();
+}
+
+void test_table_stripes( TestObjs *objs )
+{
+  Table *table = objs->invoices;
+  unsigned first = table->get_stripe( "abc123" );
+  std::string other_key = "xyz456";
+  while (table->get_stripe( other_key ) == first) { other_key += "6"; }
+  unsigned other = table->get_stripe( other_key );
+
+  // Writers of different stripes do not contend, and keep out whole-table locks
+  ASSERT( table->trylock_stripe( first, false ) );
+  ASSERT( table->trylock_stripe( other, false ) );
+  ASSERT( !table->trylock_stripe( first, true ) );
+  ASSERT( !table->trylock() );
+  ASSERT( !table->trylock_shared() );
+
+  table->set( "abc123", "1000" );
+  table->commit_stripe( first );
+  table->unlock_stripe( first );
+  table->unlock_stripe( other );
+
+  // A transaction reading the table keeps writers out of every stripe, but not readers
+  ASSERT( table->trylock_shared() );
+  ASSERT( !table->trylock_stripe( other, false ) );
+  ASSERT( table->trylock_stripe( first, true ) );
+  ASSERT( "1000" == table->get( "abc123" ) );
+  table->unlock_stripe( first );
+  table->unlock_shared();
+}
+
+void test_table_find_hashed( TestObjs *objs )
+{
+  // Decoding a GET hashes its table and key the way the table does
+  MessageView view;
+  MessageSerialization::decode_view( "GET invoices abc123\n", view );
+  HashedKey key = view.get_hashed_key();
+  ASSERT( HashedKey::hash_of( "abc123" ) == key.hash );
+  ASSERT( HashedKey::hash_of( "invoices" ) == view.get_hashed_table().hash );
+
+  Table *table = objs->invoices;
+  ASSERT( table->get_stripe( "abc123" ) == table->get_stripe( key ) );
+  std::string_view value;
+  ASSERT( !table->find( key, value ) );
+
+  // A proposed value is found, then the committed one
+  table->lock();
+  table->set( key, "1000" );
+  ASSERT( table->find( key, value ) );
+  ASSERT( "1000" == value );
+  table->commit_changes();
+  table->set( HashedKey( "xyz456" ), "2000" );
+  table->rollback_changes();
+  table->unlock();
+  ASSERT( table->find( key, value ) );
+  ASSERT( "1000" == value );
+  ASSERT( "1000" == table->get( "abc123" ) );
+  ASSERT( !table->find( HashedKey( "xyz456" ), value ) );
+}
+
 void test_value_stack( TestObjs *objs )
 {
   // stack should be empty initially
@@ -615,3 +780,522 @@ void test_value_stack_exceptions( TestObjs *objs )
     // good
   }
 }
+
+void test_output_buffer_format( TestObjs * )
+{
+  OutputBuffer out;
+  ASSERT( out.empty() );
+
+  out.append_ok();
+  out.append_data( "10012" );
+  out.append_failure( MessageType::FAILED, "The operation failed" );
+  out.append_failure( MessageType::ERROR, "An error occurred" );
+  out.append( OutputBuffer::FixedResponse::NOT_LOGGED_IN );
+  ASSERT( 5 == out.get_num_responses() );
+
+  std::string expected = "OK\nDATA 10012\nFAILED \"The operation failed\"\n"
+                         "ERROR \"An error occurred\"\nERROR \"Please log in first.\"\n";
+  ASSERT( expected == std::string( out.data(), out.size() ) );
+
+  // Every formatted response decodes back to the message it stands for
+  Message msg;
+  MessageSerialization::decode( "FAILED \"The operation failed\"\n", msg );
+  ASSERT( "The operation failed" == msg.get_quoted_text() );
+
+  // Responses written without a buffer end the connection with an ERROR
+  MessageSerialization::decode( std::string( OutputBuffer::fixed_encoding( OutputBuffer::FixedResponse::TIMED_OUT ) ), msg );
+  ASSERT( MessageType::ERROR == msg.get_message_type() );
+  MessageSerialization::decode( std::string( OutputBuffer::fixed_encoding( OutputBuffer::FixedResponse::TOO_MANY_CLIENTS ) ), msg );
+  ASSERT( MessageType::ERROR == msg.get_message_type() );
+
+  // Partially written output keeps the rest
+  out.consume( 3 );
+  ASSERT( expected.substr( 3 ) == std::string( out.data(), out.size() ) );
+
+  std::string taken;
+  out.take( taken );
+  ASSERT( expected.substr( 3 ) == taken );
+  ASSERT( out.empty() );
+  ASSERT( 0 == out.get_num_responses() );
+}
+
+namespace {
+  // Counts calls to the global allocation functions below while set
+  bool count_allocations = false;
+  long num_allocations = 0;
+
+  void *counted_malloc( size_t size )
+  {
+    if ( count_allocations ) { num_allocations++; }
+    void *p = malloc( size ? size : 1 );
+    if ( p == nullptr ) { throw std::bad_alloc(); }
+    return p;
+  }
+}
+
+void *operator new( size_t size ) { return counted_malloc( size ); }
+void *operator new[]( size_t size ) { return counted_malloc( size ); }
+
+// The replacements are a matched set on malloc and free. GCC cannot tell once it inlines a
+// delete into code that allocated with a new expression, and warns from -O1 on.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete( void *p ) noexcept { free( p ); }
+void operator delete[]( void *p ) noexcept { free( p ); }
+void operator delete( void *p, size_t ) noexcept { free( p ); }
+void operator delete[]( void *p, size_t ) noexcept { free( p ); }
+#pragma GCC diagnostic pop
+
+void test_output_buffer_no_allocation( TestObjs * )
+{
+  OutputBuffer out;
+
+  // Grow the buffer to the size of a batch once
+  for ( int i = 0; i < 64; i++ ) { out.append_ok(); }
+  out.append( OutputBuffer::FixedResponse::NOT_LOGGED_IN );
+  out.clear();
+  size_t capacity = out.capacity();
+  const char *storage = out.data();
+
+  // Later batches of the same size allocate nothing, not even temporarily, and keep the storage
+  count_allocations = true;
+  num_allocations = 0;
+  for ( int batch = 0; batch < 1000; batch++ ) {
+    for ( int i = 0; i < 64; i++ ) { out.append_ok(); }
+    out.append( OutputBuffer::FixedResponse::NOT_LOGGED_IN );
+    out.consume( out.size() );
+  }
+  count_allocations = false;
+
+  ASSERT( 0 == num_allocations );
+  ASSERT( capacity == out.capacity() );
+  ASSERT( storage == out.data() );
+}
+
+void test_spsc_ring( TestObjs * )
+{
+  // The capacity is rounded up to 4
+  SpscRing<int> ring( 3 );
+  int item = -1;
+
+  ASSERT( ring.empty() );
+  ASSERT( !ring.try_pop( item ) );
+
+  // Wrap around the end of the ring several times, keeping the order
+  for ( int round = 0; round < 3; round++ ) {
+    for ( int i = 0; i < 4; i++ ) { ASSERT( ring.try_push( round * 10 + i ) ); }
+    ASSERT( !ring.try_push( 99 ) );
+    ASSERT( !ring.empty() );
+
+    for ( int i = 0; i < 4; i++ ) {
+      ASSERT( ring.try_pop( item ) );
+      ASSERT( round * 10 + i == item );
+    }
+    ASSERT( ring.empty() );
+  }
+}
+
+void test_flat_map( TestObjs * )
+{
+  // The map only holds views, so the arena keeps the bytes
+  Arena arena;
+  FlatMap map;
+  ASSERT( map.empty() );
+  ASSERT( nullptr == map.find( "missing" ) );
+
+  // Enough keys to grow the map several times. Right after each growth, while entries
+  // are still being moved, every key must be found in the old or the new slots.
+  int migrations = 0;
+  for ( int i = 0; i < 1000; i++ ) {
+    std::string key = "key" + std::to_string( i );
+    bool was_migrating = map.is_migrating();
+    map.insert( arena.copy( key ) ) = arena.copy( std::to_string( i ) );
+    if ( was_migrating || !map.is_migrating() ) { continue; }
+
+    migrations++;
+    for ( int j = 0; j <= i; j++ ) {
+      ASSERT( map.find( "key" + std::to_string( j ) ) != nullptr );
+    }
+    size_t count = 0;
+    map.for_each( [&count]( std::string_view, std::string_view ) { count++; } );
+    ASSERT( size_t( i + 1 ) == count );
+  }
+  ASSERT( migrations >= 3 );
+  std::string long_key( 100, 'k' );
+  map.insert( arena.copy( long_key ) ) = arena.copy( std::string( 100, 'v' ) );
+  ASSERT( 1001 == map.size() );
+
+  for ( int i = 0; i < 1000; i++ ) {
+    const std::string_view *value = map.find( "key" + std::to_string( i ) );
+    ASSERT( value != nullptr );
+    ASSERT( std::to_string( i ) == *value );
+  }
+  ASSERT( std::string( 100, 'v' ) == *map.find( long_key ) );
+  ASSERT( nullptr == map.find( "key1000" ) );
+
+  // Replacing a value through find
+  *map.find( "key7" ) = "seven";
+  ASSERT( "seven" == *map.find( "key7" ) );
+  ASSERT( 1001 == map.size() );
+
+  size_t visited = 0;
+  map.for_each( [&visited]( std::string_view, std::string_view ) { visited++; } );
+  ASSERT( 1001 == visited );
+
+  map.clear();
+  ASSERT( map.empty() );
+  ASSERT( nullptr == map.find( "key7" ) );
+  map.insert( "key7" ) = "7";
+  ASSERT( "7" == *map.find( "key7" ) );
+
+  // A small map keeps its slots when cleared
+  map.clear();
+  ASSERT( nullptr == map.find( "key7" ) );
+  map.insert( "key8" ) = "8";
+  ASSERT( "8" == *map.find( "key8" ) );
+  ASSERT( 1 == map.size() );
+}
+
+void test_table_compact( TestObjs *objs )
+{
+  Table *table = objs->invoices;
+  std::string value( 1000, 'a' );
+
+  // Overwriting values releases their bytes, and compacting keeps only the last ones
+  for ( int round = 0; round < 200; round++ ) {
+    value[0] = 'a' + round % 26;
+    TableGuard g( table );
+    table->set( "abc123", value );
+    table->set( "xyz456", value );
+    table->commit_changes();
+  }
+  ASSERT( table->compact() > 0 );
+  ASSERT( 0 == table->compact() );
+
+  TableGuard g( table );
+  ASSERT( value == table->get( "abc123" ) );
+  ASSERT( value == table->get( "xyz456" ) );
+}
+
+void test_table_directory_concurrent( TestObjs *objs )
+{
+  // Writers race to create the same names, growing the directory many times, while
+  // readers look names up without locking. (Run under ThreadSanitizer to check the
+  // directory's memory ordering: g++ -fsanitize=thread.)
+  const int NUM_NAMES = 2000;
+  const int NUM_WRITERS = 4;
+  const int NUM_READERS = 2;
+
+  TableDirectory directory;
+  Table *table = objs->invoices;
+  std::vector<std::string> names;
+  for ( int i = 0; i < NUM_NAMES; i++ ) { names.push_back( "t" + std::to_string( i ) ); }
+
+  std::atomic<int> inserted( 0 );
+  std::atomic<bool> writers_done( false );
+  std::atomic<bool> consistent( true );
+
+  std::vector<std::thread> threads;
+  for ( int r = 0; r < NUM_READERS; r++ ) {
+    threads.emplace_back( [&]() {
+      // A name that was found once must be found from then on
+      std::vector<bool> seen( NUM_NAMES );
+      while ( !writers_done.load() ) {
+        for ( int i = 0; i < NUM_NAMES; i++ ) {
+          Table *found = directory.find( HashedKey( names[i] ) );
+          if ( found != nullptr && found != table ) { consistent = false; }
+          if ( found == nullptr && seen[i] ) { consistent = false; }
+          if ( found != nullptr ) { seen[i] = true; }
+        }
+      }
+    } );
+  }
+  std::vector<std::thread> writers;
+  for ( int w = 0; w < NUM_WRITERS; w++ ) {
+    writers.emplace_back( [&, w]() {
+      for ( int i = 0; i < NUM_NAMES; i++ ) {
+        if ( directory.insert( names[(i + w * 500) % NUM_NAMES], table ) ) { inserted++; }
+      }
+    } );
+  }
+  for ( auto it = writers.begin(); it != writers.end(); it++ ) { it->join(); }
+  writers_done = true;
+  for ( auto it = threads.begin(); it != threads.end(); it++ ) { it->join(); }
+
+  ASSERT( consistent.load() );
+  ASSERT( NUM_NAMES == inserted.load() );
+  ASSERT( size_t( NUM_NAMES ) == directory.size() );
+  for ( int i = 0; i < NUM_NAMES; i++ ) {
+    ASSERT( table == directory.find( HashedKey( names[i] ) ) );
+  }
+  ASSERT( nullptr == directory.find( HashedKey( "missing" ) ) );
+
+  size_t count = 0;
+  directory.for_each( [&count]( const std::string &, Table * ) { count++; } );
+  ASSERT( size_t( NUM_NAMES ) == count );
+}
+
+void test_wal_recover( TestObjs * )
+{
+  const std::string path = "unit_tests_wal.log";
+  unlink( path.c_str() );
+
+  // Nothing to recover from a log that does not exist yet
+  std::vector<std::string> changes;
+  auto collect = [&changes]( WriteAheadLog::Op op, std::string_view table, std::string_view key, std::string_view value ) {
+    changes.push_back( std::string( 1, static_cast<char>( op ) ) + " " + std::string( table ) + " " +
+                       std::string( key ) + " " + std::string( value ) );
+  };
+  ASSERT( 0 == WriteAheadLog::recover( path, 0, collect ) );
+
+  // Each mode's records survive closing the log, buffered ones included
+  WriteAheadLog::Durability modes[] = { WriteAheadLog::Durability::EVERY_COMMIT,
+                                        WriteAheadLog::Durability::GROUP_COMMIT,
+                                        WriteAheadLog::Durability::PERIODIC };
+  for ( WriteAheadLog::Durability mode : modes ) {
+    WriteAheadLog log( path, mode, 1000 );
+    std::string record;
+    WriteAheadLog::append_create( record, "invoices" );
+    log.commit( record );
+
+    // A transaction's changes to several tables are one record
+    record.clear();
+    WriteAheadLog::append_set( record, "invoices", "abc123", "1000" );
+    WriteAheadLog::append_set( record, "accounts", "alice", "" );
+    log.commit( record );
+  }
+  ASSERT( 6 == WriteAheadLog::recover( path, 0, collect ) );
+  ASSERT( 9 == changes.size() );
+  ASSERT( "C invoices  " == changes[0] );
+  ASSERT( "S invoices abc123 1000" == changes[1] );
+  ASSERT( "S accounts alice " == changes[2] );
+
+  // A record torn by a crash is cut off, and the next records follow the last good one
+  {
+    std::ofstream torn( path, std::ios::app | std::ios::binary );
+    torn << "torn record";
+  }
+  changes.clear();
+  ASSERT( 6 == WriteAheadLog::recover( path, 0, collect ) );
+  unsigned long long suffix_start;
+  {
+    WriteAheadLog log( path, WriteAheadLog::Durability::EVERY_COMMIT );
+    suffix_start = log.end();
+    std::string record;
+    WriteAheadLog::append_set( record, "invoices", "xyz456", "2000" );
+    log.commit( record );
+  }
+  changes.clear();
+  ASSERT( 7 == WriteAheadLog::recover( path, 0, collect ) );
+  ASSERT( "S invoices xyz456 2000" == changes.back() );
+
+  // Recovery can also start where a record starts, such as where a snapshot left off
+  changes.clear();
+  ASSERT( 1 == WriteAheadLog::recover( path, suffix_start, collect ) );
+  ASSERT( 1 == changes.size() );
+
+  unlink( path.c_str() );
+}
+
+void test_wal_rewrite( TestObjs * )
+{
+  const std::string path = "unit_tests_rewrite.log";
+  const std::string tmp_path = path + ".rewrite";
+  unlink( path.c_str() );
+
+  std::map<std::string, std::string> recovered;
+  auto collect = [&recovered]( WriteAheadLog::Op op, std::string_view table, std::string_view key, std::string_view value ) {
+    if ( op == WriteAheadLog::Op::SET ) { recovered[std::string( table ) + " " + std::string( key )] = value; }
+  };
+  auto file_size = [&path]() {
+    std::ifstream in( path, std::ios::binary | std::ios::ate );
+    return (long long) in.tellg();
+  };
+
+  // Counters SET over and over, and the records committed during and after the rewrite
+  const int NUM_KEYS = 100, NUM_ROUNDS = 10;
+  long long size_before;
+  {
+    WriteAheadLog log( path, WriteAheadLog::Durability::PERIODIC, 1000 );
+    Table counters( "counters", 4 );
+    std::string record;
+    WriteAheadLog::append_create( record, "counters" );
+    log.commit( record );
+    for ( int round = 0; round < NUM_ROUNDS; round++ ) {
+      for ( int i = 0; i < NUM_KEYS; i++ ) {
+        record.clear();
+        WriteAheadLog::append_set( record, "counters", "key" + std::to_string( i ), std::to_string( round ) );
+        log.commit( record );
+        counters.restore( "key" + std::to_string( i ), std::to_string( round ) );
+      }
+    }
+
+    unsigned long long from = log.end();
+    ASSERT( NUM_KEYS == WriteAheadLog::write_compacted( tmp_path, { &counters } ) );
+    record.clear();
+    WriteAheadLog::append_create( record, "late" );
+    WriteAheadLog::append_set( record, "late", "key0", "during" );
+    WriteAheadLog::append_set( record, "counters", "key0", "during" );
+    log.commit( record );
+    ASSERT( log.sync() );
+    size_before = file_size();
+
+    // A rewritten log that is not there leaves the log as it was
+    try {
+      log.replace( "unit_tests_missing.log", from );
+      FAIL( "Replacing the log with a missing file should throw" );
+    } catch ( CommException &ex ) {
+      // Good
+    }
+    ASSERT( size_before == file_size() );
+
+    log.replace( tmp_path, from );
+    record.clear();
+    WriteAheadLog::append_set( record, "counters", "key1", "after" );
+    log.commit( record );
+  }
+  ASSERT( access( tmp_path.c_str(), F_OK ) != 0 );
+  ASSERT( file_size() < size_before / 5 );
+
+  // One CREATE and one SET per key, the record committed during the rewrite, and the one after
+  ASSERT( 1 + NUM_KEYS + 1 + 1 == WriteAheadLog::recover( path, 0, collect ) );
+  ASSERT( NUM_KEYS + 1 == recovered.size() );
+  ASSERT( "during" == recovered["counters key0"] );
+  ASSERT( "after" == recovered["counters key1"] );
+  ASSERT( "9" == recovered["counters key2"] );
+  ASSERT( "during" == recovered["late key0"] );
+
+  unlink( path.c_str() );
+}
+
+void test_snapshot( TestObjs * )
+{
+  const std::string path = "unit_tests.snapshot";
+  unlink( path.c_str() );
+
+  std::vector<std::unique_ptr<Table>> loaded;
+  auto open_table = [&loaded]( const std::string &name ) {
+    loaded.emplace_back( new Table( name ) );
+    return loaded.back().get();
+  };
+  ParallelRestore restorer( 2 );
+  unsigned long long log_end = 0, num_pairs = 0;
+  ASSERT( !Snapshot::load( path, open_table, restorer, log_end, num_pairs ) );
+
+  // Enough pairs to fill several blocks, and a table with none
+  const int NUM_KEYS = 100000;
+  Table invoices( "invoices", 4 ), accounts( "accounts" );
+  for ( int i = 0; i < NUM_KEYS; i++ ) {
+    invoices.restore( "key" + std::to_string( i ), "value" + std::to_string( i ) );
+  }
+  ASSERT( NUM_KEYS == Snapshot::write( path, 1234, { &invoices, &accounts } ) );
+
+  ASSERT( Snapshot::load( path, open_table, restorer, log_end, num_pairs ) );
+  restorer.finish();
+  ASSERT( 1234 == log_end );
+  ASSERT( NUM_KEYS == num_pairs );
+  ASSERT( 2 == loaded.size() );
+  ASSERT( "invoices" == loaded[0]->get_name() );
+  ASSERT( "accounts" == loaded[1]->get_name() );
+  loaded[0]->lock();
+  ASSERT( "value0" == loaded[0]->get( "key0" ) );
+  ASSERT( "value99999" == loaded[0]->get( "key99999" ) );
+  loaded[0]->unlock();
+
+  // A damaged byte makes the whole snapshot unusable, rather than silently losing pairs
+  {
+    std::fstream damaged( path, std::ios::in | std::ios::out | std::ios::binary );
+    damaged.seekg( 100000 );
+    char byte = damaged.get();
+    damaged.seekp( 100000 );
+    damaged.put( byte ^ 1 );
+  }
+  loaded.clear();
+  try {
+    Snapshot::load( path, open_table, restorer, log_end, num_pairs );
+    FAIL( "No exception thrown loading a damaged snapshot" );
+  } catch ( CommException &ex ) {
+    // Good
+  }
+
+  unlink( path.c_str() );
+}
+
+void test_parallel_restore( TestObjs * )
+{
+  // Each key is restored several times, and must end up with the value routed last
+  const int NUM_KEYS = 20000;
+  const int NUM_ROUNDS = 5;
+  Table invoices( "invoices" ), accounts( "accounts", 1 );
+  {
+    ParallelRestore restorer( 3 );
+    for ( int round = 0; round < NUM_ROUNDS; round++ ) {
+      for ( int i = 0; i < NUM_KEYS; i++ ) {
+        std::string key = "key" + std::to_string( i );
+        restorer.restore( &invoices, HashedKey( key ), std::to_string( round ) );
+        restorer.restore( &accounts, HashedKey( key ), std::to_string( round * i ) );
+      }
+    }
+    restorer.finish();
+
+    invoices.lock();
+    accounts.lock();
+    for ( int i = 0; i < NUM_KEYS; i++ ) {
+      std::string key = "key" + std::to_string( i );
+      ASSERT( std::to_string( NUM_ROUNDS - 1 ) == invoices.get( key ) );
+      ASSERT( std::to_string( ( NUM_ROUNDS - 1 ) * i ) == accounts.get( key ) );
+    }
+    invoices.unlock();
+    accounts.unlock();
+
+    // The workers can go on restoring after a finish
+    restorer.restore( &invoices, HashedKey( "key0" ), "later" );
+  }
+  invoices.lock();
+  ASSERT( "later" == invoices.get( "key0" ) );
+  invoices.unlock();
+}
+
+void test_mapped_snapshot( TestObjs * )
+{
+  const std::string path = "unit_tests_mapped.snapshot";
+  unlink( path.c_str() );
+  ASSERT( nullptr == MappedSnapshot::open( path ) );
+
+  const int NUM_KEYS = 10000;
+  Table invoices( "invoices" ), accounts( "accounts" );
+  for ( int i = 0; i < NUM_KEYS; i++ ) {
+    invoices.restore( "key" + std::to_string( i ), "value" + std::to_string( i ) );
+  }
+  Snapshot::write( path, 99, { &invoices, &accounts } );
+
+  MappedSnapshot *snapshot = MappedSnapshot::open( path );
+  ASSERT( nullptr != snapshot );
+  ASSERT( 99 == snapshot->get_log_end() );
+  ASSERT( NUM_KEYS == snapshot->get_num_pairs() );
+  ASSERT( 2 == snapshot->get_tables().size() );
+  ASSERT( "accounts" == snapshot->get_tables()[1]->get_name() );
+
+  // Every pair is served from the mapping
+  Table mapped( "invoices" );
+  mapped.set_image( snapshot->get_tables()[0] );
+  mapped.lock();
+  for ( int i = 0; i < NUM_KEYS; i++ ) {
+    ASSERT( "value" + std::to_string( i ) == mapped.get( "key" + std::to_string( i ) ) );
+  }
+  ASSERT( !mapped.has_key( "key" + std::to_string( NUM_KEYS ) ) );
+
+  // Pairs committed later replace the image's, and the table still has each key once
+  mapped.set( "key0", "changed" );
+  mapped.set( "new", "pair" );
+  mapped.commit_changes();
+  ASSERT( "changed" == mapped.get( "key0" ) );
+  ASSERT( "pair" == mapped.get( "new" ) );
+  size_t count = 0;
+  mapped.for_each_pair( [&count]( std::string_view, std::string_view ) { count++; } );
+  ASSERT( NUM_KEYS + 1 == count );
+  mapped.unlock();
+
+  delete snapshot;
+  unlink( path.c_str() );
+}
@@ -0,0 +1,54 @@
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "csapp.h"
+#include "unix_socket.h"
+
+namespace {
+  /* Fills in the address of a socket file. Returns false if the path is too long. */
+  bool unix_address(const std::string &path, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) { return false; }
+    memcpy(addr.sun_path, path.data(), path.size());
+    return true;
+  }
+}
+
+int open_unix_listenfd(const std::string &path, int backlog) {
+  sockaddr_un addr;
+  if (!unix_address(path, addr)) { return -1; }
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) { return -1; }
+
+  // A socket file outlives the server that bound it, so the path is reused
+  unlink(path.c_str());
+  if (bind(listen_fd, (sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, backlog) < 0) {
+    close(listen_fd);
+    return -1;
+  }
+  return listen_fd;
+}
+
+
+int open_unix_clientfd(const std::string &path) {
+  sockaddr_un addr;
+  if (!unix_address(path, addr)) { return -1; }
+
+  int client_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (client_fd < 0) { return -1; }
+
+  if (connect(client_fd, (sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(client_fd);
+    return -1;
+  }
+  return client_fd;
+}
+
+
+int open_server_clientfd(const std::string &hostname, const std::string &port, const std::string &socket_path) {
+  if (!socket_path.empty()) { return open_unix_clientfd(socket_path); }
+  return open_clientfd(hostname.data(), port.data());
+}
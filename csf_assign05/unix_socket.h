@@ -0,0 +1,30 @@
+#ifndef UNIX_SOCKET_H
+#define UNIX_SOCKET_H
+
+#include <string>
+
+/*
+ * Unix domain stream sockets, for clients on the same host as the server and for the
+ * hot restart control socket. They work like csapp's open_listenfd/open_clientfd, but
+ * skip the TCP loopback stack.
+ */
+
+/*
+ * Opens a socket listening at path, replacing any stale socket file.
+ * @return The socket, or -1 on failure.
+*/
+int open_unix_listenfd(const std::string &path, int backlog);
+
+/*
+ * Connects to the socket listening at path.
+ * @return The socket, or -1 if nothing is listening there.
+*/
+int open_unix_clientfd(const std::string &path);
+
+/*
+ * Connects to a server at socket_path if it is not empty, or at hostname:port otherwise.
+ * @return The socket, or -1 on failure.
+*/
+int open_server_clientfd(const std::string &hostname, const std::string &port, const std::string &socket_path);
+
+#endif // UNIX_SOCKET_H
@@ -0,0 +1,255 @@
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include "uring.h"
+
+namespace {
+  // user_data of the trial operations submitted by probe_multishot
+  const unsigned long long PROBE_ACCEPT = 1;
+  const unsigned long long PROBE_RECV = 2;
+  const unsigned long long PROBE_CANCEL = 3;
+
+  unsigned load_acquire( unsigned *p ) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+  void store_release( unsigned *p, unsigned v ) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+}
+
+IoUring::IoUring()
+  : ring_fd(-1)
+  , sq_head(nullptr), sq_tail(nullptr), sq_mask(0), sq_entries(0), sq_array(nullptr)
+  , sqes(nullptr), sqe_tail(0), sqe_submitted(0)
+  , cq_head(nullptr), cq_tail(nullptr), cq_mask(0), cqes(nullptr)
+  , sq_ring_ptr(MAP_FAILED), sq_ring_size(0), cq_ring_ptr(MAP_FAILED), cq_ring_size(0), sqes_size(0)
+  , buf_ring(nullptr), buf_ring_size(0), buffers(nullptr), num_buffers(0), buffer_size(0)
+  , buf_ring_tail(0)
+{
+}
+
+IoUring::~IoUring()
+{
+  if (buf_ring != nullptr) { munmap(buf_ring, buf_ring_size); }
+  delete[] buffers;
+  if (sqes != nullptr) { munmap(sqes, sqes_size); }
+  if (cq_ring_ptr != MAP_FAILED && cq_ring_ptr != sq_ring_ptr) { munmap(cq_ring_ptr, cq_ring_size); }
+  if (sq_ring_ptr != MAP_FAILED) { munmap(sq_ring_ptr, sq_ring_size); }
+  if (ring_fd >= 0) { close(ring_fd); }
+}
+
+bool IoUring::init( unsigned entries, unsigned num_buffers_, unsigned buffer_size_ )
+{
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring_fd < 0) { return false; }
+
+  // Map the submission and completion rings (a single mapping on kernels that support it)
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && cq_ring_size > sq_ring_size) { sq_ring_size = cq_ring_size; }
+
+  sq_ring_ptr = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring_ptr == MAP_FAILED) { return false; }
+
+  if (single_mmap) { cq_ring_ptr = sq_ring_ptr; }
+  else {
+    cq_ring_ptr = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring_ptr == MAP_FAILED) { return false; }
+  }
+
+  sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  void *sqes_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd, IORING_OFF_SQES);
+  if (sqes_ptr == MAP_FAILED) { return false; }
+  sqes = static_cast<io_uring_sqe *>( sqes_ptr );
+
+  char *sq = static_cast<char *>( sq_ring_ptr );
+  sq_head = reinterpret_cast<unsigned *>( sq + params.sq_off.head );
+  sq_tail = reinterpret_cast<unsigned *>( sq + params.sq_off.tail );
+  sq_mask = *reinterpret_cast<unsigned *>( sq + params.sq_off.ring_mask );
+  sq_entries = params.sq_entries;
+  sq_array = reinterpret_cast<unsigned *>( sq + params.sq_off.array );
+  sqe_tail = *sq_tail;
+  sqe_submitted = sqe_tail;
+
+  char *cq = static_cast<char *>( cq_ring_ptr );
+  cq_head = reinterpret_cast<unsigned *>( cq + params.cq_off.head );
+  cq_tail = reinterpret_cast<unsigned *>( cq + params.cq_off.tail );
+  cq_mask = *reinterpret_cast<unsigned *>( cq + params.cq_off.ring_mask );
+  cqes = reinterpret_cast<io_uring_cqe *>( cq + params.cq_off.cqes );
+
+  // Register the provided buffer ring, which must be page aligned
+  num_buffers = num_buffers_;
+  buffer_size = buffer_size_;
+  buf_ring_size = num_buffers * sizeof(io_uring_buf);
+  void *ring_mem = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring_mem == MAP_FAILED) { return false; }
+  buf_ring = static_cast<io_uring_buf_ring *>( ring_mem );
+
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long) buf_ring;
+  reg.ring_entries = num_buffers;
+  reg.bgid = BUFFER_GROUP;
+  if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) { return false; }
+
+  buffers = new char[(size_t) num_buffers * buffer_size];
+  for (unsigned i = 0; i < num_buffers; i++) { recycle_buffer(i); }
+
+  return probe_multishot();
+}
+
+
+bool IoUring::probe_multishot()
+{
+  // A listener with an abstract address picked by the kernel, and a connected pair of sockets,
+  // on which neither operation can complete before it is cancelled
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  int pair[2] = { -1, -1 };
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  bool ok = listen_fd >= 0 && socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0 &&
+            bind(listen_fd, reinterpret_cast<sockaddr *>( &addr ), sizeof(sa_family_t)) == 0 &&
+            listen(listen_fd, 1) == 0;
+
+  if (ok) {
+    // Kernels without multishot accepts (5.19) or receives (6.0) reject the flags with -EINVAL
+    prep_multishot_accept(listen_fd, PROBE_ACCEPT);
+    prep_multishot_recv(pair[0], PROBE_RECV);
+    ok = submit_and_wait(0) >= 0;
+  }
+
+  if (ok) {
+    prep_cancel(PROBE_ACCEPT, PROBE_CANCEL);
+    prep_cancel(PROBE_RECV, PROBE_CANCEL);
+
+    // Both cancellations complete, and so does each trial operation, for the last time
+    unsigned remaining = 4;
+    while (ok && remaining > 0) {
+      ok = submit_and_wait(1) >= 0;
+      io_uring_cqe *cqe;
+      while (ok && remaining > 0 && (cqe = peek_cqe()) != nullptr) {
+        if (cqe->user_data != PROBE_CANCEL && cqe->res == -EINVAL) { ok = false; }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) { remaining--; }
+        cqe_seen();
+      }
+    }
+  }
+
+  if (listen_fd >= 0) { close(listen_fd); }
+  if (pair[0] >= 0) { close(pair[0]); }
+  if (pair[1] >= 0) { close(pair[1]); }
+  return ok;
+}
+
+io_uring_sqe *IoUring::get_sqe()
+{
+  if (sqe_tail - load_acquire(sq_head) >= sq_entries) { submit_and_wait(0); }
+
+  unsigned index = sqe_tail & sq_mask;
+  io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[index] = index;
+  sqe_tail++;
+  return sqe;
+}
+
+int IoUring::submit_and_wait( unsigned min_complete )
+{
+  store_release(sq_tail, sqe_tail);
+  unsigned to_submit = sqe_tail - sqe_submitted;
+  sqe_submitted = sqe_tail;
+
+  unsigned flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+    // Entries are consumed even if the wait is interrupted
+    to_submit = 0;
+  } while (ret < 0 && errno == EINTR);
+
+  return ret;
+}
+
+io_uring_cqe *IoUring::peek_cqe()
+{
+  unsigned head = *cq_head;
+  if (head == load_acquire(cq_tail)) { return nullptr; }
+  return &cqes[head & cq_mask];
+}
+
+void IoUring::cqe_seen()
+{
+  store_release(cq_head, *cq_head + 1);
+}
+
+void IoUring::recycle_buffer( unsigned buffer_id )
+{
+  // The header's flexible array member is laid out differently when compiled as C++,
+  // so the ring entries are indexed from the start of the ring directly
+  io_uring_buf *bufs = reinterpret_cast<io_uring_buf *>( buf_ring );
+  io_uring_buf *buf = &bufs[buf_ring_tail & (num_buffers - 1)];
+  buf->addr = (unsigned long) get_buffer(buffer_id);
+  buf->len = buffer_size;
+  buf->bid = buffer_id;
+  buf_ring_tail++;
+  __atomic_store_n(&buf_ring->tail, buf_ring_tail, __ATOMIC_RELEASE);
+}
+
+void IoUring::prep_multishot_accept( int listen_fd, unsigned long long user_data )
+{
+  io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = user_data;
+}
+
+void IoUring::prep_multishot_recv( int fd, unsigned long long user_data )
+{
+  io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUFFER_GROUP;
+  sqe->user_data = user_data;
+}
+
+void IoUring::prep_send( int fd, const void *data, size_t len, unsigned long long user_data )
+{
+  io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long) data;
+  sqe->len = len;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = user_data;
+}
+
+void IoUring::prep_cancel( unsigned long long target, unsigned long long user_data )
+{
+  io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = user_data;
+}
+
+void IoUring::prep_timeout( const __kernel_timespec *interval, unsigned long long user_data )
+{
+  io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (unsigned long) interval;
+  sqe->len = 1;
+  sqe->user_data = user_data;
+}
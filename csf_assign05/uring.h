@@ -0,0 +1,98 @@
+#ifndef URING_H
+#define URING_H
+
+#include <cstddef>
+#include <linux/io_uring.h>
+
+/* 
+ * Minimal wrapper around the io_uring system calls (liburing is not a dependency).
+ * It owns one submission/completion ring pair and one ring of provided receive
+ * buffers. Only one thread may use an IoUring at a time.
+ */
+class IoUring {
+private:
+  int ring_fd;
+
+  // Submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *sq_array;
+  io_uring_sqe *sqes;
+  unsigned sqe_tail;
+  unsigned sqe_submitted;
+
+  // Completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  io_uring_cqe *cqes;
+
+  // Memory mappings to release on destruction
+  void *sq_ring_ptr;
+  size_t sq_ring_size;
+  void *cq_ring_ptr;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  // Provided buffers for multishot receives
+  io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  char *buffers;
+  unsigned num_buffers;
+  unsigned buffer_size;
+  unsigned short buf_ring_tail;
+
+  /* Tries a multishot accept and a multishot receive, then cancels them. Returns false if the
+  kernel rejects either. */
+  bool probe_multishot();
+
+  // copy constructor and assignment operator are prohibited
+  IoUring( const IoUring & );
+  IoUring &operator=( const IoUring & );
+
+public:
+  // Buffer group id of the provided receive buffers
+  static const unsigned short BUFFER_GROUP = 0;
+
+  IoUring();
+  ~IoUring();
+
+  /* 
+   * Sets up the rings and registers num_buffers (a power of two) receive buffers of
+   * buffer_size bytes. Returns false if the kernel lacks any of the needed features,
+   * including multishot accepts and receives.
+   */
+  bool init( unsigned entries, unsigned num_buffers, unsigned buffer_size );
+
+  /* Returns a zeroed submission entry, submitting queued entries first if the queue is full. */
+  io_uring_sqe *get_sqe();
+
+  /* Submits all queued entries and waits until at least min_complete completions are ready. */
+  int submit_and_wait( unsigned min_complete );
+
+  /* Returns the oldest unconsumed completion, or nullptr if there is none. */
+  io_uring_cqe *peek_cqe();
+
+  /* Marks the completion returned by peek_cqe as consumed. */
+  void cqe_seen();
+
+  /* Returns the start of a provided buffer selected by the kernel for a receive. */
+  char *get_buffer( unsigned buffer_id ) { return buffers + (size_t) buffer_id * buffer_size; }
+
+  /* Gives a provided buffer back to the kernel once its data has been consumed. */
+  void recycle_buffer( unsigned buffer_id );
+
+  void prep_multishot_accept( int listen_fd, unsigned long long user_data );
+  void prep_multishot_recv( int fd, unsigned long long user_data );
+  void prep_send( int fd, const void *data, size_t len, unsigned long long user_data );
+
+  /* Queues the cancellation of the operation submitted with user_data target. */
+  void prep_cancel( unsigned long long target, unsigned long long user_data );
+
+  /* Queues a timer that completes (with -ETIME) after interval, which must stay valid until submitted. */
+  void prep_timeout( const __kernel_timespec *interval, unsigned long long user_data );
+};
+
+#endif // URING_H
@@ -39,6 +39,10 @@ void ValueStack::pop() {
   stack.pop();
 }
 
+void ValueStack::clear() {
+  stack = std::stack<std::string>();
+}
+
 int ValueStack::get_size() {
   return stack.size();
 }
\ No newline at end of file
@@ -19,6 +19,8 @@ public:
   std::string get_top() const;
   void pop();
 
+  void clear();
+
   int get_size();
 };
 
@@ -0,0 +1,464 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "csapp.h"
+#include "exceptions.h"
+#include "hashed_key.h"
+#include "table.h"
+#include "wal.h"
+
+namespace {
+  // A rewrite copies the records appended meanwhile without holding off commits until no more
+  // than this many bytes are left
+  const unsigned long long CATCH_UP_BYTES = 256 * 1024;
+
+  // A rewritten log is fsynced every so many bytes, so that the commits' own fsyncs never wait
+  // behind writing back all of it at once
+  const unsigned long long REWRITE_SYNC_BYTES = 4 * 1024 * 1024;
+
+  // The file a rewrite replaced is shrunk by this many bytes at a time before it is closed
+  const off_t RELEASE_STEP_BYTES = 16 * 1024 * 1024;
+
+  // Each record starts with the length of its bytes and their checksum
+  struct RecordHeader {
+    unsigned long long length;
+    unsigned long long checksum;
+  };
+
+  unsigned long long checksum_of( std::string_view bytes ) {
+    return HashedKey::hash_of(bytes);
+  }
+
+  void append_record( std::string &out, const std::string &record ) {
+    RecordHeader header = { record.size(), checksum_of(record) };
+    out.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.append(record);
+  }
+
+  void append_string( std::string &record, std::string_view bytes ) {
+    unsigned len = bytes.size();
+    record.append(reinterpret_cast<const char *>(&len), sizeof(len));
+    record.append(bytes);
+  }
+
+  // Reads a string written by append_string, and advances pos past it
+  bool read_string( const std::string &record, size_t &pos, std::string_view &out ) {
+    unsigned len;
+    if (record.size() - pos < sizeof(len)) { return false; }
+    memcpy(&len, record.data() + pos, sizeof(len));
+    pos += sizeof(len);
+    if (record.size() - pos < len) { return false; }
+    out = std::string_view(record.data() + pos, len);
+    pos += len;
+    return true;
+  }
+
+  bool write_all( int fd, const std::string &data ) {
+    size_t written = 0;
+    while (written < data.size()) {
+      ssize_t n = write(fd, data.data() + written, data.size() - written);
+      if (n < 0 && errno == EINTR) { continue; }
+      if (n <= 0) { return false; }
+      written += n;
+    }
+    return true;
+  }
+
+  // Copies the bytes of in_fd from offset from up to offset to onto the end of out_fd
+  bool copy_range( int in_fd, int out_fd, unsigned long long from, unsigned long long to ) {
+    std::string chunk;
+    while (from < to) {
+      chunk.resize(std::min(to - from, 1ULL << 20));
+      ssize_t n = pread(in_fd, &chunk[0], chunk.size(), from);
+      if (n < 0 && errno == EINTR) { continue; }
+      if (n <= 0) { return false; }
+      chunk.resize(n);
+      if (!write_all(out_fd, chunk)) { return false; }
+      from += n;
+    }
+    return true;
+  }
+
+  // Closes the last descriptor of a file that was replaced, after freeing its blocks a step at a
+  // time, so that the fsyncs of commits made meanwhile never wait for all of them to be freed at once
+  void release_file( int fd ) {
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+      for (off_t size = st.st_size; size > 0; size -= std::min<off_t>(size, RELEASE_STEP_BYTES)) {
+        if (ftruncate(fd, size - std::min<off_t>(size, RELEASE_STEP_BYTES)) != 0) { break; }
+      }
+    }
+    close(fd);
+  }
+
+  // A rename is only durable once the directory holding both names is
+  bool sync_directory_of( const std::string &path ) {
+    size_t slash = path.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    bool synced = dir_fd >= 0 && fsync(dir_fd) == 0;
+    if (dir_fd >= 0) { close(dir_fd); }
+    return synced;
+  }
+}
+
+WriteAheadLog::WriteAheadLog( const std::string &path, Durability durability, int period_ms )
+  : m_fd( open( path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 ) )
+  , m_path( path )
+  , m_durability( durability )
+  , m_period_ms( period_ms )
+  , m_start_offset( 0 )
+  , m_appended_bytes( 0 )
+  , m_durable_bytes( 0 )
+  , m_flushing( false )
+  , m_failed( false )
+  , m_stopping( false )
+  , m_has_flusher( false )
+{
+  struct stat st;
+  if (m_fd < 0 || fstat(m_fd, &st) != 0) {
+    if (m_fd >= 0) { close(m_fd); }
+    throw CommException("Could not open the log " + path);
+  }
+  m_start_offset = st.st_size;
+
+  pthread_mutex_init(&m_mutex, nullptr);
+  pthread_cond_init(&m_durable_cond, nullptr);
+
+  if (pthread_create(&m_flusher, nullptr, flusher_worker, this) != 0) {
+    close(m_fd);
+    throw CommException("Could not create log flusher thread");
+  }
+  m_has_flusher = true;
+}
+
+WriteAheadLog::~WriteAheadLog()
+{
+  if (m_has_flusher) {
+    pthread_mutex_lock(&m_mutex);
+    m_stopping = true;
+    pthread_cond_broadcast(&m_durable_cond);
+    pthread_mutex_unlock(&m_mutex);
+    pthread_join(m_flusher, nullptr);
+  }
+
+  sync();
+  close(m_fd);
+  pthread_cond_destroy(&m_durable_cond);
+  pthread_mutex_destroy(&m_mutex);
+}
+
+void WriteAheadLog::append_create( std::string &record, std::string_view table )
+{
+  record += static_cast<char>(Op::CREATE);
+  append_string(record, table);
+}
+
+void WriteAheadLog::append_set( std::string &record, std::string_view table, std::string_view key,
+                                std::string_view value )
+{
+  record += static_cast<char>(Op::SET);
+  append_string(record, table);
+  append_string(record, key);
+  append_string(record, value);
+}
+
+bool WriteAheadLog::flush_locked()
+{
+  if (m_failed) { return false; }
+  if (m_buffer.empty()) { return true; }
+
+  // Records appended while this batch is written wait in a new buffer, for the next batch
+  std::string batch;
+  batch.swap(m_buffer);
+  unsigned long long batch_end = m_appended_bytes;
+  m_flushing = true;
+  pthread_mutex_unlock(&m_mutex);
+
+  bool written = write_all(m_fd, batch) && fdatasync(m_fd) == 0;
+
+  pthread_mutex_lock(&m_mutex);
+  m_flushing = false;
+  if (written) { m_durable_bytes = batch_end; }
+  else { m_failed = true; }
+  pthread_cond_broadcast(&m_durable_cond);
+  return written;
+}
+
+void WriteAheadLog::commit( const std::string &record )
+{
+  pthread_mutex_lock(&m_mutex);
+  append_record(m_buffer, record);
+  m_appended_bytes += sizeof(RecordHeader) + record.size();
+  unsigned long long record_end = m_appended_bytes;
+
+  bool durable = !m_failed;
+  if (m_durability == Durability::EVERY_COMMIT) {
+    // The mutex stays held, so each commit pays for its own fsync, unless the flusher thread
+    // (writing the records of commit_async) takes it along
+    while (durable && m_durable_bytes < record_end) {
+      if (m_flushing) {
+        pthread_cond_wait(&m_durable_cond, &m_mutex);
+        durable = !m_failed;
+        continue;
+      }
+      durable = write_all(m_fd, m_buffer) && fdatasync(m_fd) == 0;
+      m_buffer.clear();
+      if (durable) { m_durable_bytes = record_end; }
+      else { m_failed = true; }
+    }
+  } else if (m_durability == Durability::GROUP_COMMIT) {
+    // Whoever finds no write under way writes everything buffered, for itself and for
+    // the committers that arrived while the previous fsync ran
+    while (durable && m_durable_bytes < record_end) {
+      if (m_flushing) { pthread_cond_wait(&m_durable_cond, &m_mutex); }
+      else { flush_locked(); }
+      durable = !m_failed;
+    }
+  }
+  pthread_mutex_unlock(&m_mutex);
+
+  if (!durable) { throw OperationException("Could not write to the log."); }
+}
+
+unsigned long long WriteAheadLog::commit_async( const std::string &record )
+{
+  pthread_mutex_lock(&m_mutex);
+  bool failed = m_failed;
+  if (!failed) {
+    append_record(m_buffer, record);
+    m_appended_bytes += sizeof(RecordHeader) + record.size();
+
+    // The periodic flusher keeps to its period, but in the durable modes it writes at once
+    if (m_durability != Durability::PERIODIC) { pthread_cond_broadcast(&m_durable_cond); }
+  }
+  unsigned long long record_end = m_appended_bytes;
+  pthread_mutex_unlock(&m_mutex);
+
+  if (failed) { throw OperationException("Could not write to the log."); }
+  return record_end;
+}
+
+bool WriteAheadLog::is_durable( unsigned long long record_end )
+{
+  // A periodic commit is done once its record is buffered
+  if (m_durability == Durability::PERIODIC) { return true; }
+
+  pthread_mutex_lock(&m_mutex);
+  bool durable = m_durable_bytes >= record_end;
+  bool failed = m_failed;
+  pthread_mutex_unlock(&m_mutex);
+
+  if (!durable && failed) { throw OperationException("Could not write to the log."); }
+  return durable;
+}
+
+bool WriteAheadLog::sync()
+{
+  pthread_mutex_lock(&m_mutex);
+  while (m_flushing) { pthread_cond_wait(&m_durable_cond, &m_mutex); }
+  bool synced = flush_locked();
+  pthread_mutex_unlock(&m_mutex);
+  return synced;
+}
+
+unsigned long long WriteAheadLog::end()
+{
+  pthread_mutex_lock(&m_mutex);
+  unsigned long long offset = m_start_offset + m_appended_bytes;
+  pthread_mutex_unlock(&m_mutex);
+  return offset;
+}
+
+unsigned long long WriteAheadLog::write_compacted( const std::string &path, const std::vector<Table *> &tables )
+{
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) { throw CommException("Could not create the log " + path); }
+
+  // Every table is created before any of its pairs is set, as in the log being replaced
+  std::string batch, record;
+  for (auto it = tables.begin(); it != tables.end(); it++) {
+    record.clear();
+    append_create(record, (*it)->get_name());
+    append_record(batch, record);
+  }
+  bool written = write_all(fd, batch);
+  unsigned long long unsynced_bytes = 0;
+
+  unsigned long long num_pairs = 0;
+  for (auto it = tables.begin(); written && it != tables.end(); it++) {
+    Table *table = *it;
+    std::string name = table->get_name();
+
+    // The stripe is only locked while its pairs are copied, not while they are written
+    for (unsigned i = 0; written && i < table->get_num_stripes(); i++) {
+      batch.clear();
+      table->lock_stripe(i, true);
+      table->for_each_pair(i, [&batch, &record, &name, &num_pairs]( std::string_view key, std::string_view value ) {
+        record.clear();
+        append_set(record, name, key, value);
+        append_record(batch, record);
+        num_pairs++;
+      });
+      table->unlock_stripe(i);
+      written = write_all(fd, batch);
+
+      unsynced_bytes += batch.size();
+      if (written && unsynced_bytes >= REWRITE_SYNC_BYTES) {
+        written = fdatasync(fd) == 0;
+        unsynced_bytes = 0;
+      }
+    }
+  }
+  close(fd);
+
+  if (!written) { throw CommException("Could not write the log " + path); }
+  return num_pairs;
+}
+
+void WriteAheadLog::replace( const std::string &tmp_path, unsigned long long from )
+{
+  int in_fd = open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+  int out_fd = open(tmp_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+  bool copied = in_fd >= 0 && out_fd >= 0;
+
+  // Records are copied once they are written, in rounds that commits carry on during, until
+  // the last round is small enough to copy with them held off
+  unsigned long long copied_end = from;
+  while (copied) {
+    pthread_mutex_lock(&m_mutex);
+    unsigned long long written_end = m_start_offset + m_durable_bytes;
+    copied = !m_failed;
+    pthread_mutex_unlock(&m_mutex);
+    if (!copied || written_end <= copied_end + CATCH_UP_BYTES) { break; }
+    copied = copy_range(in_fd, out_fd, copied_end, written_end);
+    copied_end = written_end;
+  }
+  copied = copied && fdatasync(out_fd) == 0;
+
+  // With no write under way, everything not buffered is written, and the buffer is flushed to
+  // the new file later like it would have been to the old one (records in it from before from
+  // only repeat changes the rewritten log already holds)
+  pthread_mutex_lock(&m_mutex);
+  while (m_flushing) { pthread_cond_wait(&m_durable_cond, &m_mutex); }
+  unsigned long long written_end = m_start_offset + m_durable_bytes;
+  struct stat st;
+  copied = copied && !m_failed && copy_range(in_fd, out_fd, copied_end, written_end) &&
+           fdatasync(out_fd) == 0 && fstat(out_fd, &st) == 0;
+  bool replaced = copied && rename(tmp_path.c_str(), m_path.c_str()) == 0;
+  int old_fd = -1;
+  if (replaced) {
+    old_fd = m_fd;
+    m_fd = out_fd;
+    m_start_offset = st.st_size - m_durable_bytes;
+
+    // Commits made durable in the new file would be lost if the old one came back after a crash
+    if (!sync_directory_of(m_path)) { m_failed = true; }
+  }
+  bool failed = m_failed;
+  pthread_mutex_unlock(&m_mutex);
+
+  if (in_fd >= 0) { close(in_fd); }
+  if (old_fd >= 0) { release_file(old_fd); }
+  if (!replaced) {
+    if (out_fd >= 0) { close(out_fd); }
+    unlink(tmp_path.c_str());
+  }
+  if (!replaced || failed) { throw CommException("Could not replace the log " + m_path); }
+}
+
+void *WriteAheadLog::flusher_worker( void *arg )
+{
+  WriteAheadLog *log = static_cast<WriteAheadLog *>( arg );
+
+  pthread_mutex_lock(&log->m_mutex);
+  while (!log->m_stopping && log->m_durability != Durability::PERIODIC) {
+    // Records of commit_async are written as soon as no write is under way. A committer of
+    // commit that wakes up to find its record written by this thread has nothing left to do.
+    while (!log->m_stopping && (log->m_buffer.empty() || log->m_flushing || log->m_failed)) {
+      pthread_cond_wait(&log->m_durable_cond, &log->m_mutex);
+    }
+    if (!log->m_stopping) { log->flush_locked(); }
+  }
+
+  while (!log->m_stopping) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += log->m_period_ms / 1000;
+    deadline.tv_nsec += (log->m_period_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+    // Other signals on the condition (a sync finishing) do not cut the period short
+    int rc = 0;
+    while (!log->m_stopping && rc != ETIMEDOUT) {
+      rc = pthread_cond_timedwait(&log->m_durable_cond, &log->m_mutex, &deadline);
+    }
+    if (!log->m_flushing) { log->flush_locked(); }
+  }
+  pthread_mutex_unlock(&log->m_mutex);
+
+  return nullptr;
+}
+
+unsigned long long WriteAheadLog::recover( const std::string &path, unsigned long long from,
+                                           const std::function<void( Op, std::string_view, std::string_view,
+                                                                     std::string_view )> &fn )
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0 && errno == ENOENT && from == 0) { return 0; }
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) { throw CommException("Could not read the log " + path); }
+
+  // Starting past the end would let new records land before from, where the next recovery skips them
+  if ((unsigned long long) st.st_size < from || lseek(fd, from, SEEK_SET) != (off_t) from) {
+    close(fd);
+    throw CommException("The log " + path + " ends before the records still to recover");
+  }
+
+  rio_t log_buf;
+  rio_readinitb(&log_buf, fd);
+  unsigned long long num_records = 0;
+  off_t valid_end = from;
+  std::string record;
+
+  while (1) {
+    // A record cut short, or whose bytes do not match its checksum, was torn by a crash
+    RecordHeader header;
+    if (rio_readnb(&log_buf, &header, sizeof(header)) != sizeof(header)) { break; }
+    if (header.length > (unsigned long long) (st.st_size - valid_end - sizeof(header))) { break; }
+    record.resize(header.length);
+    if (rio_readnb(&log_buf, &record[0], header.length) != (ssize_t) header.length) { break; }
+    if (checksum_of(record) != header.checksum) { break; }
+
+    // Each change is its op, then each of its strings as a 32-bit length and the bytes
+    size_t pos = 0;
+    while (pos < record.size()) {
+      Op op = static_cast<Op>(record[pos++]);
+      std::string_view table, key, value;
+      bool valid = read_string(record, pos, table);
+      if (valid && op == Op::SET) { valid = read_string(record, pos, key) && read_string(record, pos, value); }
+      if (!valid || (op != Op::SET && op != Op::CREATE)) {
+        close(fd);
+        throw CommException("Corrupt record in the log " + path);
+      }
+      fn(op, table, key, value);
+    }
+
+    num_records++;
+    valid_end += sizeof(header) + header.length;
+  }
+  close(fd);
+
+  // New records must follow the last good one, not the torn one
+  if (valid_end < st.st_size && truncate(path.c_str(), valid_end) != 0) {
+    throw CommException("Could not truncate the log " + path);
+  }
+  return num_records;
+}
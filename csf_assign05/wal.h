@@ -0,0 +1,160 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <pthread.h>
+
+class Table;
+
+/*
+ * Append-only write-ahead log of committed changes, from which the server rebuilds its
+ * tables when it starts. Every commit (a CREATE, an autocommit SET, or a transaction's
+ * SETs to all of its tables) is one record, appended before the change is applied and
+ * answered, so a record is either recovered whole or not at all.
+ *
+ * Each record is framed by its length and a checksum of its bytes. A crash in the middle
+ * of an append leaves a torn record at the end of the log, which recovery detects and
+ * cuts off.
+ *
+ * When a commit returns depends on the durability mode:
+ *   EVERY_COMMIT  each commit writes and fsyncs its own record before returning
+ *   GROUP_COMMIT  a commit waits until its record is fsynced, and committers arriving
+ *                 while an fsync is under way share the next one
+ *   PERIODIC      a commit only buffers its record, and a background thread writes and
+ *                 fsyncs the buffer every period_ms, so up to that long of acknowledged
+ *                 commits can be lost in a crash (but never only part of one)
+ *
+ * An event loop cannot wait for an fsync without holding up every other client of its
+ * thread, so it commits with commit_async and polls is_durable instead. In the two durable
+ * modes, a background thread writes and fsyncs those records as soon as no write is under
+ * way, so the ones appended during an fsync share the next one.
+ *
+ * Every SET of a key stays in the log, so it grows far faster than the tables do. It is
+ * rewritten (see write_compacted and replace) to one record per live key, followed by the
+ * records committed while that was written, and the new file takes the old one's place
+ * without commits being held off for more than the last of those records.
+ */
+class WriteAheadLog {
+public:
+  enum class Durability {
+    EVERY_COMMIT,
+    GROUP_COMMIT,
+    PERIODIC,
+  };
+
+  /* Kinds of change a record holds. */
+  enum class Op : char {
+    CREATE = 'C',
+    SET = 'S',
+  };
+
+private:
+  int m_fd;
+  std::string m_path;
+  Durability m_durability;
+  int m_period_ms;
+
+  pthread_mutex_t m_mutex;
+
+  /* Signalled when records become durable, or the log fails. */
+  pthread_cond_t m_durable_cond;
+
+  /* Records appended but not yet handed to write(). */
+  std::string m_buffer;
+
+  /* Offset in the log file that m_appended_bytes counts from: its size when it was opened.
+  A rewrite moves it to where the counted bytes would have started in the new file, which
+  wraps around if that is shorter, as only the sum is an offset. */
+  unsigned long long m_start_offset;
+
+  /* Bytes of records appended, and of those that are fsynced, counted from when the log
+  was opened. A commit waits until m_durable_bytes reaches the end of its record. */
+  unsigned long long m_appended_bytes;
+  unsigned long long m_durable_bytes;
+
+  /* Whether a committer (the group's leader) or the flusher thread is writing. */
+  bool m_flushing;
+
+  /* Set once a write or fsync fails: the log can no longer promise anything, so every
+  later commit fails too. */
+  bool m_failed;
+
+  bool m_stopping;
+  bool m_has_flusher;
+  pthread_t m_flusher;
+
+  // copy constructor and assignment operator are prohibited
+  WriteAheadLog( const WriteAheadLog & );
+  WriteAheadLog &operator=( const WriteAheadLog & );
+
+  /* Writes and fsyncs the buffered records, with the mutex held on entry and on return
+  (but not while writing). Returns false if the log failed. */
+  bool flush_locked();
+
+  static void *flusher_worker( void *arg );
+
+public:
+  /* Opens (creating if needed) the log at path for appending. Throws a CommException if
+  it cannot. */
+  WriteAheadLog( const std::string &path, Durability durability, int period_ms = 0 );
+
+  /* Flushes whatever is buffered, and closes the log. */
+  ~WriteAheadLog();
+
+  /* Appends a change to a record being built, to be passed to commit. */
+  static void append_create( std::string &record, std::string_view table );
+  static void append_set( std::string &record, std::string_view table, std::string_view key,
+                          std::string_view value );
+
+  /* Appends record to the log, and returns once it is as durable as the mode promises.
+  Throws an OperationException if it cannot be written. */
+  void commit( const std::string &record );
+
+  /* Appends record to the log like commit, but returns at once, with the position
+  is_durable takes to tell when the record is as durable as the mode promises. Throws an
+  OperationException if the log has failed. */
+  unsigned long long commit_async( const std::string &record );
+
+  /* Whether the record commit_async returned record_end for is as durable as the mode
+  promises. Throws an OperationException if the log failed before it was. */
+  bool is_durable( unsigned long long record_end );
+
+  /* Writes and fsyncs every record appended so far, whatever the mode. Returns false if
+  the log failed. */
+  bool sync();
+
+  /* Offset in the log file just past the last record appended so far (durable or not).
+  Records appended later all start at or after it. */
+  unsigned long long end();
+
+  /* Writes a log to path that creates tables and SETs every committed pair of theirs, one
+  record per pair, for replace to put in place of this one. Each stripe is copied with only
+  that stripe locked (shared), as by Snapshot::write, so the rest of the log must be copied
+  after it from an offset the log had reached before this started.
+  @return The number of pairs written.
+  Throws a CommException if the file cannot be written. */
+  static unsigned long long write_compacted( const std::string &path, const std::vector<Table *> &tables );
+
+  /* Appends the records of this log from offset from (what end returned before the rewritten
+  log at tmp_path was started) to that log, moves it in place of this one, and appends every
+  later commit to it. Most records are copied while commits carry on, and only the last ones
+  with commits held off. Throws a CommException, after removing tmp_path, if the log could not
+  be replaced (and stays as it was); if the move is made but cannot be made durable, the log
+  fails like after a failed write. */
+  void replace( const std::string &tmp_path, unsigned long long from );
+
+  /* Reads the log at path from offset from, which must be where a record starts (0, or
+  what end returned), and calls fn( op, table, key, value ) for every change of every
+  complete record, in order (key and value are empty for a CREATE). A torn or corrupt
+  record ends the log: it and anything after it are cut off the file, so that new records
+  follow the last good one. Returns the number of records recovered; a missing log holds
+  none. Throws a CommException if the log cannot be read, or ends before from. */
+  static unsigned long long recover( const std::string &path, unsigned long long from,
+                                     const std::function<void( Op, std::string_view, std::string_view,
+                                                               std::string_view )> &fn );
+};
+
+#endif // WAL_H